@@ -0,0 +1,570 @@
+/*
+ * Benchmark of the module's hot paths without a server: compression,
+ * decompression, training sample collection, RDB save/load and appends to
+ * logs, over
+ * synthetic JSON, protobuf-like and HTML values of several sizes, with and
+ * without a dictionary and at several compression levels.
+ *
+ * Each result is written to stdout as one JSON object per line.
+ *
+ * Usage: bench [-t ms] [-s sizes] [-l levels] [-c corpora]
+ *
+ *   -t ms       Time spent on each case (default 100)
+ *   -s sizes    Comma separated value sizes in bytes
+ *   -l levels   Comma separated compression levels
+ *   -c corpora  Comma separated subset of json,proto,html
+ */
+
+#include "src/module.c"
+#include "bench/stub.c"
+
+#include <unistd.h>
+
+#define	BENCH_NVALUES		64	/* Distinct values per case */
+#define	BENCH_MIN_OPS		100
+#define	BENCH_MAX_OPS		(1 << 20)
+#define	BENCH_MAX_ARGS		16
+#define	BENCH_DICT_SIZE		(16 * 1024)
+#define	BENCH_DICT_SAMPLES	1000
+#define	BENCH_DICT_SAMPLE_SIZE	1024
+#define	BENCH_LOG_BLOCK_SIZE	(16 * 1024)
+#define	BENCH_LOG_MAX		(4 * 1024 * 1024)	/* Then start over */
+
+static const char *const words[] = {
+	"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+	"hotel", "india", "juliet", "kilo", "lima", "mike", "november",
+	"oscar", "papa", "quebec", "romeo", "sierra", "tango", "uniform",
+	"victor", "whiskey", "xray", "yankee", "zulu",
+};
+#define	NWORDS	(sizeof (words) / sizeof (words[0]))
+
+struct corpus {
+	const char *name;
+	size_t (*record)(char *, size_t, uint64_t *);
+};
+
+struct stats {
+	uint64_t *lat;
+	size_t ops;
+	uint64_t ns;
+	size_t bytes_in;
+	size_t bytes_out;
+};
+
+static uint64_t rnd(uint64_t *state) {
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+static const char *word(uint64_t *state) {
+	return words[rnd(state) % NWORDS];
+}
+
+static size_t json_record(char *buf, size_t cap, uint64_t *state) {
+	const int n = snprintf(buf, cap,
+	    "{\"id\":%llu,\"user\":\"%s_%s\",\"email\":\"%s@%s.example.com\","
+	    "\"tags\":[\"%s\",\"%s\"],\"score\":%llu.%02llu,\"active\":%s,"
+	    "\"created\":\"2023-%02llu-%02lluT%02llu:%02llu:00Z\"},",
+	    (unsigned long long)(rnd(state) % 1000000), word(state),
+	    word(state), word(state), word(state), word(state), word(state),
+	    (unsigned long long)(rnd(state) % 1000),
+	    (unsigned long long)(rnd(state) % 100),
+	    rnd(state) % 2 ? "true" : "false",
+	    (unsigned long long)(rnd(state) % 12 + 1),
+	    (unsigned long long)(rnd(state) % 28 + 1),
+	    (unsigned long long)(rnd(state) % 24),
+	    (unsigned long long)(rnd(state) % 60));
+
+	return n < 0 ? 0 : (size_t)n < cap ? (size_t)n : cap;
+}
+
+static size_t varint(unsigned char *p, uint64_t v) {
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (unsigned char)v;
+
+	return n;
+}
+
+/* Tagged fields as encoded by protocol buffers */
+static size_t proto_record(char *buf, size_t cap, uint64_t *state) {
+	unsigned char tmp[256];
+	size_t n = 0;
+
+	for (unsigned field = 1; field <= 8; field++) {
+		switch (field % 4) {
+		case 0:		/* varint */
+			n += varint(tmp + n, field << 3 | 0);
+			n += varint(tmp + n, rnd(state) % 100000);
+			break;
+		case 1:		/* length delimited */
+			{
+				const char *const w = word(state);
+				const size_t len = strlen(w);
+
+				n += varint(tmp + n, field << 3 | 2);
+				n += varint(tmp + n, len);
+				(void) memcpy(tmp + n, w, len);
+				n += len;
+			}
+			break;
+		case 2:		/* fixed64 */
+			{
+				const double d = (double)(rnd(state) % 10000) /
+				    100;
+
+				n += varint(tmp + n, field << 3 | 1);
+				(void) memcpy(tmp + n, &d, sizeof (d));
+				n += sizeof (d);
+			}
+			break;
+		default:	/* small enum */
+			n += varint(tmp + n, field << 3 | 0);
+			n += varint(tmp + n, rnd(state) % 4);
+			break;
+		}
+	}
+
+	if (n > cap)
+		n = cap;
+	(void) memcpy(buf, tmp, n);
+
+	return n;
+}
+
+static size_t html_record(char *buf, size_t cap, uint64_t *state) {
+	const int n = snprintf(buf, cap,
+	    "<li class=\"product\"><a href=\"/p/%llu/%s-%s\">"
+	    "<img src=\"/img/%llu.jpg\" alt=\"%s\"></a>"
+	    "<span class=\"title\">%s %s</span>"
+	    "<span class=\"price\">$%llu.%02llu</span></li>\n",
+	    (unsigned long long)(rnd(state) % 100000), word(state),
+	    word(state), (unsigned long long)(rnd(state) % 100000),
+	    word(state), word(state), word(state),
+	    (unsigned long long)(rnd(state) % 500),
+	    (unsigned long long)(rnd(state) % 100));
+
+	return n < 0 ? 0 : (size_t)n < cap ? (size_t)n : cap;
+}
+
+static const struct corpus corpora[] = {
+	{ "json", json_record },
+	{ "proto", proto_record },
+	{ "html", html_record },
+};
+#define	NCORPORA	(sizeof (corpora) / sizeof (corpora[0]))
+
+/*
+ * Fill buf with len bytes of records.
+ */
+static void corpus_value(const struct corpus *c, char *buf, size_t len,
+    uint64_t seed) {
+	uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+	size_t off = 0;
+
+	while (off < len)
+		off += c->record(buf + off, len - off, &state);
+}
+
+static uint64_t now_ns(void) {
+	return monotonic_ns();
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void stats_begin(struct stats *st) {
+	st->ops = 0;
+	st->ns = 0;
+	st->bytes_in = 0;
+	st->bytes_out = 0;
+}
+
+static int stats_done(const struct stats *st, uint64_t budget_ns) {
+	return st->ops >= BENCH_MAX_OPS ||
+	    (st->ops >= BENCH_MIN_OPS && st->ns >= budget_ns);
+}
+
+static void stats_add(struct stats *st, uint64_t ns, size_t in, size_t out) {
+	st->lat[st->ops++] = ns;
+	st->ns += ns;
+	st->bytes_in += in;
+	st->bytes_out += out;
+}
+
+static void report(const char *op, const char *corpus, size_t size,
+    int dict, int level, struct stats *st) {
+	qsort(st->lat, st->ops, sizeof (st->lat[0]), cmp_u64);
+
+	printf("{\"op\":\"%s\",\"corpus\":\"%s\",\"size\":%zu,\"dict\":%s,"
+	    "\"level\":%d,\"ops\":%zu,\"ops_per_sec\":%.0f,"
+	    "\"ns_per_byte\":%.3f,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+	    "\"ratio\":%.3f}\n",
+	    op, corpus, size, dict ? "true" : "false", level, st->ops,
+	    (double)st->ops * 1e9 / (double)st->ns,
+	    (double)st->ns / (double)st->bytes_in,
+	    (unsigned long long)st->lat[st->ops / 2],
+	    (unsigned long long)st->lat[st->ops * 99 / 100],
+	    st->bytes_out > 0 ? (double)st->bytes_in / st->bytes_out : 0);
+	fflush(stdout);
+}
+
+static void module_setup(int level) {
+	module_defaults();
+	module.clevel = level;
+	module.tuner.step = tune_step(level);
+	module.cctx = ZSTD_createCCtx();
+	module.dctx = ZSTD_createDCtx();
+	module.all_dicts = RedisModule_CreateDict(NULL);
+}
+
+static void module_teardown(void) {
+	if (module.dict != NULL)
+		(void) dict_deactivate(&module, module.dict);
+	ZSTD_freeCCtx(module.cctx);
+	ZSTD_freeDCtx(module.dctx);
+	RedisModule_FreeDict(NULL, module.all_dicts);
+	RedisModule_Free(module.delimiters);
+}
+
+/*
+ * Train a default dictionary on values of the corpus that aren't used by
+ * the benchmark itself.
+ */
+static int train_default_dict(const struct corpus *c, int level) {
+	char *const samples = malloc(BENCH_DICT_SAMPLES *
+	    BENCH_DICT_SAMPLE_SIZE);
+	size_t sizes[BENCH_DICT_SAMPLES];
+	char *const dictbuf = malloc(BENCH_DICT_SIZE);
+
+	for (size_t i = 0; i < BENCH_DICT_SAMPLES; i++) {
+		corpus_value(c, samples + i * BENCH_DICT_SAMPLE_SIZE,
+		    BENCH_DICT_SAMPLE_SIZE, 1000000 + i);
+		sizes[i] = BENCH_DICT_SAMPLE_SIZE;
+	}
+
+	const size_t len = ZDICT_trainFromBuffer(dictbuf, BENCH_DICT_SIZE,
+	    samples, sizes, BENCH_DICT_SAMPLES);
+	int ret = -1;
+
+	if (ZDICT_isError(len) == 0) {
+		ret = dict_create_with_id(&module, 1, dictbuf, len, NULL, 0,
+		    level) < 0 ? -1 : 0;
+	}
+	free(dictbuf);
+	free(samples);
+
+	return ret;
+}
+
+static void bench_codec(const struct corpus *c, size_t size, int dict,
+    int level, char **values, uint64_t budget_ns, struct stats *st) {
+	struct zipstr *objs[BENCH_NVALUES];
+	char *const out = malloc(size);
+
+	/* zipstr_create */
+	stats_begin(st);
+	for (size_t i = 0; !stats_done(st, budget_ns); i++) {
+		const size_t v = i % BENCH_NVALUES;
+		const uint64_t start = now_ns();
+		struct zipstr *const zs = zipstr_create(&module, "k", 1,
+		    values[v], size);
+		const uint64_t ns = now_ns() - start;
+
+		stats_add(st, ns, size, zs != NULL ? zs->len : size);
+		if (zs != NULL)
+			zipstr_free(zs);
+	}
+	report("compress", c->name, size, dict, level, st);
+
+	for (size_t v = 0; v < BENCH_NVALUES; v++)
+		objs[v] = zipstr_create(&module, "k", 1, values[v], size);
+	if (objs[0] == NULL) {
+		/* Stored uncompressed; nothing to decompress or save */
+		for (size_t v = 0; v < BENCH_NVALUES; v++) {
+			if (objs[v] != NULL)
+				zipstr_free(objs[v]);
+		}
+		free(out);
+		return;
+	}
+
+	/* zipstr_decompress */
+	stats_begin(st);
+	for (size_t i = 0; !stats_done(st, budget_ns); i++) {
+		const struct zipstr *const zs = objs[i % BENCH_NVALUES];
+
+		if (zs == NULL)
+			continue;
+
+		const uint64_t start = now_ns();
+		const int err = zipstr_decompress(&module, zs, out);
+		const uint64_t ns = now_ns() - start;
+
+		if (err != 0) {
+			fprintf(stderr, "decompression failed\n");
+			exit(1);
+		}
+		stats_add(st, ns, zs->orig_len, zs->len);
+	}
+	report("decompress", c->name, size, dict, level, st);
+
+	/* zipstr_rdb_save / zipstr_rdb_load */
+	RedisModuleIO io = { .buf = NULL };
+
+	zipstr_aux_save(&io, REDISMODULE_AUX_BEFORE_RDB);
+	const size_t aux_len = io.len;
+
+	stats_begin(st);
+	for (size_t i = 0; !stats_done(st, budget_ns); i++) {
+		struct zipstr *const zs = objs[i % BENCH_NVALUES];
+
+		if (zs == NULL)
+			continue;
+
+		io.len = aux_len;
+		const uint64_t start = now_ns();
+		zipstr_rdb_save(&io, zs);
+		const uint64_t ns = now_ns() - start;
+
+		stats_add(st, ns, zs->orig_len, zs->len);
+	}
+	zipstr_aux_save(&io, REDISMODULE_AUX_AFTER_RDB);
+	report("rdb_save", c->name, size, dict, level, st);
+
+	/* Load the last saved object over and over */
+	if (zipstr_aux_load(&io, ZIPSTR_ENCODING_VERSION,
+	    REDISMODULE_AUX_BEFORE_RDB) != REDISMODULE_OK) {
+		fprintf(stderr, "aux load failed\n");
+		exit(1);
+	}
+	stats_begin(st);
+	while (!stats_done(st, budget_ns)) {
+		io.pos = aux_len;
+		const uint64_t start = now_ns();
+		struct zipstr *const zs = zipstr_rdb_load(&io,
+		    ZIPSTR_ENCODING_VERSION);
+		const uint64_t ns = now_ns() - start;
+
+		if (zs == NULL) {
+			fprintf(stderr, "rdb load failed\n");
+			exit(1);
+		}
+		stats_add(st, ns, zs->orig_len, zs->len);
+		zipstr_free(zs);
+	}
+	load_dicts_release();
+	report("rdb_load", c->name, size, dict, level, st);
+	free(io.buf);
+
+	for (size_t v = 0; v < BENCH_NVALUES; v++) {
+		if (objs[v] != NULL)
+			zipstr_free(objs[v]);
+	}
+	free(out);
+}
+
+/*
+ * Appends of the values to a log, and reads of as many bytes at random
+ * offsets of the log. The ratio of appends is the one of the logs.
+ */
+static void bench_log(const struct corpus *c, size_t size, int dict,
+    int level, char **values, uint64_t budget_ns, struct stats *st) {
+	struct zipstr *zs = NULL;
+	size_t stored = 0;	/* By the logs started over */
+
+	stats_begin(st);
+	for (size_t i = 0; !stats_done(st, budget_ns); i++) {
+		const char *const v = values[i % BENCH_NVALUES];
+
+		if (zs != NULL && zs->orig_len + size > BENCH_LOG_MAX) {
+			stored += zs->len;
+			zipstr_free(zs);
+			zs = NULL;
+		}
+
+		const uint64_t start = now_ns();
+
+		if (zs == NULL) {
+			zs = log_encode(&module, module.dict, v, size,
+			    BENCH_LOG_BLOCK_SIZE);
+			if (zs != NULL) {
+				zipstr_init(&module, zs, module.dict, zs->len,
+				    zs->orig_len);
+			}
+		} else {
+			zs = log_append(&module, zs, v, size);
+		}
+		const uint64_t ns = now_ns() - start;
+
+		if (zs == NULL) {
+			fprintf(stderr, "log append failed\n");
+			exit(1);
+		}
+		stats_add(st, ns, size, 0);
+	}
+	st->bytes_out = stored + zs->len;
+	report("log_append", c->name, size, dict, level, st);
+
+	char *const out = malloc(size);
+	uint64_t state = 1;
+
+	stats_begin(st);
+	while (!stats_done(st, budget_ns) && zs->orig_len >= size) {
+		const size_t offset = rnd(&state) % (zs->orig_len - size + 1);
+		const uint64_t start = now_ns();
+		const int err = zipstr_read_range(&module, zs, offset, size,
+		    out);
+		const uint64_t ns = now_ns() - start;
+
+		if (err != 0) {
+			fprintf(stderr, "log read failed\n");
+			exit(1);
+		}
+		stats_add(st, ns, size, 0);
+	}
+	if (st->ops > 0)
+		report("log_getrange", c->name, size, dict, level, st);
+
+	free(out);
+	zipstr_free(zs);
+}
+
+/*
+ * Sample collection for training, as done for each scanned key.
+ */
+static void bench_train_sample(const struct corpus *c, size_t size,
+    char **values, uint64_t budget_ns, struct stats *st) {
+	struct train_data train = { 0 };
+	RedisModuleString *const keyname = RedisModule_CreateString(NULL,
+	    "k", 1);
+
+	train_data_init(&train, DEFAULT_MAX_NSAMPLES,
+	    DEFAULT_DICT_SIZE * TRAINBUF_FACTOR, 1);
+
+	stats_begin(st);
+	for (size_t i = 0; !stats_done(st, budget_ns); i++) {
+		RedisModuleKey key = { values[i % BENCH_NVALUES], size };
+
+		const uint64_t start = now_ns();
+		train_callback(NULL, keyname, &key, &train);
+		const uint64_t ns = now_ns() - start;
+
+		stats_add(st, ns, size, 0);
+	}
+	report("train_sample", c->name, size, 0, 0, st);
+
+	RedisModule_FreeString(NULL, keyname);
+	train_data_free(&train);
+}
+
+static size_t parse_list(const char *arg, long long *out) {
+	size_t n = 0;
+	char *end;
+
+	while (*arg != '\0' && n < BENCH_MAX_ARGS) {
+		out[n++] = strtoll(arg, &end, 10);
+		if (end == arg || (*end != ',' && *end != '\0')) {
+			fprintf(stderr, "invalid list: %s\n", arg);
+			exit(2);
+		}
+		arg = *end == ',' ? end + 1 : end;
+	}
+	return n;
+}
+
+int main(int argc, char **argv) {
+	long long sizes[BENCH_MAX_ARGS] = { 64, 256, 1024, 4096, 16384, 65536 };
+	size_t nsizes = 6;
+	long long levels[BENCH_MAX_ARGS] = { 1, 3, 9 };
+	size_t nlevels = 3;
+	const char *only = NULL;
+	long long budget_ms = 100;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:s:l:c:")) != -1) {
+		switch (opt) {
+		case 't':
+			budget_ms = strtoll(optarg, NULL, 10);
+			break;
+		case 's':
+			nsizes = parse_list(optarg, sizes);
+			break;
+		case 'l':
+			nlevels = parse_list(optarg, levels);
+			break;
+		case 'c':
+			only = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t ms] [-s sizes] "
+			    "[-l levels] [-c corpora]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	stub_init();
+
+	const uint64_t budget_ns = (uint64_t)budget_ms * 1000000;
+	struct stats st;
+
+	st.lat = malloc(BENCH_MAX_OPS * sizeof (*st.lat));
+
+	for (size_t ci = 0; ci < NCORPORA; ci++) {
+		const struct corpus *const c = &corpora[ci];
+
+		if (only != NULL && strstr(only, c->name) == NULL)
+			continue;
+
+		for (size_t si = 0; si < nsizes; si++) {
+			const size_t size = sizes[si];
+			char *values[BENCH_NVALUES];
+
+			for (size_t v = 0; v < BENCH_NVALUES; v++) {
+				values[v] = malloc(size);
+				corpus_value(c, values[v], size, v);
+			}
+
+			for (size_t li = 0; li < nlevels; li++) {
+				for (int dict = 0; dict <= 1; dict++) {
+					module_setup(levels[li]);
+					if (dict && train_default_dict(c,
+					    levels[li]) != 0) {
+						fprintf(stderr, "training "
+						    "failed\n");
+						return 1;
+					}
+					bench_codec(c, size, dict, levels[li],
+					    values, budget_ns, &st);
+					bench_log(c, size, dict, levels[li],
+					    values, budget_ns, &st);
+					module_teardown();
+				}
+			}
+
+			module_setup(ZSTD_CLEVEL_DEFAULT);
+			bench_train_sample(c, size, values, budget_ns, &st);
+			module_teardown();
+
+			for (size_t v = 0; v < BENCH_NVALUES; v++)
+				free(values[v]);
+		}
+	}
+	free(st.lat);
+
+	return 0;
+}
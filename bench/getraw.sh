@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Compare COMPRESS.GET against COMPRESS.GETRAW, which leaves decompression
+# to the client. For each command, report the server CPU time and the bytes
+# sent to clients, taken from INFO before and after the run.
+#
+# Expects a server with the module loaded. The keys are compressed with a
+# default dictionary trained on them, as in a deployment using one. Clients
+# spend about the time of the decompress cases of bench/bench instead.
+#
+# Usage: bench/getraw.sh [REQUESTS]
+
+REQUESTS=${1:-1000000}
+KEYSPACE=${KEYSPACE:-10000}
+VALUE=${VALUE:-'{"id":__rand_int__,"name":"bench","email":"bench@example.com","tags":["alpha","beta","gamma"],"active":true,"score":98.5,"address":{"street":"1 Main St","city":"Springfield","zip":"12345"}}'}
+CLI=${REDIS_CLI:-redis-cli}
+BENCH=${REDIS_BENCHMARK:-redis-benchmark}
+
+# Server CPU seconds and output bytes so far
+counters() {
+	$CLI info | tr -d '\r' | awk -F: '
+	    $1 == "used_cpu_sys" || $1 == "used_cpu_user" { cpu += $2 }
+	    $1 == "total_net_output_bytes" { out = $2 }
+	    END { printf "%f %d\n", cpu, out }'
+}
+
+run() {
+	before=$(counters)
+	$BENCH -q -r "$KEYSPACE" -n "$REQUESTS" -P 16 "$@" \
+	    bench:__rand_int__ >/dev/null
+	after=$(counters)
+	echo "$before $after" | awk -v cmd="$1" -v n="$REQUESTS" '{
+		printf "%-16s cpu_us/op=%.2f bytes/op=%.1f\n", cmd,
+		    ($3 - $1) * 1e6 / n, ($4 - $2) / n }'
+}
+
+$CLI flushall >/dev/null
+# Train on plain values, then store them compressed with the dictionary
+$BENCH -q -r "$KEYSPACE" -n $((KEYSPACE * 4)) -P 16 \
+    set bench:__rand_int__ "$VALUE" >/dev/null
+$CLI compress.dict train >/dev/null
+$BENCH -q -r "$KEYSPACE" -n $((KEYSPACE * 4)) -P 16 \
+    compress.set bench:__rand_int__ "$VALUE" >/dev/null
+
+run compress.get
+run compress.getraw
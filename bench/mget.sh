@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Compare COMPRESS.MGET/MSET against pipelined single-key COMPRESS.GET/SET.
+#
+# Expects a server with the module loaded. Each batch command moves BATCH
+# keys, so compare keys/s: requests/s * BATCH for the batched commands, and
+# requests/s for the pipelined single-key ones.
+#
+# Usage: bench/mget.sh [BATCH] [REQUESTS]
+
+BATCH=${1:-100}
+REQUESTS=${2:-100000}
+KEYSPACE=${KEYSPACE:-100000}
+VALUE=${VALUE:-'{"id":1234,"name":"bench","tags":["a","b","c"],"active":true}'}
+CLI=${REDIS_CLI:-redis-cli}
+BENCH=${REDIS_BENCHMARK:-redis-benchmark}
+
+mget="compress.mget"
+mset="compress.mset"
+i=0
+while [ $i -lt "$BATCH" ]; do
+	mget="$mget bench:__rand_int__"
+	mset="$mset bench:__rand_int__ $VALUE"
+	i=$((i + 1))
+done
+
+$CLI flushall >/dev/null
+
+echo "== pipelined COMPRESS.SET (keys/s = requests/s)"
+$BENCH -q -r "$KEYSPACE" -n "$REQUESTS" -P "$BATCH" \
+    compress.set bench:__rand_int__ "$VALUE"
+echo "== COMPRESS.MSET x $BATCH (keys/s = requests/s * $BATCH)"
+$BENCH -q -r "$KEYSPACE" -n $((REQUESTS / BATCH)) $mset
+
+echo "== pipelined COMPRESS.GET (keys/s = requests/s)"
+$BENCH -q -r "$KEYSPACE" -n "$REQUESTS" -P "$BATCH" \
+    compress.get bench:__rand_int__
+echo "== COMPRESS.MGET x $BATCH (keys/s = requests/s * $BATCH)"
+$BENCH -q -r "$KEYSPACE" -n $((REQUESTS / BATCH)) $mget
@@ -0,0 +1,323 @@
+/*
+ * Minimal stand-in for the RedisModule API, enough to run the compression,
+ * dictionary, sampling and RDB paths of the module without a server.
+ * Included by bench.c after the module sources.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+struct RedisModuleString {
+	size_t len;
+	char *ptr;
+};
+
+/* A string key, as seen by the scan callbacks */
+struct RedisModuleKey {
+	const char *ptr;
+	size_t len;
+};
+
+/* RDB stream kept in memory */
+struct RedisModuleIO {
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t pos;
+};
+
+struct stub_entry {
+	void *key;
+	size_t keylen;
+	void *value;
+	struct stub_entry *next;
+};
+
+struct RedisModuleDict {
+	struct stub_entry *head;
+	uint64_t size;
+};
+
+struct RedisModuleDictIter {
+	struct stub_entry *next;
+};
+
+static void *stub_alloc(size_t bytes) {
+	void *const p = malloc(bytes > 0 ? bytes : 1);
+
+	if (p == NULL)
+		abort();
+	return p;
+}
+
+static void *stub_calloc(size_t nmemb, size_t size) {
+	void *const p = calloc(nmemb > 0 ? nmemb : 1, size > 0 ? size : 1);
+
+	if (p == NULL)
+		abort();
+	return p;
+}
+
+static void *stub_realloc(void *ptr, size_t bytes) {
+	void *const p = realloc(ptr, bytes > 0 ? bytes : 1);
+
+	if (p == NULL)
+		abort();
+	return p;
+}
+
+static char *stub_strdup(const char *str) {
+	const size_t len = strlen(str) + 1;
+
+	return memcpy(stub_alloc(len), str, len);
+}
+
+static long long stub_milliseconds(void) {
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void stub_log(RedisModuleCtx *ctx, const char *level,
+    const char *fmt, ...) {
+	(void) ctx;
+
+	if (getenv("BENCH_LOG") == NULL)
+		return;
+
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "[%s] ", level);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+}
+
+static RedisModuleString *stub_create_string(RedisModuleCtx *ctx,
+    const char *ptr, size_t len) {
+	(void) ctx;
+
+	RedisModuleString *const str = stub_alloc(sizeof (*str));
+
+	str->ptr = stub_alloc(len + 1);
+	(void) memcpy(str->ptr, ptr, len);
+	str->ptr[len] = '\0';
+	str->len = len;
+
+	return str;
+}
+
+static void stub_free_string(RedisModuleCtx *ctx, RedisModuleString *str) {
+	(void) ctx;
+
+	free(str->ptr);
+	free(str);
+}
+
+static const char *stub_string_ptr_len(const RedisModuleString *str,
+    size_t *len) {
+	if (len != NULL)
+		*len = str->len;
+	return str->ptr;
+}
+
+static int stub_key_type(RedisModuleKey *key) {
+	(void) key;
+
+	return REDISMODULE_KEYTYPE_STRING;
+}
+
+static char *stub_string_dma(RedisModuleKey *key, size_t *len, int mode) {
+	(void) mode;
+
+	*len = key->len;
+	return (char *)key->ptr;
+}
+
+static RedisModuleDict *stub_create_dict(RedisModuleCtx *ctx) {
+	(void) ctx;
+
+	return stub_calloc(1, sizeof (RedisModuleDict));
+}
+
+static struct stub_entry **stub_dict_find(RedisModuleDict *d, void *key,
+    size_t keylen) {
+	struct stub_entry **e = &d->head;
+
+	while (*e != NULL && ((*e)->keylen != keylen ||
+	    memcmp((*e)->key, key, keylen) != 0))
+		e = &(*e)->next;
+	return e;
+}
+
+static int stub_dict_set(RedisModuleDict *d, void *key, size_t keylen,
+    void *value) {
+	struct stub_entry **const e = stub_dict_find(d, key, keylen);
+
+	if (*e != NULL)
+		return REDISMODULE_ERR;
+
+	struct stub_entry *const n = stub_calloc(1, sizeof (*n));
+
+	n->key = memcpy(stub_alloc(keylen), key, keylen);
+	n->keylen = keylen;
+	n->value = value;
+	*e = n;
+	d->size++;
+
+	return REDISMODULE_OK;
+}
+
+static int stub_dict_replace(RedisModuleDict *d, void *key, size_t keylen,
+    void *value) {
+	struct stub_entry **const e = stub_dict_find(d, key, keylen);
+
+	if (*e == NULL)
+		return stub_dict_set(d, key, keylen, value);
+	(*e)->value = value;
+
+	return REDISMODULE_OK;
+}
+
+static void *stub_dict_get(RedisModuleDict *d, void *key, size_t keylen,
+    int *nokey) {
+	struct stub_entry **const e = stub_dict_find(d, key, keylen);
+
+	if (nokey != NULL)
+		*nokey = *e == NULL;
+	return *e != NULL ? (*e)->value : NULL;
+}
+
+static int stub_dict_del(RedisModuleDict *d, void *key, size_t keylen,
+    void *oldval) {
+	struct stub_entry **const e = stub_dict_find(d, key, keylen);
+	struct stub_entry *const n = *e;
+
+	if (n == NULL)
+		return REDISMODULE_ERR;
+	if (oldval != NULL)
+		*(void **)oldval = n->value;
+	*e = n->next;
+	free(n->key);
+	free(n);
+	d->size--;
+
+	return REDISMODULE_OK;
+}
+
+static uint64_t stub_dict_size(RedisModuleDict *d) {
+	return d->size;
+}
+
+static RedisModuleDictIter *stub_dict_iter_start(RedisModuleDict *d,
+    const char *op, void *key, size_t keylen) {
+	(void) op;
+	(void) key;
+	(void) keylen;
+
+	RedisModuleDictIter *const iter = stub_alloc(sizeof (*iter));
+
+	iter->next = d->head;
+	return iter;
+}
+
+static void *stub_dict_next(RedisModuleDictIter *iter, size_t *keylen,
+    void **value) {
+	struct stub_entry *const e = iter->next;
+
+	if (e == NULL)
+		return NULL;
+	iter->next = e->next;
+	if (keylen != NULL)
+		*keylen = e->keylen;
+	if (value != NULL)
+		*value = e->value;
+
+	return e->key;
+}
+
+static void stub_dict_iter_stop(RedisModuleDictIter *iter) {
+	free(iter);
+}
+
+static void stub_free_dict(RedisModuleCtx *ctx, RedisModuleDict *d) {
+	(void) ctx;
+
+	while (d->head != NULL)
+		(void) stub_dict_del(d, d->head->key, d->head->keylen, NULL);
+	free(d);
+}
+
+static void stub_io_write(RedisModuleIO *io, const void *data, size_t len) {
+	if (io->len + len > io->cap) {
+		io->cap = (io->len + len) * 2;
+		io->buf = stub_realloc(io->buf, io->cap);
+	}
+	(void) memcpy(io->buf + io->len, data, len);
+	io->len += len;
+}
+
+static void stub_save_unsigned(RedisModuleIO *io, uint64_t value) {
+	stub_io_write(io, &value, sizeof (value));
+}
+
+static uint64_t stub_load_unsigned(RedisModuleIO *io) {
+	uint64_t value;
+
+	(void) memcpy(&value, io->buf + io->pos, sizeof (value));
+	io->pos += sizeof (value);
+
+	return value;
+}
+
+static void stub_save_string_buffer(RedisModuleIO *io, const char *str,
+    size_t len) {
+	stub_save_unsigned(io, len);
+	stub_io_write(io, str, len);
+}
+
+static char *stub_load_string_buffer(RedisModuleIO *io, size_t *lenptr) {
+	const size_t len = stub_load_unsigned(io);
+	char *const buf = stub_alloc(len);
+
+	(void) memcpy(buf, io->buf + io->pos, len);
+	io->pos += len;
+	if (lenptr != NULL)
+		*lenptr = len;
+
+	return buf;
+}
+
+void stub_init(void) {
+	RedisModule_Alloc = stub_alloc;
+	RedisModule_Calloc = stub_calloc;
+	RedisModule_Realloc = stub_realloc;
+	RedisModule_Free = free;
+	RedisModule_Strdup = stub_strdup;
+	RedisModule_Milliseconds = stub_milliseconds;
+	RedisModule_Log = stub_log;
+
+	RedisModule_CreateString = stub_create_string;
+	RedisModule_FreeString = stub_free_string;
+	RedisModule_StringPtrLen = stub_string_ptr_len;
+	RedisModule_KeyType = stub_key_type;
+	RedisModule_StringDMA = stub_string_dma;
+
+	RedisModule_CreateDict = stub_create_dict;
+	RedisModule_FreeDict = stub_free_dict;
+	RedisModule_DictSize = stub_dict_size;
+	RedisModule_DictSetC = stub_dict_set;
+	RedisModule_DictReplaceC = stub_dict_replace;
+	RedisModule_DictGetC = stub_dict_get;
+	RedisModule_DictDelC = stub_dict_del;
+	RedisModule_DictIteratorStartC = stub_dict_iter_start;
+	RedisModule_DictNextC = stub_dict_next;
+	RedisModule_DictIteratorStop = stub_dict_iter_stop;
+
+	RedisModule_SaveUnsigned = stub_save_unsigned;
+	RedisModule_LoadUnsigned = stub_load_unsigned;
+	RedisModule_SaveStringBuffer = stub_save_string_buffer;
+	RedisModule_LoadStringBuffer = stub_load_string_buffer;
+}
@@ -0,0 +1,101 @@
+/*
+ * Reference decoder for COMPRESS.GETRAW replies. Only depends on zstd.
+ *
+ * Values stored in chunks are a skippable frame with the chunk index
+ * followed by one frame per chunk. zstd skips the former and decodes the
+ * frames one after the other, so they need no special handling here.
+ */
+
+#include <stdlib.h>
+
+#include "deps/zstd/lib/zstd.h"
+#include "client/zipstr_client.h"
+
+struct zc_dict {
+	long long id;
+	ZSTD_DDict *ddict;
+};
+
+struct zc_ctx {
+	ZSTD_DCtx *dctx;
+	struct zc_dict *dicts;
+	size_t ndicts;
+};
+
+struct zc_ctx *zc_create(void) {
+	struct zc_ctx *const zc = calloc(1, sizeof (*zc));
+
+	if (zc == NULL)
+		return NULL;
+	if ((zc->dctx = ZSTD_createDCtx()) == NULL) {
+		free(zc);
+		return NULL;
+	}
+	return zc;
+}
+
+void zc_free(struct zc_ctx *zc) {
+	if (zc == NULL)
+		return;
+	for (size_t i = 0; i < zc->ndicts; i++)
+		ZSTD_freeDDict(zc->dicts[i].ddict);
+	free(zc->dicts);
+	ZSTD_freeDCtx(zc->dctx);
+	free(zc);
+}
+
+static ZSTD_DDict *zc_find(const struct zc_ctx *zc, long long id) {
+	for (size_t i = 0; i < zc->ndicts; i++) {
+		if (zc->dicts[i].id == id)
+			return zc->dicts[i].ddict;
+	}
+	return NULL;
+}
+
+int zc_has_dict(const struct zc_ctx *zc, long long id) {
+	return zc_find(zc, id) != NULL;
+}
+
+int zc_add_dict(struct zc_ctx *zc, long long id, const void *buf,
+    size_t len) {
+	if (zc_has_dict(zc, id))
+		return ZC_OK;
+
+	struct zc_dict *const dicts = realloc(zc->dicts,
+	    (zc->ndicts + 1) * sizeof (*dicts));
+	if (dicts == NULL)
+		return ZC_ENOMEM;
+	zc->dicts = dicts;
+
+	/* Copied, so buf can be freed along with the reply */
+	ZSTD_DDict *const ddict = ZSTD_createDDict(buf, len);
+	if (ddict == NULL)
+		return ZC_ENOMEM;
+
+	zc->dicts[zc->ndicts].id = id;
+	zc->dicts[zc->ndicts].ddict = ddict;
+	zc->ndicts++;
+
+	return ZC_OK;
+}
+
+int zc_decode(struct zc_ctx *zc, long long id, const void *frames,
+    size_t len, void *dst, size_t orig_len) {
+	size_t ret;
+
+	if (id != 0) {
+		const ZSTD_DDict *const ddict = zc_find(zc, id);
+
+		if (ddict == NULL)
+			return ZC_ENODICT;
+		ret = ZSTD_decompress_usingDDict(zc->dctx, dst, orig_len,
+		    frames, len, ddict);
+	} else {
+		ret = ZSTD_decompressDCtx(zc->dctx, dst, orig_len, frames,
+		    len);
+	}
+
+	if (ZSTD_isError(ret) || ret != orig_len)
+		return ZC_ECORRUPT;
+	return ZC_OK;
+}
@@ -0,0 +1,43 @@
+/*
+ * Reference decoder for clients that decompress values themselves.
+ *
+ * COMPRESS.GETRAW and COMPRESS.MGETRAW return a compressed value as an
+ * array of the dictionary ID, the original length and the zstd frames.
+ * Values that aren't compressed are returned as plain bulk strings. A
+ * client keeps the dictionaries it has seen, fetched once with
+ * COMPRESS.DICT DUMP <id>, and decodes the frames with zc_decode().
+ *
+ * Dictionaries never change once created, so they can be cached for as
+ * long as the client runs.
+ */
+
+#ifndef ZIPSTR_CLIENT_H
+#define	ZIPSTR_CLIENT_H
+
+#include <stddef.h>
+
+#define	ZC_OK		0
+#define	ZC_ENODICT	-1	/* Fetch the dictionary and retry */
+#define	ZC_ECORRUPT	-2	/* Frames don't decode to orig_len bytes */
+#define	ZC_ENOMEM	-3
+
+struct zc_ctx;
+
+struct zc_ctx *zc_create(void);
+void zc_free(struct zc_ctx *zc);
+
+/*
+ * Add the dictionary returned by COMPRESS.DICT DUMP <id>.
+ */
+int zc_add_dict(struct zc_ctx *zc, long long id, const void *buf,
+    size_t len);
+int zc_has_dict(const struct zc_ctx *zc, long long id);
+
+/*
+ * Decompress the frames of a COMPRESS.GETRAW reply into dst, which must
+ * hold orig_len bytes. Dictionary ID 0 means no dictionary.
+ */
+int zc_decode(struct zc_ctx *zc, long long id, const void *frames,
+    size_t len, void *dst, size_t orig_len);
+
+#endif /* ZIPSTR_CLIENT_H */
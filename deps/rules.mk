@@ -5,6 +5,6 @@ deps/redis/src/redismodule.h:
 deps/zstd: deps/libzstd/lib/libzstd.a
 deps/libzstd/lib/libzstd.a:
 	git submodule update --init -- deps/zstd
-	cd deps/zstd && make
+	cd deps/zstd && make lib-mt
 
 .PHONY: deps/redis deps/zstd
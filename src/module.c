@@ -1,6 +1,13 @@
+#define	_POSIX_C_SOURCE	200809L
+
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
 
 #define ZSTD_STATIC_LINKING_ONLY
 #include "deps/zstd/lib/zstd.h"
@@ -14,73 +21,717 @@
 
 
 #define	MODPREFIX	"compress"
-#define BUFSIZE		10*1024*1024
 
-#define	ZIPSTR_ENCODING_VERSION	0
+#define	ZIPSTR_ENCODING_VERSION	2
+#define	ZIPHASH_ENCODING_VERSION	1
+
+#define	DEFAULT_OFFLOAD_THRESHOLD	1024*1024
+#define	DEFAULT_CPU_BUDGET_US	100
+#define	DEFAULT_DELIMITERS	":"
+#define	MAX_STRING_SIZE		512*1024*1024
+
+#define	DEFAULT_HASH_MAX_PACKED_ENTRIES	128
+#define	DEFAULT_HASH_MAX_PACKED_VALUE	1024
+#define	HASH_ENTRY_HDR		12	/* field, original and stored length */
+
+#define	DEFAULT_LARGE_THRESHOLD	8*1024*1024
+#define	DEFAULT_LARGE_WORKERS	2
+#define	DEFAULT_LARGE_WINDOW_LOG	27	/* Decoders accept up to 27 */
+
+#define	CHUNK_MAGIC		0x184D2A5E	/* zstd skippable frame */
+#define	CHUNK_HDR_SIZE		16	/* magic, size, chunk size, count */
+#define	LOG_MAGIC		0x184D2A5D	/* zstd skippable frame */
+#define	LOG_CHAIN		4	/* Blocks per chain of prefixes */
+#define	DEFAULT_MIN_SIZE	32
+#define	DEFAULT_MAX_ENTROPY	760	/* 1/100 bits per byte */
+
+#define	ENTROPY_SAMPLE		4096	/* Smaller values are sampled whole */
+#define	ENTROPY_CHUNKS		16
+#define	ENTROPY_CHUNK_SIZE	256
+
+#define	CACHE_SKETCH_SIZE	4096	/* Access counters, power of two */
+#define	CACHE_FREQ_MAX		15
+#define	DEFAULT_CACHE_ADMIT	2
+
+#define	DEFAULT_DDICT_IDLE_TIMEOUT	300	/* Seconds */
+#define	DICT_SWEEP_MS		1000
+#define	DICT_MAX_SLOTS		65536	/* Slot 0 means no dictionary */
+
+#define	DEFAULT_MIGRATE_BUDGET_MS	2
+#define	MIGRATE_TICK_MS		10
+
+#define	FREE_TICK_MS		10
+#define	FREE_BUDGET_NS		1000000	/* Per tick */
+
+#define	HIST_SUB_BITS	2	/* Linear sub-buckets per power of two */
+#define	HIST_NBUCKETS	(64 << HIST_SUB_BITS)
+
+#define	TUNE_NLEVELS	8
+#define	TUNE_WINDOW	256	/* Compressions between level adjustments */
+#define	TUNE_MIN_GAIN	1.01	/* Ratio gain needed to move a level up */
+
+static const int tune_levels[TUNE_NLEVELS] = { -7, -3, -1, 1, 3, 6, 9, 12 };
+
+/*
+ * Compression level autotuner. Measures the cost and ratio at the current
+ * level and moves the level to stay within the per-command CPU budget.
+ */
+struct level_tuner {
+	int step;			/* Index into tune_levels */
+	unsigned samples;
+	uint64_t ns;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	double ratio[TUNE_NLEVELS];	/* Last ratio seen at each level */
+};
+
+/*
+ * Why a value was stored without compression.
+ */
+enum skip_reason {
+	SKIP_NONE,
+	SKIP_SMALL,		/* Below min-size */
+	SKIP_MAGIC,		/* Known compressed format */
+	SKIP_ENTROPY,		/* Sample looks random */
+	SKIP_INCOMPRESSIBLE,	/* Didn't shrink with zstd */
+	SKIP_NREASONS
+};
+
+/*
+ * Latency histogram with fixed memory. Bucket boundaries are powers of two
+ * split into 1 << HIST_SUB_BITS linear steps, so quantiles are within 25%
+ * of the recorded times.
+ */
+struct latency_hist {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[HIST_NBUCKETS];
+};
+
+/*
+ * Commands with a latency histogram.
+ */
+enum stat_cmd {
+	STAT_SET,
+	STAT_GET,
+	STAT_GETDEL,
+	STAT_MSET,
+	STAT_MGET,
+	STAT_GETRANGE,
+	STAT_SETRANGE,
+	STAT_APPEND,
+	STAT_HSET,
+	STAT_HGET,
+	STAT_HMGET,
+	STAT_HGETALL,
+	STAT_HDEL,
+	STAT_NCMDS
+};
+
+static const char *const stat_cmd_names[STAT_NCMDS] = {
+	"set", "get", "getdel", "mset", "mget", "getrange", "setrange",
+	"append", "hset", "hget", "hmget", "hgetall", "hdel"
+};
+
+/*
+ * Work done by zstd with a dictionary, or without one.
+ */
+struct codec_stats {
+	uint64_t compressions;
+	uint64_t bytes_in;		/* Compressed */
+	uint64_t bytes_out;
+	uint64_t compress_ns;
+	uint64_t decompressions;
+	uint64_t bytes_decompressed;
+	uint64_t decompress_ns;
+};
 
 struct dict {
 	unsigned long refcnt;
 
 	long long id;
+	uint64_t save_index;		/* Index in the RDB being saved */
 	char *prefix;
 	size_t prefix_len;
 	size_t mem_uncompressed;
 	size_t mem_compressed;
 
-	ZSTD_CDict *cdict;
-	ZSTD_DDict *ddict;
+	struct level_tuner tuner;
+	struct codec_stats stats;
+	ZSTD_CDict *cdicts[TUNE_NLEVELS];	/* Created as levels are used */
+	unsigned long njobs;		/* Worker jobs using a CDict */
+	uint64_t cdict_used;		/* Last use of a CDict, in seconds */
+	ZSTD_DDict *ddict;		/* Created on first use */
+	uint64_t ddict_used;		/* Last use of the DDict, in seconds */
+	int aof_emitted;		/* Set in the AOF rewrite child */
+	uint16_t slot;			/* Index in dict_slots */
 	char *buf;
 	size_t buflen;
 };
 
-struct compress_module {
-	char *buf;			/* tmp buffer for compress/uncompress */
+/*
+ * Trie of prefix dictionaries with one node per prefix byte. A key uses the
+ * dictionary of the longest prefix followed by a delimiter in the key.
+ */
+struct prefix_node {
+	struct dict *dict;
+	unsigned nchildren;
+	struct prefix_child {
+		unsigned char c;
+		struct prefix_node *node;
+	} *children;			/* Sorted by c */
+};
+
+/*
+ * SET options.
+ */
+struct set_opts {
+	int nx;
+	int xx;
+	int get;			/* Reply with the old value */
+	int keepttl;
+	mstime_t expire_at;		/* Unix time in ms, 0 for none */
+};
+
+/*
+ * Values of at least threshold bytes are compressed with the streaming API,
+ * which can use zstd's own worker threads and long distance matching.
+ */
+struct large_params {
+	long long threshold;		/* 0 disables */
+	long long workers;		/* zstd threads per compression */
+	long long window_log;
+	long long ldm;			/* Long distance matching */
+};
+
+/*
+ * Compression of a large value handed to the worker pool.
+ */
+struct compress_job {
+	struct compress_job *next;
+
+	RedisModuleBlockedClient *bc;
+	RedisModuleString *keyname;
+	RedisModuleString *val;		/* Retained until the job is freed */
+	int db;
+	const char *data;
+	size_t len;
+
+	struct dict *dict;		/* Held while the job is in flight */
+	const ZSTD_CDict *cdict;
+	int clevel;
+	size_t chunk_size;
+	struct large_params large;
+	int measure;			/* Time the compression */
+	uint64_t ns;
+	struct set_opts opts;
+	struct zipstr *zs;		/* Result, NULL if not compressible */
+};
+
+/*
+ * Object freed off the main thread, e.g. by FLUSHALL ASYNC, and released
+ * later on the main thread.
+ */
+struct deferred_free {
+	struct deferred_free *next;
+	void *value;
+	void (*release)(void *value);
+};
+
+/*
+ * Decompressed copy of a frequently read object.
+ */
+struct cache_entry {
+	const struct zipstr *zs;
+	struct cache_entry *hnext;	/* Hash chain */
+	struct cache_entry *prev;	/* LRU list, most recent first */
+	struct cache_entry *next;
+	size_t len;
+	char data[];
+};
+
+/*
+ * Bounded cache of decompressed values, keyed by object. Values are only
+ * admitted once they have been read cache-admit times, as estimated by a
+ * small count-min sketch that is halved periodically, and only if they
+ * were read more often than the entries they would evict.
+ */
+struct value_cache {
+	long long max_bytes;		/* 0 disables the cache */
+	long long admit;
+
+	struct cache_entry **buckets;
+	size_t nbuckets;
+	size_t nentries;
+	size_t bytes;
+	struct cache_entry *head;
+	struct cache_entry *tail;
+
+	unsigned char freq[CACHE_SKETCH_SIZE];
+	size_t nfreq;			/* Reads since counters were halved */
+
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+};
+
+/*
+ * Background recompression of objects whose dictionary is no longer the
+ * one their key would use, walking every database with a scan cursor.
+ */
+struct migrator {
+	int running;
+	long long budget_ms;		/* Per tick */
+	RedisModuleTimerID timer;
+	RedisModuleScanCursor *cursor;
+	int db;
+	long long started;
+	long long finished;
+
+	size_t scanned;			/* Keys visited */
+	size_t migrated;		/* Objects recompressed */
+	size_t failed;			/* Kept, e.g. no longer compressible */
+	size_t bytes_before;		/* Size of migrated objects before */
+	size_t bytes_after;
+
+	char *buf;			/* Scratch for decompressed values */
 	size_t buflen;
+};
+
+struct worker_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct compress_job *head;
+	struct compress_job **tail;
+
+	long long nthreads;
+	size_t njobs;			/* Queued or running */
+};
+
+struct compress_module {
 	int clevel;			/* Compression level */
+	struct level_tuner tuner;	/* Used without dictionary */
+	long long autotune;
+	long long cpu_budget_us;
 
 	struct dict *dict;		/* Default dictionary */
 
-	RedisModuleDict *all_dicts;	/* All dictionaries */
-	RedisModuleDict *prefix_dicts;	/* Active prefix dictionaries */
+	struct dict **load_dicts;	/* By RDB index, held while loading */
+	size_t nload_dicts;
+	int save_indexes;		/* Objects refer to dicts by index */
+	int aof_active_emitted;		/* Set in the AOF rewrite child */
 
-	RedisModuleString *set_str;
-	RedisModuleCommandFilter *set_filter;
+	RedisModuleDict *all_dicts;	/* All dictionaries */
+	struct dict **dict_slots;	/* By slot, for objects; 0 is unused */
+	size_t ndict_slots;
+	struct prefix_node prefix_dicts;	/* Active prefix dictionaries */
+	char *delimiters;		/* Characters ending a key prefix */
+	unsigned char is_delim[256];
 
-	RedisModuleString *get_str;
-	RedisModuleCommandFilter *get_filter;
+	RedisModuleCommandFilter *filter;	/* Transparent mode */
 
 	ZSTD_CCtx *cctx;
 	ZSTD_DCtx *dctx;
+	const struct dict *dctx_dict;	/* Dictionary referenced by dctx */
+	ZSTD_format_e dctx_format;
+	long long ddict_idle_timeout;	/* Seconds; 0 keeps DDicts */
+	uint64_t clock;			/* Seconds, updated by the sweep */
 
 	size_t mem_total_uncompressed;
 	size_t mem_total_compressed;
 	size_t nobjs;
+	size_t frame_bytes_saved;	/* By magicless frames */
+
+	size_t nhashes;
+	size_t hash_fields;
+	size_t hash_mem_uncompressed;
+	size_t hash_mem_compressed;
+	long long hash_max_packed_entries;
+	long long hash_max_packed_value;
+	long long transparent_hash;	/* Filter hash commands too */
+
+	struct train_job *train_job;	/* Async training in progress */
+	long long train_samples;
+	long long train_bytes;		/* 0 scales with the dictionary */
+	struct migrator migrator;
+
+	struct worker_pool pool;
+	long long offload_threshold;	/* Min value size for the pool */
+	size_t noffloaded;
+
+	long long min_size;
+	long long detect;		/* Check for incompressible data */
+	long long max_entropy;
+	long long chunk_size;		/* Chunk larger values; 0 disables */
+	long long log_block_size;	/* APPEND makes logs; 0 disables */
+	size_t nlogs;
+	size_t log_tail_bytes;		/* Not compressed yet */
+	struct large_params large;
+	size_t nskipped[SKIP_NREASONS];
+
+	struct value_cache cache;
+
+	pthread_t main_thread;
+	pthread_mutex_t free_lock;
+	struct deferred_free *free_list;
+	int free_timer;			/* Draining free_list */
+
+	long long stats;		/* Time commands and zstd calls */
+	struct latency_hist latency[STAT_NCMDS];
+	struct codec_stats codec;	/* Without dictionary */
 };
 
 /*
- * Compressessed String object.
+ * Compressed string. Values are at most MAX_STRING_SIZE bytes, so 32 bit
+ * lengths are enough, and the dictionary is referred to by its slot rather
+ * than a pointer. Values below large-threshold are a single zstd frame
+ * without the magic number, dictionary ID and content size, which the
+ * header already has. zipstr_frames() puts the magic number back for RDB
+ * files, the AOF, replicas and clients, so they get standard frames.
  */
 struct zipstr {
-	size_t orig_len;
-	size_t len;
-	struct dict *dict;
+	uint32_t orig_len;
+	uint32_t len;
+	uint16_t dict_slot;	/* In module.dict_slots, 0 for none */
+	uint8_t flags;
 	char buf[];
 };
 
+#define	ZIPSTR_MAGICLESS	0x01	/* buf is a frame without its magic */
+
+/* Header of objects before the compact form, for INFO */
+#define	ZIPSTR_HDR_V1	(2 * sizeof (size_t) + 2 * sizeof (void *))
+
+/*
+ * Compressed hash. Field values are compressed one by one with the
+ * dictionary of the key's prefix, so reading a field only decompresses that
+ * field. Small hashes keep their entries back to back in one buffer that is
+ * scanned linearly, like the listpacks of Redis hashes. A hash moves to a
+ * dict of its fields once it has more than hash-max-packed-entries fields,
+ * or a value stored in more than hash-max-packed-value bytes.
+ */
+struct ziphash {
+	size_t nfields;
+	size_t fields_len;		/* Of all field names */
+	size_t orig_len;		/* Of all values */
+	size_t len;			/* Of all values as stored */
+	RedisModuleDict *fields;	/* Field to hash_value, unless packed */
+	char *packed;			/* Entries, while packed */
+	size_t packed_len;
+	uint16_t dict_slot;		/* In module.dict_slots, 0 for none */
+};
+
+/*
+ * Value of a field: a magicless frame if len is less than orig_len, the
+ * value as is otherwise. A packed entry has the field length, orig_len and
+ * len as 32 bit little endian integers, then the field and the value.
+ */
+struct hash_value {
+	uint32_t orig_len;
+	uint32_t len;
+	char buf[];
+};
+
+/*
+ * Field of a hash, found or iterated over.
+ */
+struct hash_entry {
+	const char *field;
+	size_t field_len;
+	uint32_t orig_len;
+	uint32_t len;
+	const char *value;
+	size_t off;			/* Of the entry, if packed */
+	struct hash_value *hv;		/* Unless packed */
+};
+
+struct hash_iter {
+	const struct ziphash *zh;
+	size_t off;
+	RedisModuleDictIter *iter;	/* Unless packed */
+};
+
+#define	PREFIX_CACHE_SIZE	8
+
+/*
+ * Chunked objects start with a zstd skippable frame holding the chunk size,
+ * the number of chunks and the end offset of each chunk's frame. One frame
+ * per chunk follows. The buffer is still a valid zstd stream, so the whole
+ * object decompresses like any other.
+ *
+ * Logs, built by APPEND, start with a skippable frame of LOG_MAGIC holding
+ * the block size and the number of blocks. The frames of the blocks sealed
+ * so far follow, then the tail, which isn't compressed until it fills a
+ * block, and the end offset of each frame last, so that both grow in place.
+ * Each block but the first of every LOG_CHAIN is compressed with the
+ * previous block as a prefix, so logs are only decoded by the module.
+ */
+struct chunk_index {
+	size_t chunk_size;
+	size_t nchunks;
+	const unsigned char *ends;	/* LE32 end offset of each frame */
+	const char *frames;
+};
+
+/*
+ * Dictionary lookups for the keys of a single command. Keys in a batch tend
+ * to share a few prefixes, so each prefix is only looked up once. Entries
+ * are keyed on the key up to its last delimiter, which is all that decides
+ * the match.
+ */
+struct prefix_cache {
+	int n;
+	struct {
+		const char *prefix;
+		size_t len;
+		struct dict *dict;
+	} entries[PREFIX_CACHE_SIZE];
+};
+
+struct train_sample {
+	char *data;
+	size_t len;
+};
+
+/*
+ * Reservoir of training samples. Every key that can serve as a sample has
+ * the same chance of being in it once the keyspace has been scanned.
+ */
 struct train_data {
 	const char *match_prefix;
 	size_t match_len;
-	char *buf;
-	size_t buflen;
-	size_t offset;
+	struct train_sample *samples;
 	size_t nsamples;
 	size_t max_nsamples;
-	size_t *sample_sizes;
+	size_t bytes;
+	size_t max_bytes;
+	uint64_t seen;			/* Keys eligible as samples */
+	uint64_t rng;			/* xorshift64 state */
+};
+
+enum train_state {
+	TRAIN_SAMPLING,
+	TRAIN_TRAINING,
+	TRAIN_DONE
+};
+
+enum train_algo {
+	TRAIN_DEFAULT,		/* As ZDICT_trainFromBuffer */
+	TRAIN_FASTCOVER,	/* fastCover searching k, d and more steps */
+	TRAIN_COVER
+};
+
+/*
+ * Dictionary training job. Samples are collected on the main thread and
+ * copied into the job's private buffer, so the ZDICT step can run on a
+ * worker thread without touching the keyspace.
+ */
+struct train_job {
+	long long id;
+	enum train_state state;
+	int cancelled;
+	long long started;
+
+	char *prefix;
+	size_t prefix_len;
+	struct train_data train;
+	RedisModuleScanCursor *cursor;
+
+	enum train_algo algo;
+	unsigned nthreads;		/* Parameter search threads */
+	int level;
+
+	char *dictbuf;
+	size_t dictbuf_len;
+	size_t dict_size;		/* ZDICT result (size or error code) */
+	unsigned k;			/* Chosen parameters */
+	unsigned d;
+	size_t nheldout;		/* Samples kept out of training */
+	double ratio;			/* On the held-out samples */
+
+	RedisModuleBlockedClient *bc;
+	RedisModuleCtx *scan_ctx;	/* Has the db of the blocked client */
+	RedisModuleTimerID timer;
+};
+
+/*
+ * Module options. Set as load arguments, or using COMPRESS.CONFIG SET if
+ * they can be changed at runtime.
+ */
+struct config_opt {
+	const char *name;
+	long long *value;
+	long long min;
+	long long max;
+	int runtime;
+	char **str;			/* Set instead of value for strings */
+	void (*changed)(void);
 };
 
 static RedisModuleType *ZipString_Type;
+static RedisModuleType *ZipHash_Type;
 static struct compress_module module;
 
+void delimiters_changed(void);
+void cache_size_changed(void);
+int zipstr_log(const struct zipstr *zs, struct chunk_index *li);
+size_t log_tail_len(const struct zipstr *zs, const struct chunk_index *li);
+void compress_job_install(struct compress_job *job);
+int dctx_use_dict(struct compress_module *module, struct dict *dict,
+    ZSTD_format_e format);
+
+static struct config_opt config_opts[] = {
+	{ "threads", &module.pool.nthreads, 0, 64, 0, NULL, NULL },
+	{ "offload-threshold", &module.offload_threshold, 0, LLONG_MAX, 1,
+	    NULL, NULL },
+	{ "autotune", &module.autotune, 0, 1, 1, NULL, NULL },
+	{ "cpu-budget-us", &module.cpu_budget_us, 1, LLONG_MAX, 1, NULL, NULL },
+	{ "min-size", &module.min_size, 0, LLONG_MAX, 1, NULL, NULL },
+	{ "detect-incompressible", &module.detect, 0, 1, 1, NULL, NULL },
+	{ "max-entropy", &module.max_entropy, 0, 800, 1, NULL, NULL },
+	{ "delimiters", NULL, 0, 0, 1, &module.delimiters, delimiters_changed },
+	{ "chunk-size", &module.chunk_size, 0, UINT32_MAX, 1, NULL, NULL },
+	{ "log-block-size", &module.log_block_size, 0, UINT32_MAX, 1, NULL,
+	    NULL },
+	{ "cache-size", &module.cache.max_bytes, 0, LLONG_MAX, 1, NULL,
+	    cache_size_changed },
+	{ "cache-admit", &module.cache.admit, 1, CACHE_FREQ_MAX, 1, NULL,
+	    NULL },
+	{ "ddict-idle-timeout", &module.ddict_idle_timeout, 0, LLONG_MAX, 1,
+	    NULL, NULL },
+	{ "migrate-budget-ms", &module.migrator.budget_ms, 1, 1000, 1, NULL,
+	    NULL },
+	{ "stats", &module.stats, 0, 1, 1, NULL, NULL },
+	{ "large-threshold", &module.large.threshold, 0, LLONG_MAX, 1, NULL,
+	    NULL },
+	{ "large-workers", &module.large.workers, 0, 64, 1, NULL, NULL },
+	/*
+	 * At most ZSTD_WINDOWLOG_LIMIT_DEFAULT, the window the DCtx accepts
+	 * since dctx_use_dict() leaves ZSTD_d_windowLogMax as is. Objects
+	 * compressed with a larger window couldn't be read back.
+	 */
+	{ "large-window-log", &module.large.window_log, 10, 27, 1, NULL, NULL },
+	{ "large-ldm", &module.large.ldm, 0, 1, 1, NULL, NULL },
+	{ "train-samples", &module.train_samples, 1, 1 << 24, 1, NULL, NULL },
+	{ "train-bytes", &module.train_bytes, 0, UINT32_MAX, 1, NULL, NULL },
+	{ "hash-max-packed-entries", &module.hash_max_packed_entries, 0,
+	    LLONG_MAX, 1, NULL, NULL },
+	{ "hash-max-packed-value", &module.hash_max_packed_value, 0,
+	    UINT32_MAX, 1, NULL, NULL },
+	{ "transparent-hash", &module.transparent_hash, 0, 1, 1, NULL, NULL },
+};
+
+
+struct prefix_node *prefix_node_child(const struct prefix_node *node,
+    unsigned char c) {
+	for (unsigned i = 0; i < node->nchildren; i++) {
+		if (node->children[i].c == c)
+			return node->children[i].node;
+		if (node->children[i].c > c)
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * Dictionary of the longest prefix of key that is followed by a delimiter.
+ * Walks the trie once along the key without allocating.
+ */
+struct dict *prefix_index_match(const struct prefix_node *root,
+    const unsigned char *is_delim, const char *key, size_t keylen) {
+	const struct prefix_node *node = root;
+	struct dict *best = NULL;
+
+	for (size_t i = 0; i < keylen && node != NULL; i++) {
+		const unsigned char c = key[i];
+
+		/* node holds the prefix key[0..i) */
+		if (is_delim[c] && node->dict != NULL)
+			best = node->dict;
+		node = prefix_node_child(node, c);
+	}
+	return best;
+}
+
+/*
+ * Dictionary of exactly prefix.
+ */
+struct dict *prefix_index_get(const struct prefix_node *root,
+    const char *prefix, size_t len) {
+	const struct prefix_node *node = root;
+
+	for (size_t i = 0; i < len && node != NULL; i++)
+		node = prefix_node_child(node, prefix[i]);
+
+	return node != NULL ? node->dict : NULL;
+}
+
+/*
+ * Set the dictionary of prefix. Returns the dictionary it replaced.
+ */
+struct dict *prefix_index_set(struct prefix_node *root, const char *prefix,
+    size_t len, struct dict *dict) {
+	struct prefix_node *node = root;
+
+	for (size_t i = 0; i < len; i++) {
+		const unsigned char c = prefix[i];
+		struct prefix_node *child = prefix_node_child(node, c);
+
+		if (child == NULL) {
+			unsigned pos = 0;
+
+			while (pos < node->nchildren &&
+			    node->children[pos].c < c)
+				pos++;
+
+			node->children = RedisModule_Realloc(node->children,
+			    (node->nchildren + 1) * sizeof (*node->children));
+			(void) memmove(&node->children[pos + 1],
+			    &node->children[pos],
+			    (node->nchildren - pos) * sizeof (*node->children));
+			child = RedisModule_Calloc(1, sizeof (*child));
+			node->children[pos].c = c;
+			node->children[pos].node = child;
+			node->nchildren++;
+		}
+		node = child;
+	}
+
+	struct dict *const old = node->dict;
+	node->dict = dict;
+	return old;
+}
+
+/*
+ * Remove the dictionary of prefix, pruning nodes left empty. Returns 1 if
+ * node itself is now empty.
+ */
+int prefix_index_del(struct prefix_node *node, const char *prefix,
+    size_t len) {
+	if (len == 0) {
+		node->dict = NULL;
+		return node->nchildren == 0;
+	}
+
+	unsigned pos;
+	for (pos = 0; pos < node->nchildren; pos++) {
+		if (node->children[pos].c == (unsigned char)prefix[0])
+			break;
+	}
+	if (pos == node->nchildren)
+		return 0;
+
+	struct prefix_node *const child = node->children[pos].node;
+	if (prefix_index_del(child, prefix + 1, len - 1)) {
+		RedisModule_Free(child->children);
+		RedisModule_Free(child);
+		node->nchildren--;
+		(void) memmove(&node->children[pos], &node->children[pos + 1],
+		    (node->nchildren - pos) * sizeof (*node->children));
+	}
+	return node->dict == NULL && node->nchildren == 0;
+}
 
 void dict_hold(struct dict *dict, const struct zipstr *zs) {
 	if (dict == NULL)
@@ -94,11 +745,121 @@ void dict_hold(struct dict *dict, const struct zipstr *zs) {
 	}
 }
 
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Histogram bucket of a time in nanoseconds.
+ */
+unsigned hist_bucket(uint64_t ns) {
+	if (ns < (1 << HIST_SUB_BITS))
+		return ns;
+
+	const unsigned e = 63 - __builtin_clzll(ns);
+	const unsigned sub = (ns >> (e - HIST_SUB_BITS)) &
+	    ((1 << HIST_SUB_BITS) - 1);
+
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+/*
+ * Largest time that falls in bucket b.
+ */
+uint64_t hist_bucket_max(unsigned b) {
+	if (b < (1 << HIST_SUB_BITS))
+		return b;
+
+	const unsigned e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	const uint64_t step = (uint64_t)1 << (e - HIST_SUB_BITS);
+	const uint64_t min = ((uint64_t)1 << e) +
+	    (b & ((1 << HIST_SUB_BITS) - 1)) * step;
+
+	return min + (step - 1);
+}
+
+void hist_record(struct latency_hist *h, uint64_t ns) {
+	h->count++;
+	h->total_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->buckets[hist_bucket(ns)]++;
+}
+
+/*
+ * Upper bound of quantile q (0 to 1) of the recorded times.
+ */
+uint64_t hist_quantile(const struct latency_hist *h, double q) {
+	const uint64_t rank = (uint64_t)(q * h->count + 0.5);
+	uint64_t seen = 0;
+
+	if (h->count == 0)
+		return 0;
+	for (unsigned b = 0; b < HIST_NBUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank && seen > 0) {
+			const uint64_t max = hist_bucket_max(b);
+			return max < h->max_ns ? max : h->max_ns;
+		}
+	}
+	return h->max_ns;
+}
+
+struct codec_stats *codec_stats(struct compress_module *mod,
+    struct dict *dict) {
+	return dict != NULL ? &dict->stats : &mod->codec;
+}
+
+void codec_record_compress(struct compress_module *mod, struct dict *dict,
+    uint64_t ns, size_t len, size_t compressed_len) {
+	struct codec_stats *const st = codec_stats(mod, dict);
+
+	st->compressions++;
+	st->bytes_in += len;
+	st->bytes_out += compressed_len;
+	st->compress_ns += ns;
+}
+
+void codec_record_decompress(struct compress_module *mod, struct dict *dict,
+    uint64_t ns, size_t len) {
+	struct codec_stats *const st = codec_stats(mod, dict);
+
+	st->decompressions++;
+	st->bytes_decompressed += len;
+	st->decompress_ns += ns;
+}
+
+/*
+ * Tuner step with the level closest to clevel.
+ */
+int tune_step(int clevel) {
+	int step = 0;
+
+	for (int i = 1; i < TUNE_NLEVELS; i++) {
+		if (abs(tune_levels[i] - clevel) <
+		    abs(tune_levels[step] - clevel))
+			step = i;
+	}
+	return step;
+}
+
+void dict_free_cdicts(struct dict *dict) {
+	for (int i = 0; i < TUNE_NLEVELS; i++) {
+		if (dict->cdicts[i] != NULL) {
+			ZSTD_freeCDict(dict->cdicts[i]);
+			dict->cdicts[i] = NULL;
+		}
+	}
+}
+
 void dict_free(struct dict *dict) {
-	if (dict->cdict != NULL)
-		ZSTD_freeCDict(dict->cdict);
+	dict_free_cdicts(dict);
 	if (dict->ddict != NULL)
 		ZSTD_freeDDict(dict->ddict);
+	RedisModule_Free(dict->prefix);
 	RedisModule_Free(dict->buf);
 	RedisModule_Free(dict);
 }
@@ -111,6 +872,11 @@ void dict_rele(struct compress_module *mod, struct dict *dict,
 	if (--dict->refcnt == 0) {
 		RedisModule_DictDelC(mod->all_dicts, &dict->id,
 		    sizeof (dict->id), NULL);
+		if (mod->dctx_dict == dict) {
+			(void) ZSTD_DCtx_refDDict(mod->dctx, NULL);
+			mod->dctx_dict = NULL;
+		}
+		mod->dict_slots[dict->slot] = NULL;
 		dict_free(dict);
 		return;
 	}
@@ -122,19 +888,55 @@ void dict_rele(struct compress_module *mod, struct dict *dict,
 }
 
 /*
- * Create ref counted dictionary.
+ * Free slot for a new dictionary, growing the table if needed, or 0 if all
+ * DICT_MAX_SLOTS are taken.
  */
-long long dict_create_with_id(struct compress_module *mod, long long id,
+uint16_t dict_slot_alloc(struct compress_module *mod) {
+	for (size_t i = 1; i < mod->ndict_slots; i++) {
+		if (mod->dict_slots[i] == NULL)
+			return (uint16_t)i;
+	}
+	if (mod->ndict_slots == DICT_MAX_SLOTS)
+		return 0;
+
+	const size_t slot = mod->ndict_slots > 0 ? mod->ndict_slots : 1;
+	size_t n = mod->ndict_slots > 0 ? mod->ndict_slots * 2 : 16;
+
+	if (n > DICT_MAX_SLOTS)
+		n = DICT_MAX_SLOTS;
+	mod->dict_slots = RedisModule_Realloc(mod->dict_slots,
+	    n * sizeof (*mod->dict_slots));
+	for (size_t i = mod->ndict_slots; i < n; i++)
+		mod->dict_slots[i] = NULL;
+	mod->ndict_slots = n;
+
+	return (uint16_t)slot;
+}
+
+/*
+ * Create ref counted dictionary. The caller owns the only reference. The
+ * CDict is created when the dictionary is activated, the DDict when an
+ * object is first decompressed with it.
+ */
+struct dict *dict_new(struct compress_module *mod, long long id,
     const char *buf, size_t buflen, const char *prefix, size_t prefix_len,
     int clevel) {
 	if (RedisModule_DictGetC(mod->all_dicts, &id, sizeof (id),
 	    NULL) != NULL) {
 		RedisModule_Log(NULL, "error", "Duplicate dictionary ID");
-		return -1;
+		return NULL;
+	}
+
+	const uint16_t slot = dict_slot_alloc(mod);
+	if (slot == 0) {
+		RedisModule_Log(NULL, "warning", "Too many dictionaries");
+		return NULL;
 	}
 
-	struct dict *const dict = RedisModule_Alloc(sizeof (*dict));
+	struct dict *const dict = RedisModule_Calloc(1, sizeof (*dict));
 
+	mod->dict_slots[slot] = dict;
+	dict->slot = slot;
 	dict->id = id;
 	dict->prefix = NULL;
 	dict->prefix_len = 0;
@@ -149,450 +951,5119 @@ long long dict_create_with_id(struct compress_module *mod, long long id,
 	dict->buflen = buflen;
 	dict->buf = RedisModule_Alloc(dict->buflen);
 	(void) memcpy(dict->buf, buf, dict->buflen);
-	dict->cdict = ZSTD_createCDict_byReference(dict->buf, buflen, clevel);
-	dict->ddict = ZSTD_createDDict_byReference(dict->buf, buflen);
-
-	if (dict->cdict == NULL || dict->ddict == NULL) {
-		RedisModule_Log(NULL, "error", "Could not create dict");
-		dict_free(dict);
-		return -1;
-	}
+	dict->tuner.step = tune_step(clevel);
 	dict->refcnt = 1;
 
 	(void) RedisModule_DictSetC(mod->all_dicts, &dict->id,
 	    sizeof (dict->id), dict);
 
-	if (prefix != NULL) {
-		struct dict *const pdict = RedisModule_DictGetC(
-		    mod->prefix_dicts, dict->prefix, dict->prefix_len, NULL);
-		if (pdict != NULL) {
-			dict_rele(mod, pdict, NULL);
-		}
-		(void) RedisModule_DictSetC(mod->prefix_dicts, dict->prefix,
-		    dict->prefix_len, dict);
-	} else {
-		/* drop previous default dictionary */
-		dict_rele(mod, mod->dict, NULL);
-		mod->dict = dict;
-	}
-
-	return dict->id;
+	return dict;
 }
 
-long long dict_create(struct compress_module *mod, const char *buf,
-    size_t buflen, const char *prefix, size_t prefix_len, int clevel) {
+struct dict *dict_slot_get(uint16_t slot) {
+	return slot != 0 ? module.dict_slots[slot] : NULL;
+}
 
-	return dict_create_with_id(mod, RedisModule_Milliseconds(),
-	    buf, buflen, prefix, prefix_len, clevel);
+/*
+ * Dictionary the object was compressed with, or NULL.
+ */
+struct dict *zipstr_dict(const struct zipstr *zs) {
+	return dict_slot_get(zs->dict_slot);
 }
 
-void zipstr_free(void *value) {
-	struct zipstr *const zs = value;
+/*
+ * Bytes of the standard frame header left out of a magicless frame: the
+ * magic number, dictionary ID and content size, less the window descriptor
+ * that replaces the latter.
+ */
+size_t zipstr_frame_saving(const struct zipstr *zs) {
+	const struct dict *const dict = zipstr_dict(zs);
+	const unsigned id = dict != NULL ?
+	    ZSTD_getDictID_fromDict(dict->buf, dict->buflen) : 0;
+	size_t saved = 4 - 1;
+
+	saved += id == 0 ? 0 : id < 256 ? 1 : id < 65536 ? 2 : 4;
+	saved += zs->orig_len < 256 ? 1 : zs->orig_len < 65536 + 256 ? 2 : 4;
+	return saved;
+}
 
-	module.mem_total_uncompressed -= zs->orig_len;
-	module.mem_total_compressed -= zs->len;
-	module.nobjs--;
+/*
+ * Memory used by the dictionary, including its CDicts and DDict.
+ */
+size_t dict_mem(const struct dict *dict) {
+	size_t mem = sizeof (*dict) + dict->prefix_len + dict->buflen;
 
-	dict_rele(&module, zs->dict, zs);
+	for (int i = 0; i < TUNE_NLEVELS; i++)
+		mem += ZSTD_sizeof_CDict(dict->cdicts[i]);
+	mem += ZSTD_sizeof_DDict(dict->ddict);
 
-	RedisModule_Free(zs);
+	return mem;
 }
 
-struct zipstr *zipstr_alloc(struct compress_module *module,
-    struct dict *dict, const char *compressed_data, size_t len,
-    size_t orig_len) {
+int dict_is_active(const struct compress_module *mod,
+    const struct dict *dict) {
+	if (dict->prefix_len > 0) {
+		return prefix_index_get(&mod->prefix_dicts, dict->prefix,
+		    dict->prefix_len) == dict;
+	}
+	return mod->dict == dict;
+}
 
-	/* Data was compressed successfully; create an object */ 
-	struct zipstr *const zs = RedisModule_Alloc(sizeof(*zs) + len);
-	zs->orig_len = orig_len;
-	zs->len = len;
-	zs->dict = dict;
-	(void) memcpy(zs->buf, compressed_data, zs->len);
-
-	dict_hold(zs->dict, zs);
-	
-	module->mem_total_uncompressed += zs->orig_len;
-	module->mem_total_compressed += zs->len;
-	module->nobjs++;
+/*
+ * CDict for the current level of dict, created if needed. Returns NULL if
+ * it can't be created.
+ */
+const ZSTD_CDict *dict_cdict(struct dict *dict) {
+	const int step = dict->tuner.step;
 
-	return zs;
+	dict->cdict_used = module.clock;
+	if (dict->cdicts[step] == NULL) {
+		dict->cdicts[step] = ZSTD_createCDict_byReference(dict->buf,
+		    dict->buflen, tune_levels[step]);
+	}
+	return dict->cdicts[step];
 }
 
 /*
- * Create a compressed string from the original data.
+ * Free the CDicts of a dictionary that no longer compresses new values.
  */
-struct zipstr *zipstr_create(struct compress_module *module, const char *key,
-    size_t keylen, const char *data, size_t len) {
+void dict_trim(struct compress_module *mod, struct dict *dict) {
+	if (dict != NULL && dict->njobs == 0 && !dict_is_active(mod, dict))
+		dict_free_cdicts(dict);
+}
 
-	const char *const pos = memchr(key, ':', keylen);
-	struct dict *dict = NULL;
-	size_t clen;
+/*
+ * Use dict for new objects of its prefix, or as the default dictionary,
+ * taking over a reference from the caller. Fails, leaving the reference to
+ * the caller, if the CDict can't be created.
+ */
+int dict_activate(struct compress_module *mod, struct dict *dict) {
+	struct dict *old;
 
-	if (pos != NULL) {
-		/* look for dict */
-		dict = RedisModule_DictGetC(module->prefix_dicts,
-		    (void *)key, (pos - key), NULL);
-	}
-	if (dict == NULL) {
-		dict = module->dict;
+	if (dict_cdict(dict) == NULL) {
+		RedisModule_Log(NULL, "warning", "Could not create dict");
+		return -1;
 	}
 
-	/* Use dictionary, if available */
-	if (dict != NULL) {
-		clen = ZSTD_compress_usingCDict(module->cctx, module->buf,
-		    module->buflen, data, len, dict->cdict);
+	if (dict->prefix_len > 0) {
+		/* drop previous dictionary for the prefix */
+		old = prefix_index_set(&mod->prefix_dicts, dict->prefix,
+		    dict->prefix_len, dict);
 	} else {
-		clen = ZSTD_compress(module->buf, module->buflen, data, len,
-		    module->clevel);
-	}
-
-	if (ZSTD_isError(clen) != 0) {
-		return NULL;
+		/* drop previous default dictionary */
+		old = mod->dict;
+		mod->dict = dict;
 	}
+	dict_trim(mod, old);
+	dict_rele(mod, old, NULL);
 
-	/* Data was compressed successfully; allocate the object */ 
-	return zipstr_alloc(module, dict, module->buf, clen, len);
+	return 0;
 }
 
-void zipstr_rdb_save(RedisModuleIO *rdb, void *value) {
-	struct zipstr *const zs = value;
-	uint64_t dict_id = 0;
+long long dict_create_with_id(struct compress_module *mod, long long id,
+    const char *buf, size_t buflen, const char *prefix, size_t prefix_len,
+    int clevel) {
+	struct dict *const dict = dict_new(mod, id, buf, buflen, prefix,
+	    prefix_len, clevel);
 
-	if (zs->dict != NULL) {
-		dict_id = zs->dict->id;
+	if (dict == NULL)
+		return -1;
+	if (dict_activate(mod, dict) != 0) {
+		dict_rele(mod, dict, NULL);
+		return -1;
 	}
-	RedisModule_SaveUnsigned(rdb, zs->orig_len); 
-	// TODO No need to encode the length; it's in the RDB.
-	RedisModule_SaveUnsigned(rdb, zs->len); 
-	RedisModule_SaveUnsigned(rdb, dict_id); 
-	RedisModule_SaveStringBuffer(rdb, zs->buf, zs->len);
+
+	return id;
 }
 
-void *zipstr_rdb_load(RedisModuleIO *rdb, int encver) {
-	if (encver != ZIPSTR_ENCODING_VERSION) {
-		RedisModule_Log(NULL, "notice", "Unknown version (%d)", encver);
-		return NULL;
-	}
+/*
+ * Record a compression and adjust the level once per window. The CDict for
+ * a new level is created before moving to it, so dict_cdict() always has
+ * one.
+ */
+void tuner_record(struct compress_module *mod, struct level_tuner *t,
+    struct dict *dict, uint64_t ns, size_t in, size_t out) {
+	t->samples++;
+	t->ns += ns;
+	t->bytes_in += in;
+	t->bytes_out += out;
+
+	if (t->samples < TUNE_WINDOW)
+		return;
 
-	const uint64_t orig_len = RedisModule_LoadUnsigned(rdb);
-	const uint64_t len = RedisModule_LoadUnsigned(rdb);
-	const uint64_t dict_id = RedisModule_LoadUnsigned(rdb);
-	char *buf = RedisModule_LoadStringBuffer(rdb, NULL);
-	struct dict *dict = NULL;
+	const double avg_us = (double)t->ns / 1000 / t->samples;
+	const long long budget = mod->cpu_budget_us;
+	int next = t->step;
 
-	if (dict_id != 0) {
-		/* TODO if dict_id != 0, lookup dict */
-		dict = RedisModule_DictGetC(module.all_dicts,
-		    (void *)&dict_id, sizeof (dict_id), NULL);
-		if (dict == NULL) {
-			RedisModule_Log(NULL, "error",
-			    "Could not find dict (%llu) for object",
-			    dict_id);
-			RedisModule_Free(buf);
-			return NULL;
-		}
-		RedisModule_Log(NULL, "debug", "Found dict (%llu) for object",
-		    dict_id);
+	t->ratio[t->step] = (double)t->bytes_in / (double)t->bytes_out;
+
+	if (avg_us > budget && t->step > 0) {
+		next = t->step - 1;
+	} else if (avg_us * 2 < budget && t->step + 1 < TUNE_NLEVELS &&
+	    (t->ratio[t->step + 1] == 0 ||
+	    t->ratio[t->step + 1] > t->ratio[t->step] * TUNE_MIN_GAIN)) {
+		/* Plenty of headroom and the higher level pays off */
+		next = t->step + 1;
 	}
 
-	struct zipstr *const zs = zipstr_alloc(&module, dict, buf, len,
-	    orig_len);
-	RedisModule_Free(buf);
+	if (next != t->step && dict != NULL && dict->cdicts[next] == NULL) {
+		dict->cdicts[next] = ZSTD_createCDict_byReference(dict->buf,
+		    dict->buflen, tune_levels[next]);
+		if (dict->cdicts[next] == NULL)
+			next = t->step;
+	}
+	t->step = next;
 
-	return zs;
+	t->samples = 0;
+	t->ns = 0;
+	t->bytes_in = 0;
+	t->bytes_out = 0;
 }
 
-void zipstr_aux_save(RedisModuleIO *rdb, int when) {
-	RedisModule_Log(NULL, "error", "AUX Save");
+/*
+ * Stop using the dictionary for new objects. Returns -1 if it wasn't in use.
+ */
+int dict_deactivate(struct compress_module *mod, struct dict *dict) {
+	if (!dict_is_active(mod, dict))
+		return -1;
 
-	/* Store dictionary information before the RDB data */
-	if (when != REDISMODULE_AUX_BEFORE_RDB) {
-		return;
+	if (dict->prefix_len > 0) {
+		(void) prefix_index_del(&mod->prefix_dicts, dict->prefix,
+		    dict->prefix_len);
+	} else {
+		mod->dict = NULL;
 	}
 
-	const uint64_t ndicts = RedisModule_DictSize(module.all_dicts);
-	RedisModule_Log(NULL, "debug", "Saving %llu dicts", ndicts);
-	RedisModule_SaveUnsigned(rdb, ndicts);
+	dict_trim(mod, dict);
+	dict_rele(mod, dict, NULL);
+	return 0;
+}
 
-	RedisModuleDictIter *const iter = RedisModule_DictIteratorStartC(
-	    module.all_dicts, "^", NULL, 0);
+long long dict_create(struct compress_module *mod, const char *buf,
+    size_t buflen, const char *prefix, size_t prefix_len, int clevel) {
 
-	void *data;
-	while (RedisModule_DictNextC(iter, NULL, &data) != NULL) {
-		const struct dict *dict = data;
+	return dict_create_with_id(mod, RedisModule_Milliseconds(),
+	    buf, buflen, prefix, prefix_len, clevel);
+}
 
-		RedisModule_Log(NULL, "debug", "Saving dict %llu", dict->id);
-		RedisModule_SaveUnsigned(rdb, dict->id);
-		RedisModule_SaveUnsigned(rdb, dict->prefix_len);
-		if (dict->prefix_len > 0) {
-			RedisModule_SaveStringBuffer(rdb, dict->prefix,
-			    dict->prefix_len);
-		}
-		RedisModule_SaveStringBuffer(rdb, dict->buf, dict->buflen);
-	}
+uint64_t ptr_hash(const void *p) {
+	uint64_t h = (uintptr_t)p;
 
-	RedisModule_DictIteratorStop(iter);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h;
 }
 
-int zipstr_aux_load(RedisModuleIO *rdb, int encver, int when) {
-	RedisModule_Log(NULL, "error", "AUX Load");
+struct cache_entry *cache_find(const struct value_cache *c,
+    const struct zipstr *zs) {
 
-	if (encver != ZIPSTR_ENCODING_VERSION) {
-		RedisModule_Log(NULL, "warning",
-		    "Unknown encoding version (%d)", encver);
-		return REDISMODULE_ERR;
+	if (c->nentries == 0)
+		return NULL;
+
+	struct cache_entry *e = c->buckets[ptr_hash(zs) & (c->nbuckets - 1)];
+	while (e != NULL && e->zs != zs)
+		e = e->hnext;
+
+	return e;
+}
+
+/*
+ * Count a read of zs in the sketch and return its estimated frequency.
+ * Only the smallest counters are incremented.
+ */
+unsigned cache_freq_touch(struct value_cache *c, const struct zipstr *zs) {
+	const uint64_t h = ptr_hash(zs);
+	unsigned char *const a = &c->freq[h & (CACHE_SKETCH_SIZE - 1)];
+	unsigned char *const b = &c->freq[(h >> 32) & (CACHE_SKETCH_SIZE - 1)];
+	const unsigned f = *a < *b ? *a : *b;
+
+	if (f < CACHE_FREQ_MAX) {
+		if (*a == f)
+			(*a)++;
+		if (*b == f)
+			(*b)++;
 	}
 
-	if (when != REDISMODULE_AUX_BEFORE_RDB) {
-		return REDISMODULE_OK;
+	/* Age the counters so that keys that turned cold can be evicted */
+	if (++c->nfreq >= CACHE_SKETCH_SIZE * 8) {
+		for (size_t i = 0; i < CACHE_SKETCH_SIZE; i++)
+			c->freq[i] >>= 1;
+		c->nfreq = 0;
 	}
 
-	const uint64_t ndicts = RedisModule_LoadUnsigned(rdb);
-	RedisModule_Log(NULL, "debug", "Loading %llu dicts", ndicts);
+	return f + (f < CACHE_FREQ_MAX);
+}
 
-	for (uint64_t i = 0; i < ndicts; i++) {
-		const uint64_t id = RedisModule_LoadUnsigned(rdb);
-		const uint64_t prefix_len = RedisModule_LoadUnsigned(rdb);
-		char *prefix = NULL;
+unsigned cache_freq(const struct value_cache *c, const struct zipstr *zs) {
+	const uint64_t h = ptr_hash(zs);
+	const unsigned char a = c->freq[h & (CACHE_SKETCH_SIZE - 1)];
+	const unsigned char b = c->freq[(h >> 32) & (CACHE_SKETCH_SIZE - 1)];
 
-		if (prefix_len > 0) {
-			prefix = RedisModule_LoadStringBuffer(rdb, NULL);
-		}
-		size_t buflen;
-		char *const buf = RedisModule_LoadStringBuffer(rdb,
-		    &buflen);
+	return a < b ? a : b;
+}
 
-		RedisModule_Log(NULL, "debug", "Loading dict with ID %llu", id);
-		long long ret = dict_create_with_id(&module, id, buf,
-		    buflen, prefix, prefix_len, module.clevel);
-		RedisModule_Free(buf);
-		RedisModule_Free(prefix);
-		if (ret < 0) {
-			RedisModule_Log(NULL, "error",
-			    "Failed to load dict %llu", id);
-			return REDISMODULE_ERR;
-		}
+void cache_lru_unlink(struct value_cache *c, struct cache_entry *e) {
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+}
+
+void cache_lru_push(struct value_cache *c, struct cache_entry *e) {
+	e->prev = NULL;
+	e->next = c->head;
+	if (c->head != NULL)
+		c->head->prev = e;
+	else
+		c->tail = e;
+	c->head = e;
+}
+
+void cache_hash_unlink(struct value_cache *c, struct cache_entry *e) {
+	struct cache_entry **pe =
+	    &c->buckets[ptr_hash(e->zs) & (c->nbuckets - 1)];
+
+	while (*pe != e)
+		pe = &(*pe)->hnext;
+	*pe = e->hnext;
+}
+
+void cache_hash_insert(struct value_cache *c, struct cache_entry *e) {
+	const size_t b = ptr_hash(e->zs) & (c->nbuckets - 1);
+
+	e->hnext = c->buckets[b];
+	c->buckets[b] = e;
+}
+
+void cache_delete(struct value_cache *c, struct cache_entry *e) {
+	cache_hash_unlink(c, e);
+	cache_lru_unlink(c, e);
+
+	c->nentries--;
+	c->bytes -= sizeof (*e) + e->len;
+	RedisModule_Free(e);
+}
+
+/*
+ * Drop the cached copy of zs, if any. Called whenever an object is freed,
+ * as its address may be reused.
+ */
+void cache_remove(struct value_cache *c, const struct zipstr *zs) {
+	struct cache_entry *const e = cache_find(c, zs);
+
+	if (e != NULL)
+		cache_delete(c, e);
+}
+
+void cache_evict(struct value_cache *c, size_t max_bytes) {
+	while (c->bytes > max_bytes) {
+		cache_delete(c, c->tail);
+		c->evictions++;
 	}
-	return REDISMODULE_OK;
 }
 
-const char *zipstr_decompress(struct compress_module *module,
-    const struct zipstr *zs, size_t *buflen) {
+void cache_size_changed(void) {
+	struct value_cache *const c = &module.cache;
 
-	size_t orig_len;
-	if (zs->dict != NULL) {
-		orig_len = ZSTD_decompress_usingDDict(module->dctx,
-		    module->buf, module->buflen, zs->buf, zs->len,
-		    zs->dict->ddict);
-	} else {
-		orig_len = ZSTD_decompress(module->buf, module->buflen,
-		    zs->buf, zs->len);
+	cache_evict(c, c->max_bytes);
+	if (c->max_bytes == 0) {
+		RedisModule_Free(c->buckets);
+		c->buckets = NULL;
+		c->nbuckets = 0;
 	}
-	if (ZSTD_isError(orig_len) != 0) {
+}
+
+/*
+ * Look up the decompressed value of zs, counting the read.
+ */
+const struct cache_entry *cache_get(struct value_cache *c,
+    const struct zipstr *zs) {
+
+	if (c->max_bytes == 0)
 		return NULL;
+
+	(void) cache_freq_touch(c, zs);
+
+	struct cache_entry *const e = cache_find(c, zs);
+	if (e == NULL) {
+		c->misses++;
+		return NULL;
+	}
+	if (e != c->head) {
+		cache_lru_unlink(c, e);
+		cache_lru_push(c, e);
 	}
+	c->hits++;
 
-	*buflen = orig_len;
-	return module->buf;
+	return e;
 }
 
-int SetCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
-    int argc) {
+void cache_rehash(struct value_cache *c, size_t nbuckets) {
+	struct cache_entry **const buckets = RedisModule_Calloc(nbuckets,
+	    sizeof (*buckets));
 
-	if (argc != 3)
-		return RedisModule_WrongArity(ctx);
+	for (size_t i = 0; i < c->nbuckets; i++) {
+		struct cache_entry *e = c->buckets[i];
 
-	RedisModuleString *const keyname = argv[1];
-	RedisModuleString *const val = argv[2];
-	size_t src_len;
-	const char *const src = RedisModule_StringPtrLen(val, &src_len);
-	size_t key_len;
-	const char *const keystr = RedisModule_StringPtrLen(keyname, &key_len);
+		while (e != NULL) {
+			struct cache_entry *const next = e->hnext;
+			const size_t b = ptr_hash(e->zs) & (nbuckets - 1);
 
-	struct zipstr *const zs = zipstr_create(&module, keystr, key_len,
-	    src, src_len);
-	if (zs == NULL) {
-		/* XXX Only do in transparent compression mode? */
-		RedisModuleCallReply *reply;
-		reply = RedisModule_Call(ctx, "SET", "v", &argv[1],
-		    argc - 1);
-		return RedisModule_ReplyWithCallReply(ctx, reply);
+			e->hnext = buckets[b];
+			buckets[b] = e;
+			e = next;
+		}
 	}
+	RedisModule_Free(c->buckets);
+	c->buckets = buckets;
+	c->nbuckets = nbuckets;
+}
 
-	/* Data was compressed successfully; create an object */ 
-	RedisModuleKey *const key = RedisModule_OpenKey(ctx, keyname,
-	    REDISMODULE_WRITE);
-	RedisModule_ModuleTypeSetValue(key, ZipString_Type, zs);
-	RedisModule_CloseKey(key);
+/*
+ * Offer the decompressed value of zs after a miss. It's admitted if it was
+ * read often enough and more often than each entry it would evict.
+ */
+void cache_admit(struct value_cache *c, const struct zipstr *zs,
+    const char *data, size_t len) {
 
-	return RedisModule_ReplyWithSimpleString(ctx, "OK");
+	const size_t size = sizeof (struct cache_entry) + len;
+
+	if (c->max_bytes == 0 || size > (size_t)c->max_bytes)
+		return;
+
+	const unsigned f = cache_freq(c, zs);
+	if (f < c->admit)
+		return;
+
+	size_t freed = 0;
+	for (const struct cache_entry *v = c->tail;
+	    c->bytes - freed + size > (size_t)c->max_bytes; v = v->prev) {
+		if (cache_freq(c, v->zs) >= f)
+			return;
+		freed += sizeof (*v) + v->len;
+	}
+	cache_evict(c, c->max_bytes - size);
+
+	if (c->nentries >= c->nbuckets)
+		cache_rehash(c, c->nbuckets > 0 ? c->nbuckets * 2 : 64);
+
+	struct cache_entry *const e = RedisModule_Alloc(size);
+
+	e->zs = zs;
+	e->len = len;
+	(void) memcpy(e->data, data, len);
+	cache_hash_insert(c, e);
+	cache_lru_push(c, e);
+
+	c->nentries++;
+	c->bytes += size;
 }
 
-int GetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-	if (argc != 2)
-		return RedisModule_WrongArity(ctx);
+/*
+ * Rekey the cached copy of an object that was moved by defrag from the
+ * address from to zs, and move the entry too.
+ */
+void cache_move(struct value_cache *c, const struct zipstr *from,
+    const struct zipstr *zs, RedisModuleDefragCtx *ctx) {
 
-	RedisModuleString *const keyname = argv[1];
-	RedisModuleKey *const key = RedisModule_OpenKey(ctx, keyname,
-	    REDISMODULE_READ);
-	
-	switch (RedisModule_KeyType(key)) {
-	case REDISMODULE_KEYTYPE_MODULE:
-	        if (RedisModule_ModuleTypeGetType(key) != ZipString_Type) {
-			RedisModule_CloseKey(key);
-			return RedisModule_ReplyWithError(ctx, "ERR bad type");
-		}
-	        break;
-	case REDISMODULE_KEYTYPE_EMPTY:
-		RedisModule_CloseKey(key);
-		return RedisModule_ReplyWithNull(ctx);
-	case REDISMODULE_KEYTYPE_STRING:
-		/* XXX for now make a GET call. Should just get the string? */
-		{
-			RedisModuleCallReply *reply;
-			reply = RedisModule_Call(ctx, "GET", "s", keyname);
-			return RedisModule_ReplyWithCallReply(ctx, reply);
-		}
-	default:
-		RedisModule_CloseKey(key);
-		return RedisModule_ReplyWithError(ctx, "ERR bad type");
+	struct cache_entry *e = cache_find(c, from);
+	if (e == NULL)
+		return;
+
+	cache_hash_unlink(c, e);
+
+	struct cache_entry *const ne = RedisModule_DefragAlloc(ctx, e);
+	if (ne != NULL) {
+		e = ne;
+		if (e->prev != NULL)
+			e->prev->next = e;
+		else
+			c->head = e;
+		if (e->next != NULL)
+			e->next->prev = e;
+		else
+			c->tail = e;
 	}
+	e->zs = zs;
+	cache_hash_insert(c, e);
+}
 
-	const struct zipstr *const zs = RedisModule_ModuleTypeGetValue(key);
-	size_t buflen;
-	const char *buf = zipstr_decompress(&module, zs, &buflen);
+/*
+ * Release an object. Only safe on the main thread.
+ */
+void zipstr_release(void *value) {
+	struct zipstr *const zs = value;
+	struct chunk_index li;
 
-	RedisModule_CloseKey(key);
+	cache_remove(&module.cache, zs);
+
+	module.mem_total_uncompressed -= zs->orig_len;
+	module.mem_total_compressed -= zs->len;
+	module.nobjs--;
 
-	if (buf == NULL) {
-		RedisModule_ReplyWithError(ctx, "ERR decompression failed");
+	if (zs->flags & ZIPSTR_MAGICLESS)
+		module.frame_bytes_saved -= zipstr_frame_saving(zs);
+	if (zipstr_log(zs, &li)) {
+		module.nlogs--;
+		module.log_tail_bytes -= log_tail_len(zs, &li);
 	}
 
-	return RedisModule_ReplyWithStringBuffer(ctx, buf, buflen);
-}
+	dict_rele(&module, zipstr_dict(zs), zs);
 
-void command_filter(RedisModuleCommandFilterCtx *fctx, const char *replace_cmd,
-    RedisModuleString *replace) {
-	const RedisModuleString *cmd = RedisModule_CommandFilterArgGet(fctx, 0);
-	const char *s = RedisModule_StringPtrLen(cmd, NULL);
+	RedisModule_Free(zs);
+}
 
-	if (strcasecmp(replace_cmd, s) != 0) {
+/*
+ * Objects are freed on the lazyfree thread when a whole database is
+ * flushed asynchronously. The cache, accounting and dictionary references
+ * belong to the main thread, so those objects are queued and released by
+ * the sweep timer instead. Until then, their address can't be reused by an
+ * object that could be confused with them in the cache.
+ */
+void release_on_main(void *value, void (*release)(void *value)) {
+	if (pthread_equal(pthread_self(), module.main_thread)) {
+		release(value);
 		return;
 	}
-	/*
-	 * Increase ref count as Redis drops the refcnt of the arguments
-	 * once the call has finished processing.
-	 */
-	RedisModule_RetainString(NULL, replace);
-	RedisModule_CommandFilterArgReplace(fctx, 0, replace);
+
+	struct deferred_free *const df = RedisModule_Alloc(sizeof (*df));
+
+	df->value = value;
+	df->release = release;
+	pthread_mutex_lock(&module.free_lock);
+	df->next = module.free_list;
+	module.free_list = df;
+	pthread_mutex_unlock(&module.free_lock);
+}
+
+void zipstr_free(void *value) {
+	release_on_main(value, zipstr_release);
+}
+
+/*
+ * Release queued objects for up to FREE_BUDGET_NS, and run again in
+ * FREE_TICK_MS while some are left.
+ */
+void deferred_free_cb(RedisModuleCtx *ctx, void *data) {
+	REDISMODULE_NOT_USED(data);
+
+	const uint64_t start = monotonic_ns();
+	unsigned n = 0;
+
+	pthread_mutex_lock(&module.free_lock);
+	struct deferred_free *df = module.free_list;
+	module.free_list = NULL;
+	pthread_mutex_unlock(&module.free_lock);
+
+	while (df != NULL) {
+		struct deferred_free *const next = df->next;
+
+		df->release(df->value);
+		RedisModule_Free(df);
+		df = next;
+
+		if ((++n % 64) == 0 && monotonic_ns() - start > FREE_BUDGET_NS)
+			break;
+	}
+
+	pthread_mutex_lock(&module.free_lock);
+	if (df != NULL) {
+		struct deferred_free *last = df;
+
+		while (last->next != NULL)
+			last = last->next;
+		last->next = module.free_list;
+		module.free_list = df;
+	}
+	module.free_timer = module.free_list != NULL;
+	pthread_mutex_unlock(&module.free_lock);
+
+	if (module.free_timer) {
+		(void) RedisModule_CreateTimer(ctx, FREE_TICK_MS,
+		    deferred_free_cb, NULL);
+	}
 }
 
-void set_command_filter(RedisModuleCommandFilterCtx *fctx) {
-	command_filter(fctx, "set", module.set_str);
+/*
+ * Memory of the object, its cached copy, and an even share of its
+ * dictionary.
+ */
+size_t zipstr_mem_usage(const void *value) {
+	const struct zipstr *const zs = value;
+	size_t mem = sizeof (*zs) + zs->len;
+
+	const struct cache_entry *const e = cache_find(&module.cache, zs);
+	if (e != NULL)
+		mem += sizeof (*e) + e->len;
+
+	const struct dict *const dict = zipstr_dict(zs);
+	if (dict != NULL)
+		mem += dict_mem(dict) / dict->refcnt;
+
+	return mem;
 }
 
-void get_command_filter(RedisModuleCommandFilterCtx *fctx) {
-	command_filter(fctx, "get", module.get_str);
+/*
+ * Allocations freed with the object. Always a single one, so Redis frees
+ * objects inline on UNLINK or eviction rather than on the lazyfree thread.
+ */
+size_t zipstr_free_effort(RedisModuleString *key, const void *value) {
+	REDISMODULE_NOT_USED(key);
+	REDISMODULE_NOT_USED(value);
+
+	return 1;
+}
+
+/*
+ * Move the object and its cached copy.
+ */
+int zipstr_defrag(RedisModuleDefragCtx *ctx, RedisModuleString *key,
+    void **value) {
+	REDISMODULE_NOT_USED(key);
+
+	struct zipstr *const zs = *value;
+	struct zipstr *const nzs = RedisModule_DefragAlloc(ctx, zs);
+
+	if (nzs != NULL) {
+		cache_move(&module.cache, zs, nzs, ctx);
+		*value = nzs;
+	}
+
+	return 0;
+}
+
+/*
+ * Account for a newly created object.
+ */
+struct zipstr *zipstr_init(struct compress_module *module, struct zipstr *zs,
+    struct dict *dict, size_t len, size_t orig_len) {
+	struct chunk_index li;
+
+	zs->orig_len = orig_len;
+	zs->len = len;
+	zs->dict_slot = dict != NULL ? dict->slot : 0;
+
+	dict_hold(dict, zs);
+
+	module->mem_total_uncompressed += zs->orig_len;
+	module->mem_total_compressed += zs->len;
+	module->nobjs++;
+	if (zs->flags & ZIPSTR_MAGICLESS)
+		module->frame_bytes_saved += zipstr_frame_saving(zs);
+	if (zipstr_log(zs, &li)) {
+		module->nlogs++;
+		module->log_tail_bytes += log_tail_len(zs, &li);
+	}
+
+	return zs;
+}
+
+/*
+ * Allocate an object with room for cap bytes after the header.
+ */
+struct zipstr *zipstr_new(size_t cap) {
+	struct zipstr *const zs = RedisModule_Alloc(sizeof (*zs) + cap);
+
+	zs->dict_slot = 0;
+	zs->flags = 0;
+	return zs;
+}
+
+/*
+ * Give back the room after the first len bytes.
+ */
+struct zipstr *zipstr_shrink(struct zipstr *zs, size_t len) {
+	zs = RedisModule_Realloc(zs, sizeof (*zs) + len);
+	zs->len = len;
+
+	return zs;
+}
+
+/*
+ * Take over buf, as returned by RedisModule_LoadStringBuffer(), moving its
+ * len bytes behind room for the header within the same allocation. Sets
+ * len, but nothing else.
+ */
+struct zipstr *zipstr_adopt(char *buf, size_t len) {
+	struct zipstr *const zs = RedisModule_Realloc(buf, sizeof (*zs) + len);
+
+	(void) memmove(zs->buf, zs, len);
+	zs->len = len;
+
+	return zs;
+}
+
+/*
+ * Find the dictionary to compress key with. The cache is optional.
+ */
+struct dict *dict_lookup(struct compress_module *module,
+    struct prefix_cache *cache, const char *key, size_t keylen) {
+
+	struct dict *dict;
+	size_t len = keylen;
+
+	/* Only the part up to the last delimiter can match a prefix */
+	while (len > 0 && !module->is_delim[(unsigned char)key[len - 1]])
+		len--;
+	if (len == 0) {
+		return module->dict;
+	}
+
+	for (int i = 0; cache != NULL && i < cache->n; i++) {
+		if (cache->entries[i].len == len &&
+		    memcmp(cache->entries[i].prefix, key, len) == 0) {
+			dict = cache->entries[i].dict;
+			return dict != NULL ? dict : module->dict;
+		}
+	}
+
+	/* look for dict */
+	dict = prefix_index_match(&module->prefix_dicts, module->is_delim, key,
+	    len);
+
+	if (cache != NULL && cache->n < PREFIX_CACHE_SIZE) {
+		cache->entries[cache->n].prefix = key;
+		cache->entries[cache->n].len = len;
+		cache->entries[cache->n].dict = dict;
+		cache->n++;
+	}
+
+	return dict != NULL ? dict : module->dict;
+}
+
+uint32_t le32_read(const void *p) {
+	const unsigned char *const b = p;
+
+	return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 |
+	    (uint32_t)b[3] << 24;
+}
+
+void le32_write(void *p, uint32_t v) {
+	unsigned char *const b = p;
+
+	b[0] = v;
+	b[1] = v >> 8;
+	b[2] = v >> 16;
+	b[3] = v >> 24;
+}
+
+size_t frame_compress(ZSTD_CCtx *cctx, int clevel, const ZSTD_CDict *cdict,
+    void *dst, size_t cap, const void *src, size_t len) {
+
+	/* Use dictionary, if available */
+	if (cdict != NULL) {
+		return ZSTD_compress_usingCDict(cctx, dst, cap, src, len,
+		    cdict);
+	}
+	return ZSTD_compressCCtx(cctx, dst, cap, src, len, clevel);
+}
+
+/*
+ * Compress a large value in one frame with the streaming API. zstd splits
+ * the work over its own threads when built with ZSTD_MULTITHREAD, and
+ * finds matches across the whole window with long distance matching. The
+ * content size is pledged so that it's recorded in the frame as usual.
+ */
+size_t frame_compress_stream(ZSTD_CCtx *cctx, int clevel,
+    const ZSTD_CDict *cdict, const struct large_params *large, void *dst,
+    size_t cap, const void *src, size_t len) {
+
+	ZSTD_outBuffer out = { dst, cap, 0 };
+	ZSTD_inBuffer in = { src, len, 0 };
+	size_t ret;
+
+	(void) ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+	ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, clevel);
+	if (!ZSTD_isError(ret) && cdict != NULL)
+		ret = ZSTD_CCtx_refCDict(cctx, cdict);
+	if (!ZSTD_isError(ret)) {
+		ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog,
+		    large->window_log);
+	}
+	if (!ZSTD_isError(ret) && large->ldm) {
+		ret = ZSTD_CCtx_setParameter(cctx,
+		    ZSTD_c_enableLongDistanceMatching, 1);
+	}
+	if (!ZSTD_isError(ret))
+		ret = ZSTD_CCtx_setPledgedSrcSize(cctx, len);
+
+	/* Fails without ZSTD_MULTITHREAD; compress on this thread then */
+	(void) ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, large->workers);
+
+	while (!ZSTD_isError(ret)) {
+		ret = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+		if (ret == 0) {
+			ret = out.pos;
+			break;
+		}
+		if (!ZSTD_isError(ret) && out.pos == out.size) {
+			/* Doesn't compress to less than cap */
+			ret = (size_t)-ZSTD_error_dstSize_tooSmall;
+		}
+	}
+
+	/* Back to the parameters of the one-shot functions */
+	(void) ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+
+	return ret;
+}
+
+/*
+ * Compress into a frame without the magic number, dictionary ID and content
+ * size, which zipstr headers already have.
+ */
+size_t frame_compress_compact(ZSTD_CCtx *cctx, int clevel,
+    const ZSTD_CDict *cdict, void *dst, size_t cap, const void *src,
+    size_t len) {
+
+	size_t ret;
+
+	(void) ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+	if (cdict != NULL)
+		ret = ZSTD_CCtx_refCDict(cctx, cdict);
+	else
+		ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+		    clevel);
+	if (!ZSTD_isError(ret)) {
+		ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_format,
+		    ZSTD_f_zstd1_magicless);
+	}
+	if (!ZSTD_isError(ret))
+		ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_contentSizeFlag, 0);
+	if (!ZSTD_isError(ret))
+		ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_dictIDFlag, 0);
+	if (!ZSTD_isError(ret))
+		ret = ZSTD_compress2(cctx, dst, cap, src, len);
+
+	(void) ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+
+	return ret;
+}
+
+/*
+ * Compress a block of a log with the dictionary, or if prefix isn't NULL,
+ * with the previous block of the same size as the prefix. Consecutive
+ * blocks of a log are much alike, so that's often better than the
+ * dictionary.
+ */
+size_t log_block_compress(ZSTD_CCtx *cctx, int clevel,
+    const ZSTD_CDict *cdict, const char *prefix, void *dst, size_t cap,
+    const void *src, size_t len) {
+
+	size_t ret;
+
+	if (prefix == NULL)
+		return frame_compress(cctx, clevel, cdict, dst, cap, src, len);
+
+	(void) ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+	ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, clevel);
+	if (!ZSTD_isError(ret))
+		ret = ZSTD_CCtx_refPrefix(cctx, prefix, len);
+	if (!ZSTD_isError(ret))
+		ret = ZSTD_compress2(cctx, dst, cap, src, len);
+
+	(void) ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+
+	return ret;
+}
+
+size_t chunk_index_size(size_t nchunks) {
+	return CHUNK_HDR_SIZE + 4 * nchunks;
+}
+
+void chunk_index_write(char *buf, size_t chunk_size, size_t nchunks) {
+	le32_write(buf, CHUNK_MAGIC);
+	le32_write(buf + 4, chunk_index_size(nchunks) - 8);
+	le32_write(buf + 8, chunk_size);
+	le32_write(buf + 12, nchunks);
+}
+
+/*
+ * Read the chunk index. Returns 0 if the object isn't chunked.
+ */
+int zipstr_chunks(const struct zipstr *zs, struct chunk_index *ci) {
+	/* A magicless frame may start with anything */
+	if ((zs->flags & ZIPSTR_MAGICLESS) || zs->len < CHUNK_HDR_SIZE ||
+	    le32_read(zs->buf) != CHUNK_MAGIC)
+		return 0;
+
+	ci->chunk_size = le32_read(zs->buf + 8);
+	ci->nchunks = le32_read(zs->buf + 12);
+	ci->ends = (const unsigned char *)zs->buf + CHUNK_HDR_SIZE;
+	ci->frames = zs->buf + chunk_index_size(ci->nchunks);
+
+	return 1;
+}
+
+void log_header_write(char *buf, size_t block_size, size_t nblocks) {
+	le32_write(buf, LOG_MAGIC);
+	le32_write(buf + 4, CHUNK_HDR_SIZE - 8);
+	le32_write(buf + 8, block_size);
+	le32_write(buf + 12, nblocks);
+}
+
+/*
+ * Read the index of a log. Returns 0 if the object isn't one.
+ */
+int zipstr_log(const struct zipstr *zs, struct chunk_index *li) {
+	if ((zs->flags & ZIPSTR_MAGICLESS) || zs->len < CHUNK_HDR_SIZE ||
+	    le32_read(zs->buf) != LOG_MAGIC)
+		return 0;
+
+	li->chunk_size = le32_read(zs->buf + 8);
+	li->nchunks = le32_read(zs->buf + 12);
+	if (li->nchunks > (zs->len - CHUNK_HDR_SIZE) / 4)
+		return 0;
+	li->ends = (const unsigned char *)zs->buf + zs->len - 4 * li->nchunks;
+	li->frames = zs->buf + CHUNK_HDR_SIZE;
+
+	return 1;
+}
+
+size_t chunk_frame_start(const struct chunk_index *ci, size_t i) {
+	return i == 0 ? 0 : le32_read(ci->ends + 4 * (i - 1));
+}
+
+size_t chunk_frame_len(const struct chunk_index *ci, size_t i) {
+	return le32_read(ci->ends + 4 * i) - chunk_frame_start(ci, i);
+}
+
+size_t chunk_len(size_t chunk_size, size_t orig_len, size_t i) {
+	const size_t left = orig_len - i * chunk_size;
+
+	return left < chunk_size ? left : chunk_size;
+}
+
+/*
+ * Bytes of a log after its blocks, which aren't compressed.
+ */
+size_t log_tail_len(const struct zipstr *zs, const struct chunk_index *li) {
+	return zs->orig_len - li->nchunks * li->chunk_size;
+}
+
+const char *log_tail(const struct chunk_index *li) {
+	return li->frames + chunk_frame_start(li, li->nchunks);
+}
+
+/*
+ * Check a log received from a client. Each block must be a single frame of
+ * the block size, and the tail must be shorter than a block.
+ */
+int log_check(const struct zipstr *zs, const struct chunk_index *li) {
+	/* Frames and tail */
+	const size_t data_len = zs->len - chunk_index_size(li->nchunks);
+
+	if (li->chunk_size == 0 ||
+	    le32_read(zs->buf + 4) != CHUNK_HDR_SIZE - 8 ||
+	    li->nchunks != zs->orig_len / li->chunk_size)
+		return -1;
+
+	size_t start = 0;
+	for (size_t i = 0; i < li->nchunks; i++) {
+		const size_t end = le32_read(li->ends + 4 * i);
+
+		if (end < start || end > data_len ||
+		    ZSTD_getFrameContentSize(li->frames + start, end - start) !=
+		    li->chunk_size ||
+		    ZSTD_findFrameCompressedSize(li->frames + start,
+		    end - start) != end - start)
+			return -1;
+		start = end;
+	}
+
+	return data_len - start == log_tail_len(zs, li) ? 0 : -1;
+}
+
+/*
+ * Whether a frame may have been compressed with dict, going by the
+ * dictionary ID in its header. Frames can leave the ID out.
+ */
+int frame_dict_matches(const char *buf, size_t len, const struct dict *dict) {
+	const unsigned id = ZSTD_getDictID_fromFrame(buf, len);
+
+	return id == 0 || (dict != NULL &&
+	    id == ZSTD_getDictID_fromDict(dict->buf, dict->buflen));
+}
+
+/*
+ * Check a frame that leaves out its content size by decompressing it with
+ * dict into orig_len bytes. Frames that can't hold that much are rejected
+ * before anything is allocated.
+ */
+int frame_check_size(struct compress_module *module, struct dict *dict,
+    const char *buf, size_t len, size_t orig_len) {
+	const unsigned long long bound = ZSTD_decompressBound(buf, len);
+
+	if (bound == ZSTD_CONTENTSIZE_ERROR || bound < orig_len ||
+	    dctx_use_dict(module, dict, ZSTD_f_zstd1) != 0)
+		return -1;
+
+	char *const dst = RedisModule_Alloc(orig_len);
+	const size_t n = ZSTD_decompressDCtx(module->dctx, dst, orig_len, buf,
+	    len);
+
+	RedisModule_Free(dst);
+	return !ZSTD_isError(n) && n == orig_len ? 0 : -1;
+}
+
+/*
+ * Check an object received from a client, to be used with dict. Its frames
+ * must add up to orig_len, and a chunk index must match the frames that
+ * follow it. A single frame may leave out its content size, as compact
+ * objects do, in which case it is decompressed to check it.
+ */
+int zipstr_check(struct compress_module *module, const struct zipstr *zs,
+    struct dict *dict) {
+	struct chunk_index ci;
+
+	if (zipstr_log(zs, &ci))
+		return log_check(zs, &ci);
+
+	const unsigned long long size = ZSTD_findDecompressedSize(zs->buf,
+	    zs->len);
+
+	if (!zipstr_chunks(zs, &ci)) {
+		if (!frame_dict_matches(zs->buf, zs->len, dict))
+			return -1;
+		if (size == ZSTD_CONTENTSIZE_UNKNOWN) {
+			return frame_check_size(module, dict, zs->buf, zs->len,
+			    zs->orig_len);
+		}
+		return size == zs->orig_len ? 0 : -1;
+	}
+	if (size != zs->orig_len)
+		return -1;
+
+	const size_t hdr = chunk_index_size(ci.nchunks);
+	if (ci.chunk_size == 0 || hdr > zs->len ||
+	    le32_read(zs->buf + 4) != hdr - 8 ||
+	    ci.nchunks != (zs->orig_len + ci.chunk_size - 1) / ci.chunk_size)
+		return -1;
+
+	size_t start = 0;
+	for (size_t i = 0; i < ci.nchunks; i++) {
+		const size_t end = le32_read(ci.ends + 4 * i);
+
+		if (end < start || end > zs->len - hdr ||
+		    ZSTD_getFrameContentSize(ci.frames + start, end - start) !=
+		    chunk_len(ci.chunk_size, zs->orig_len, i) ||
+		    !frame_dict_matches(ci.frames + start, end - start, dict))
+			return -1;
+		start = end;
+	}
+
+	return start == zs->len - hdr ? 0 : -1;
+}
+
+/*
+ * The object as standard zstd frames, for RDB files, the AOF, replicas and
+ * clients. Compact objects get their magic number back in a copy, which is
+ * released with zipstr_frames_free().
+ */
+const char *zipstr_frames(const struct zipstr *zs, size_t *len) {
+	if (!(zs->flags & ZIPSTR_MAGICLESS)) {
+		*len = zs->len;
+		return zs->buf;
+	}
+
+	char *const buf = RedisModule_Alloc(zs->len + 4);
+
+	le32_write(buf, ZSTD_MAGICNUMBER);
+	(void) memcpy(buf + 4, zs->buf, zs->len);
+	*len = zs->len + 4;
+
+	return buf;
+}
+
+void zipstr_frames_free(const struct zipstr *zs, const char *frames) {
+	if (frames != zs->buf)
+		RedisModule_Free((char *)frames);
+}
+
+/*
+ * Make an object that isn't accounted for yet compact again if it's a
+ * single frame as returned by zipstr_frames(): without content size or
+ * dictionary ID. Other frames are kept as they are.
+ */
+struct zipstr *zipstr_compact(struct zipstr *zs) {
+	struct chunk_index ci;
+	ZSTD_frameHeader zfh;
+
+	if ((zs->flags & ZIPSTR_MAGICLESS) || zipstr_chunks(zs, &ci) ||
+	    ZSTD_getFrameHeader(&zfh, zs->buf, zs->len) != 0 ||
+	    zfh.frameType != ZSTD_frame ||
+	    zfh.frameContentSize != ZSTD_CONTENTSIZE_UNKNOWN ||
+	    zfh.dictID != 0 ||
+	    ZSTD_findFrameCompressedSize(zs->buf, zs->len) != zs->len)
+		return zs;
+
+	(void) memmove(zs->buf, zs->buf + 4, zs->len - 4);
+	zs->flags |= ZIPSTR_MAGICLESS;
+
+	return zipstr_shrink(zs, zs->len - 4);
+}
+
+struct zipstr *zipstr_encode_chunked(ZSTD_CCtx *cctx, int clevel,
+    const ZSTD_CDict *cdict, const char *data, size_t len,
+    size_t chunk_size) {
+
+	const size_t nchunks = (len + chunk_size - 1) / chunk_size;
+	const size_t hdr = chunk_index_size(nchunks);
+
+	if (hdr >= len)
+		return NULL;
+
+	struct zipstr *zs = zipstr_new(len);
+	size_t off = 0;
+
+	for (size_t i = 0; i < nchunks; i++) {
+		const size_t clen = frame_compress(cctx, clevel, cdict,
+		    zs->buf + hdr + off, len - hdr - off, data + i * chunk_size,
+		    chunk_len(chunk_size, len, i));
+
+		if (ZSTD_isError(clen) != 0) {
+			RedisModule_Free(zs);
+			return NULL;
+		}
+		off += clen;
+		le32_write(zs->buf + CHUNK_HDR_SIZE + 4 * i, off);
+	}
+	chunk_index_write(zs->buf, chunk_size, nchunks);
+
+	zs = zipstr_shrink(zs, hdr + off);
+	zs->orig_len = len;
+
+	return zs;
+}
+
+/*
+ * Compress data with dict (or without if NULL) into a new object that isn't
+ * accounted for yet. Doesn't touch module state, so it may be called from a
+ * worker thread with its own cctx. Values larger than chunk_size (unless 0)
+ * are split into independently compressed chunks. Otherwise, values of at
+ * least large->threshold bytes are compressed with frame_compress_stream(),
+ * and smaller ones with frame_compress_compact().
+ *
+ * Data is compressed directly into the object, which is then shrunk to the
+ * compressed size. Returns NULL if the data doesn't compress to less than
+ * its original size.
+ */
+struct zipstr *zipstr_encode(ZSTD_CCtx *cctx, int clevel,
+    const ZSTD_CDict *cdict, const char *data, size_t len,
+    size_t chunk_size, const struct large_params *large) {
+
+	if (chunk_size > 0 && len > chunk_size) {
+		return zipstr_encode_chunked(cctx, clevel, cdict, data, len,
+		    chunk_size);
+	}
+
+	struct zipstr *zs = zipstr_new(len);
+	size_t clen;
+
+	if (large->threshold > 0 && len >= (size_t)large->threshold) {
+		clen = frame_compress_stream(cctx, clevel, cdict, large,
+		    zs->buf, len, data, len);
+	} else {
+		clen = frame_compress_compact(cctx, clevel, cdict, zs->buf,
+		    len, data, len);
+		zs->flags |= ZIPSTR_MAGICLESS;
+	}
+
+	if (ZSTD_isError(clen) != 0) {
+		RedisModule_Free(zs);
+		return NULL;
+	}
+
+	/* Data was compressed successfully; give back the unused space */ 
+	zs = zipstr_shrink(zs, clen);
+	zs->orig_len = len;
+
+	return zs;
+}
+
+/*
+ * Signatures of formats that are already compressed.
+ */
+static const struct {
+	const char *magic;
+	size_t len;
+	size_t offset;
+} compressed_magics[] = {
+	{ "\x1f\x8b", 2, 0 },			/* gzip */
+	{ "\x28\xb5\x2f\xfd", 4, 0 },		/* zstd */
+	{ "\x04\x22\x4d\x18", 4, 0 },		/* lz4 */
+	{ "\xfd" "7zXZ", 5, 0 },			/* xz */
+	{ "7z\xbc\xaf\x27\x1c", 6, 0 },		/* 7-zip */
+	{ "BZh", 3, 0 },			/* bzip2 */
+	{ "PK\x03\x04", 4, 0 },			/* zip, jar, docx */
+	{ "\xff\xd8\xff", 3, 0 },		/* JPEG */
+	{ "\x89PNG", 4, 0 },			/* PNG */
+	{ "GIF8", 4, 0 },			/* GIF */
+	{ "WEBP", 4, 8 },			/* WebP */
+	{ "ftyp", 4, 4 },			/* MP4, HEIC */
+	{ "OggS", 4, 0 },			/* Ogg */
+};
+
+int is_compressed_format(const char *data, size_t len) {
+	const size_t n = sizeof (compressed_magics) /
+	    sizeof (compressed_magics[0]);
+
+	for (size_t i = 0; i < n; i++) {
+		const size_t end = compressed_magics[i].offset +
+		    compressed_magics[i].len;
+
+		if (len >= end && memcmp(data + compressed_magics[i].offset,
+		    compressed_magics[i].magic, compressed_magics[i].len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Estimate the entropy in bits per byte from a byte histogram. Large values
+ * are sampled in chunks spread over the value. Counts go to four tables in
+ * turn so that runs of the same byte don't serialize on one counter.
+ */
+double sample_entropy(const unsigned char *data, size_t len) {
+	uint32_t counts[4][256];
+	size_t nchunks = 1;
+	size_t chunk_len = len;
+	size_t total = 0;
+
+	if (len > ENTROPY_SAMPLE) {
+		nchunks = ENTROPY_CHUNKS;
+		chunk_len = ENTROPY_CHUNK_SIZE;
+	}
+	(void) memset(counts, 0, sizeof (counts));
+
+	for (size_t c = 0; c < nchunks; c++) {
+		const unsigned char *p = data;
+		size_t i = 0;
+
+		if (nchunks > 1)
+			p += c * ((len - chunk_len) / (nchunks - 1));
+
+		for (; i + 4 <= chunk_len; i += 4) {
+			counts[0][p[i]]++;
+			counts[1][p[i + 1]]++;
+			counts[2][p[i + 2]]++;
+			counts[3][p[i + 3]]++;
+		}
+		for (; i < chunk_len; i++) {
+			counts[0][p[i]]++;
+		}
+		total += chunk_len;
+	}
+
+	double entropy = 0;
+	for (int b = 0; b < 256; b++) {
+		const uint32_t n = counts[0][b] + counts[1][b] + counts[2][b] +
+		    counts[3][b];
+
+		if (n > 0) {
+			const double p = (double)n / total;
+			entropy -= p * log2(p);
+		}
+	}
+	return entropy;
+}
+
+/*
+ * Cheap checks for data that isn't worth handing to zstd.
+ */
+enum skip_reason compress_skip(const struct compress_module *module,
+    const char *data, size_t len) {
+	if (len < (size_t)module->min_size)
+		return SKIP_SMALL;
+	if (!module->detect)
+		return SKIP_NONE;
+	if (is_compressed_format(data, len))
+		return SKIP_MAGIC;
+	if (sample_entropy((const unsigned char *)data, len) * 100 >
+	    module->max_entropy)
+		return SKIP_ENTROPY;
+	return SKIP_NONE;
+}
+
+/*
+ * Compress data with dict (or without if NULL). Returns NULL if the data
+ * should be stored uncompressed.
+ */
+struct zipstr *zipstr_compress(struct compress_module *module,
+    struct dict *dict, const char *data, size_t len) {
+
+	const enum skip_reason skip = compress_skip(module, data, len);
+	if (skip != SKIP_NONE) {
+		module->nskipped[skip]++;
+		return NULL;
+	}
+
+	const ZSTD_CDict *cdict = NULL;
+	if (dict != NULL && (cdict = dict_cdict(dict)) == NULL)
+		dict = NULL;
+
+	struct level_tuner *const tuner = dict != NULL ? &dict->tuner :
+	    &module->tuner;
+	const int measure = module->autotune || module->stats;
+	const uint64_t start = measure ? monotonic_ns() : 0;
+
+	struct zipstr *const zs = zipstr_encode(module->cctx,
+	    tune_levels[module->tuner.step], cdict, data, len,
+	    module->chunk_size, &module->large);
+
+	if (measure) {
+		const uint64_t ns = monotonic_ns() - start;
+		const size_t out = zs != NULL ? zs->len : len;
+
+		if (module->stats)
+			codec_record_compress(module, dict, ns, len, out);
+		if (module->autotune)
+			tuner_record(module, tuner, dict, ns, len, out);
+	}
+	if (zs == NULL) {
+		module->nskipped[SKIP_INCOMPRESSIBLE]++;
+		return NULL;
+	}
+
+	return zipstr_init(module, zs, dict, zs->len, zs->orig_len);
+}
+
+/*
+ * Create a compressed string from the original data.
+ */
+struct zipstr *zipstr_create(struct compress_module *module, const char *key,
+    size_t keylen, const char *data, size_t len) {
+
+	return zipstr_compress(module, dict_lookup(module, NULL, key, keylen),
+	    data, len);
+}
+
+/*
+ * Objects refer to their dictionary by index in the aux data of the RDB
+ * being saved. Outside of an RDB, e.g. for DUMP, they use the dictionary
+ * ID. The low bit tells which; 0 means no dictionary.
+ */
+uint64_t dict_save_ref(const struct dict *dict) {
+	if (dict == NULL)
+		return 0;
+	return module.save_indexes ? dict->save_index << 1 :
+	    (uint64_t)dict->id << 1 | 1;
+}
+
+void zipstr_rdb_save(RedisModuleIO *rdb, void *value) {
+	struct zipstr *const zs = value;
+
+	RedisModule_SaveUnsigned(rdb, zs->orig_len);
+	RedisModule_SaveUnsigned(rdb, dict_save_ref(zipstr_dict(zs)));
+	RedisModule_SaveUnsigned(rdb, zs->flags);
+	RedisModule_SaveStringBuffer(rdb, zs->buf, zs->len);
+}
+
+/*
+ * Propagate a new active dictionary, so that replicas and the AOF have it
+ * before the objects compressed with it.
+ */
+void dict_replicate(RedisModuleCtx *ctx, const struct dict *dict) {
+	const char *const prefix = dict->prefix != NULL ? dict->prefix : "";
+
+	RedisModule_Replicate(ctx, MODPREFIX".dict", "cbclcb", "RESTORE",
+	    dict->buf, dict->buflen, "ID", dict->id, "PREFIX", prefix,
+	    dict->prefix_len);
+}
+
+/*
+ * DICT RESTORE command recreating dict with its ID and prefix. Inactive
+ * dictionaries are only restored while loading, for the objects using them.
+ */
+void dict_emit_aof(RedisModuleIO *aof, const struct dict *dict) {
+	const char *const prefix = dict->prefix != NULL ? dict->prefix : "";
+
+	if (dict_is_active(&module, dict)) {
+		RedisModule_EmitAOF(aof, MODPREFIX".dict", "cbclcb", "RESTORE",
+		    dict->buf, dict->buflen, "ID", dict->id, "PREFIX", prefix,
+		    dict->prefix_len);
+	} else {
+		RedisModule_EmitAOF(aof, MODPREFIX".dict", "cbclcbc",
+		    "RESTORE", dict->buf, dict->buflen, "ID", dict->id,
+		    "PREFIX", prefix, dict->prefix_len, "INACTIVE");
+	}
+}
+
+/*
+ * Emit the dictionaries an object rewritten to the AOF needs. The active
+ * ones are all emitted before the first object, so that they survive the
+ * rewrite even if no object uses them, and the others before the first
+ * object using them. The rewrite runs in a child process, so the flags are
+ * only ever set in the child.
+ */
+void dicts_emit_aof(RedisModuleIO *aof, struct dict *dict) {
+	if (!module.aof_active_emitted) {
+		RedisModuleDictIter *const iter =
+		    RedisModule_DictIteratorStartC(module.all_dicts, "^",
+		    NULL, 0);
+		void *value;
+
+		while (RedisModule_DictNextC(iter, NULL, &value) != NULL) {
+			struct dict *const d = value;
+
+			if (dict_is_active(&module, d)) {
+				dict_emit_aof(aof, d);
+				d->aof_emitted = 1;
+			}
+		}
+		RedisModule_DictIteratorStop(iter);
+		module.aof_active_emitted = 1;
+	}
+	if (dict != NULL && !dict->aof_emitted) {
+		dict_emit_aof(aof, dict);
+		dict->aof_emitted = 1;
+	}
+}
+
+/*
+ * Rewrite the object as SETRAW, preceded by the dictionaries it needs.
+ */
+void zipstr_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+    void *value) {
+	const struct zipstr *const zs = value;
+	struct dict *const dict = zipstr_dict(zs);
+	const long long id = dict != NULL ? dict->id : 0;
+
+	dicts_emit_aof(aof, dict);
+
+	size_t len;
+	const char *const frames = zipstr_frames(zs, &len);
+
+	RedisModule_EmitAOF(aof, MODPREFIX".setraw", "sllb", key, id,
+	    (long long)zs->orig_len, frames, len);
+	zipstr_frames_free(zs, frames);
+}
+
+struct dict *dict_find(long long id) {
+	return RedisModule_DictGetC(module.all_dicts, &id, sizeof (id), NULL);
+}
+
+/*
+ * Find the dictionary saved by dict_save_ref(). Fails if it's missing.
+ */
+int dict_load_ref(uint64_t dict_ref, struct dict **dict) {
+	const uint64_t n = dict_ref >> 1;
+
+	*dict = NULL;
+	if (n == 0)
+		return 0;
+
+	if ((dict_ref & 1) != 0) {
+		*dict = dict_find(n);
+	} else if (n <= module.nload_dicts) {
+		*dict = module.load_dicts[n - 1];
+	}
+	if (*dict == NULL) {
+		RedisModule_Log(NULL, "warning",
+		    "Could not find dict (%s %llu) for object",
+		    (dict_ref & 1) != 0 ? "ID" : "index",
+		    (unsigned long long)n);
+		return -1;
+	}
+	return 0;
+}
+
+void *zipstr_rdb_load(RedisModuleIO *rdb, int encver) {
+	if (encver > ZIPSTR_ENCODING_VERSION) {
+		RedisModule_Log(NULL, "notice", "Unknown version (%d)", encver);
+		return NULL;
+	}
+
+	const uint64_t orig_len = RedisModule_LoadUnsigned(rdb);
+	uint64_t dict_ref;
+	uint64_t flags = 0;
+
+	if (encver == 0) {
+		/* Version 0 has the length here too, and the ID */
+		(void) RedisModule_LoadUnsigned(rdb);
+		dict_ref = RedisModule_LoadUnsigned(rdb) << 1 | 1;
+	} else {
+		dict_ref = RedisModule_LoadUnsigned(rdb);
+	}
+	if (encver >= 2) {
+		/* Payloads as stored, rather than whole frames */
+		flags = RedisModule_LoadUnsigned(rdb);
+	}
+
+	size_t len;
+	char *const buf = RedisModule_LoadStringBuffer(rdb, &len);
+	struct dict *dict;
+
+	if ((flags & ~(uint64_t)ZIPSTR_MAGICLESS) != 0) {
+		RedisModule_Log(NULL, "warning", "Corrupt object");
+		RedisModule_Free(buf);
+		return NULL;
+	}
+	if (dict_load_ref(dict_ref, &dict) != 0) {
+		RedisModule_Free(buf);
+		return NULL;
+	}
+
+	struct zipstr *zs = zipstr_adopt(buf, len);
+
+	zs->flags = flags;
+	if (encver < 2)
+		zs = zipstr_compact(zs);
+
+	return zipstr_init(&module, zs, dict, zs->len, orig_len);
+}
+
+/*
+ * Dictionaries are saved before the objects, along with whether they are
+ * active. Objects refer to them by their position.
+ */
+void zipstr_aux_save(RedisModuleIO *rdb, int when) {
+	if (when == REDISMODULE_AUX_AFTER_RDB) {
+		module.save_indexes = 0;
+		return;
+	}
+
+	const uint64_t ndicts = RedisModule_DictSize(module.all_dicts);
+	RedisModule_Log(NULL, "debug", "Saving %llu dicts", ndicts);
+	RedisModule_SaveUnsigned(rdb, ndicts);
+
+	RedisModuleDictIter *const iter = RedisModule_DictIteratorStartC(
+	    module.all_dicts, "^", NULL, 0);
+
+	void *data;
+	uint64_t index = 0;
+	while (RedisModule_DictNextC(iter, NULL, &data) != NULL) {
+		struct dict *const dict = data;
+
+		dict->save_index = ++index;
+		RedisModule_SaveUnsigned(rdb, dict->id);
+		RedisModule_SaveUnsigned(rdb, dict_is_active(&module, dict));
+		RedisModule_SaveUnsigned(rdb, dict->prefix_len);
+		if (dict->prefix_len > 0) {
+			RedisModule_SaveStringBuffer(rdb, dict->prefix,
+			    dict->prefix_len);
+		}
+		RedisModule_SaveStringBuffer(rdb, dict->buf, dict->buflen);
+	}
+
+	RedisModule_DictIteratorStop(iter);
+	module.save_indexes = 1;
+}
+
+/*
+ * Drop the references held for objects being loaded.
+ */
+void load_dicts_release(void) {
+	for (size_t i = 0; i < module.nload_dicts; i++)
+		dict_rele(&module, module.load_dicts[i], NULL);
+	RedisModule_Free(module.load_dicts);
+	module.load_dicts = NULL;
+	module.nload_dicts = 0;
+}
+
+/*
+ * Hold a reference to dict until loading ends, taking over the caller's.
+ */
+void load_dicts_hold(struct dict *dict) {
+	module.load_dicts = RedisModule_Realloc(module.load_dicts,
+	    (module.nload_dicts + 1) * sizeof (*module.load_dicts));
+	module.load_dicts[module.nload_dicts++] = dict;
+}
+
+void loading_cb(RedisModuleCtx *ctx, RedisModuleEvent eid, uint64_t subevent,
+    void *data) {
+	REDISMODULE_NOT_USED(ctx);
+	REDISMODULE_NOT_USED(eid);
+	REDISMODULE_NOT_USED(data);
+
+	if (subevent == REDISMODULE_SUBEVENT_LOADING_ENDED ||
+	    subevent == REDISMODULE_SUBEVENT_LOADING_FAILED) {
+		load_dicts_release();
+	}
+}
+
+/*
+ * Each saved dictionary is held until loading ends, so that objects can
+ * refer to dictionaries that were replaced or dropped. Version 0 doesn't
+ * say which dictionaries were active; all are activated in order.
+ */
+int zipstr_aux_load(RedisModuleIO *rdb, int encver, int when) {
+	if (encver > ZIPSTR_ENCODING_VERSION) {
+		RedisModule_Log(NULL, "warning",
+		    "Unknown encoding version (%d)", encver);
+		return REDISMODULE_ERR;
+	}
+
+	if (when != REDISMODULE_AUX_BEFORE_RDB) {
+		return REDISMODULE_OK;
+	}
+
+	const uint64_t ndicts = RedisModule_LoadUnsigned(rdb);
+	RedisModule_Log(NULL, "debug", "Loading %llu dicts", ndicts);
+
+	load_dicts_release();
+	module.load_dicts = RedisModule_Calloc(ndicts,
+	    sizeof (*module.load_dicts));
+
+	for (uint64_t i = 0; i < ndicts; i++) {
+		const uint64_t id = RedisModule_LoadUnsigned(rdb);
+		const int active = encver == 0 ||
+		    RedisModule_LoadUnsigned(rdb) != 0;
+		const uint64_t prefix_len = RedisModule_LoadUnsigned(rdb);
+		char *prefix = NULL;
+
+		if (prefix_len > 0) {
+			prefix = RedisModule_LoadStringBuffer(rdb, NULL);
+		}
+		size_t buflen;
+		char *const buf = RedisModule_LoadStringBuffer(rdb,
+		    &buflen);
+
+		/* Still there after DEBUG RELOAD or a resync */
+		struct dict *dict = dict_find(id);
+		if (dict != NULL) {
+			dict_hold(dict, NULL);
+		} else {
+			dict = dict_new(&module, id, buf, buflen, prefix,
+			    prefix_len, module.clevel);
+		}
+		RedisModule_Free(buf);
+		RedisModule_Free(prefix);
+		if (dict == NULL) {
+			RedisModule_Log(NULL, "warning",
+			    "Failed to load dict %llu", id);
+			return REDISMODULE_ERR;
+		}
+		module.load_dicts[module.nload_dicts++] = dict;
+
+		if (active && !dict_is_active(&module, dict)) {
+			dict_hold(dict, NULL);
+			if (dict_activate(&module, dict) != 0) {
+				dict_rele(&module, dict, NULL);
+				return REDISMODULE_ERR;
+			}
+		}
+	}
+	return REDISMODULE_OK;
+}
+
+/*
+ * Reference the DDict of dict, creating it if needed, and expect frames in
+ * format. Both are kept as long as consecutive objects share them.
+ */
+int dctx_use_dict(struct compress_module *module, struct dict *dict,
+    ZSTD_format_e format) {
+	if (dict != NULL) {
+		if (dict->ddict == NULL) {
+			dict->ddict = ZSTD_createDDict_byReference(dict->buf,
+			    dict->buflen);
+			if (dict->ddict == NULL)
+				return -1;
+		}
+		dict->ddict_used = module->clock;
+	}
+
+	if (dict != module->dctx_dict) {
+		(void) ZSTD_DCtx_refDDict(module->dctx,
+		    dict != NULL ? dict->ddict : NULL);
+		module->dctx_dict = dict;
+	}
+	if (format != module->dctx_format) {
+		if (ZSTD_isError(ZSTD_DCtx_setParameter(module->dctx,
+		    ZSTD_d_format, format)))
+			return -1;
+		module->dctx_format = format;
+	}
+	return 0;
+}
+
+/*
+ * Free the DDicts that haven't been used for ddict-idle-timeout seconds,
+ * and likewise the CDicts of dictionaries no longer used for new objects.
+ */
+void dict_sweep_cb(RedisModuleCtx *ctx, void *data) {
+	REDISMODULE_NOT_USED(data);
+
+	module.clock = RedisModule_Milliseconds() / 1000;
+
+	if (module.ddict_idle_timeout > 0) {
+		const uint64_t idle = module.ddict_idle_timeout;
+		RedisModuleDictIter *const iter =
+		    RedisModule_DictIteratorStartC(module.all_dicts, "^",
+		    NULL, 0);
+		void *value;
+
+		while (RedisModule_DictNextC(iter, NULL, &value) != NULL) {
+			struct dict *const dict = value;
+
+			if (dict->njobs == 0 &&
+			    module.clock - dict->cdict_used >= idle &&
+			    !dict_is_active(&module, dict))
+				dict_free_cdicts(dict);
+			if (dict->ddict == NULL ||
+			    module.clock - dict->ddict_used < idle)
+				continue;
+			if (module.dctx_dict == dict) {
+				(void) ZSTD_DCtx_refDDict(module.dctx, NULL);
+				module.dctx_dict = NULL;
+			}
+			ZSTD_freeDDict(dict->ddict);
+			dict->ddict = NULL;
+		}
+		RedisModule_DictIteratorStop(iter);
+	}
+
+	pthread_mutex_lock(&module.free_lock);
+	const int drain = module.free_list != NULL && !module.free_timer;
+	module.free_timer |= drain;
+	pthread_mutex_unlock(&module.free_lock);
+	if (drain)
+		deferred_free_cb(ctx, NULL);
+
+	(void) RedisModule_CreateTimer(ctx, DICT_SWEEP_MS, dict_sweep_cb, NULL);
+}
+
+/*
+ * Decompress chunk i into dst, which must hold the chunk. Blocks of logs
+ * chained to the previous one are decompressed with its contents as the
+ * prefix instead of the dictionary.
+ */
+int zipstr_decompress_chunk(struct compress_module *module,
+    const struct zipstr *zs, const struct chunk_index *ci, size_t i,
+    const char *prefix, char *dst) {
+
+	const size_t len = chunk_len(ci->chunk_size, zs->orig_len, i);
+
+	struct dict *const dict = zipstr_dict(zs);
+
+	if (prefix == NULL) {
+		if (dctx_use_dict(module, dict, ZSTD_f_zstd1) != 0)
+			return -1;
+	} else {
+		if (dctx_use_dict(module, NULL, ZSTD_f_zstd1) != 0 ||
+		    ZSTD_isError(ZSTD_DCtx_refPrefix(module->dctx, prefix,
+		    ci->chunk_size)))
+			return -1;
+	}
+
+	const uint64_t start = module->stats ? monotonic_ns() : 0;
+	const size_t ret = ZSTD_decompressDCtx(module->dctx, dst, len,
+	    ci->frames + chunk_frame_start(ci, i), chunk_frame_len(ci, i));
+	if (ZSTD_isError(ret) != 0 || ret != len) {
+		return -1;
+	}
+	if (module->stats) {
+		codec_record_decompress(module, dict, monotonic_ns() - start,
+		    len);
+	}
+
+	return 0;
+}
+
+/*
+ * Decompress block i of a log into dst, along with the blocks it's chained
+ * to, which go to dst and scratch in turn. Both must hold a block.
+ */
+int log_block_read(struct compress_module *module, const struct zipstr *zs,
+    const struct chunk_index *li, size_t i, char *dst, char *scratch) {
+
+	char *const bufs[2] = { dst, scratch };
+	const size_t first = i - i % LOG_CHAIN;
+
+	for (size_t j = first; j <= i; j++) {
+		const char *const prefix = j > first ?
+		    bufs[(i - j + 1) % 2] : NULL;
+
+		if (zipstr_decompress_chunk(module, zs, li, j, prefix,
+		    bufs[(i - j) % 2]) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Decompress a log into dst, each block after the previous one.
+ */
+int log_decompress(struct compress_module *module, const struct zipstr *zs,
+    const struct chunk_index *li, char *dst) {
+
+	const size_t bs = li->chunk_size;
+
+	for (size_t i = 0; i < li->nchunks; i++) {
+		const char *const prefix = (i % LOG_CHAIN) != 0 ?
+		    dst + (i - 1) * bs : NULL;
+
+		if (zipstr_decompress_chunk(module, zs, li, i, prefix,
+		    dst + i * bs) != 0)
+			return -1;
+	}
+	(void) memcpy(dst + li->nchunks * bs, log_tail(li),
+	    log_tail_len(zs, li));
+
+	return 0;
+}
+
+/*
+ * Decompress the object into dst, which must hold zs->orig_len bytes.
+ */
+int zipstr_decompress(struct compress_module *module,
+    const struct zipstr *zs, char *dst) {
+
+	struct chunk_index li;
+
+	if (zipstr_log(zs, &li))
+		return log_decompress(module, zs, &li, dst);
+
+	struct dict *const dict = zipstr_dict(zs);
+	const ZSTD_format_e format = (zs->flags & ZIPSTR_MAGICLESS) ?
+	    ZSTD_f_zstd1_magicless : ZSTD_f_zstd1;
+
+	if (dctx_use_dict(module, dict, format) != 0)
+		return -1;
+
+	const uint64_t start = module->stats ? monotonic_ns() : 0;
+	const size_t orig_len = ZSTD_decompressDCtx(module->dctx, dst,
+	    zs->orig_len, zs->buf, zs->len);
+	if (ZSTD_isError(orig_len) != 0 || orig_len != zs->orig_len) {
+		return -1;
+	}
+	if (module->stats) {
+		codec_record_decompress(module, dict, monotonic_ns() - start,
+		    orig_len);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Decompress len bytes at offset of a log into dst. Only the blocks that
+ * overlap the range are decompressed, along with the ones the first of them
+ * is chained to.
+ */
+int log_read_range(struct compress_module *module, const struct zipstr *zs,
+    const struct chunk_index *li, size_t offset, size_t len, char *dst) {
+
+	const size_t bs = li->chunk_size;
+	const size_t end = offset + len;
+	const size_t sealed = li->nchunks * bs;
+	char *cur = NULL;
+	char *prev = NULL;
+	int err = 0;
+
+	if (offset < sealed) {
+		cur = RedisModule_Alloc(bs);
+		prev = RedisModule_Alloc(bs);
+	}
+	for (size_t i = offset / bs; i < li->nchunks && i * bs < end &&
+	    err == 0; i++) {
+		const size_t start = i * bs;
+
+		if (i > offset / bs && (i % LOG_CHAIN) != 0) {
+			err = zipstr_decompress_chunk(module, zs, li, i, prev,
+			    cur);
+		} else {
+			err = log_block_read(module, zs, li, i, cur, prev);
+		}
+
+		const size_t from = offset > start ? offset - start : 0;
+		const size_t to = end < start + bs ? end - start : bs;
+		(void) memcpy(dst + (start + from - offset), cur + from,
+		    to - from);
+
+		char *const tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+	RedisModule_Free(cur);
+	RedisModule_Free(prev);
+
+	if (err == 0 && end > sealed) {
+		const size_t from = offset > sealed ? offset - sealed : 0;
+
+		(void) memcpy(dst + (sealed + from - offset),
+		    log_tail(li) + from, end - sealed - from);
+	}
+
+	return err;
+}
+
+/*
+ * Decompress len bytes at offset into dst. Chunked objects and logs only
+ * decompress the chunks that overlap the range.
+ */
+int zipstr_read_range(struct compress_module *module, const struct zipstr *zs,
+    size_t offset, size_t len, char *dst) {
+
+	struct chunk_index ci;
+	int err = 0;
+
+	if (zipstr_log(zs, &ci))
+		return log_read_range(module, zs, &ci, offset, len, dst);
+
+	if (!zipstr_chunks(zs, &ci)) {
+		char *const buf = RedisModule_Alloc(zs->orig_len);
+
+		err = zipstr_decompress(module, zs, buf);
+		if (err == 0)
+			(void) memcpy(dst, buf + offset, len);
+		RedisModule_Free(buf);
+		return err;
+	}
+
+	const size_t cs = ci.chunk_size;
+	const size_t end = offset + len;
+	char *scratch = NULL;
+
+	for (size_t i = offset / cs; i * cs < end && err == 0; i++) {
+		const size_t start = i * cs;
+		const size_t clen = chunk_len(cs, zs->orig_len, i);
+
+		if (start >= offset && start + clen <= end) {
+			/* Whole chunk is in range */
+			err = zipstr_decompress_chunk(module, zs, &ci, i,
+			    NULL, dst + (start - offset));
+			continue;
+		}
+
+		if (scratch == NULL)
+			scratch = RedisModule_Alloc(cs);
+		err = zipstr_decompress_chunk(module, zs, &ci, i, NULL,
+		    scratch);
+
+		const size_t from = offset > start ? offset - start : 0;
+		const size_t to = end < start + clen ? end - start : clen;
+		(void) memcpy(dst + (start + from - offset), scratch + from,
+		    to - from);
+	}
+	RedisModule_Free(scratch);
+
+	return err;
+}
+
+/*
+ * Write data at offset into a copy of a chunked object. Only the chunks
+ * that change are decompressed and compressed again; the frames of the
+ * others are copied as is. Bytes between the end of the object and offset
+ * are zeroed.
+ */
+struct zipstr *zipstr_setrange_chunked(struct compress_module *module,
+    const struct zipstr *zs, const struct chunk_index *ci,
+    const ZSTD_CDict *cdict, size_t offset, const char *data, size_t len) {
+
+	const int clevel = tune_levels[module->tuner.step];
+	const size_t cs = ci->chunk_size;
+	const size_t new_len = offset + len > zs->orig_len ? offset + len :
+	    zs->orig_len;
+	const size_t nchunks = (new_len + cs - 1) / cs;
+	const size_t lo = offset < zs->orig_len ? offset : zs->orig_len;
+	const size_t first = lo / cs;
+	const size_t last = (offset + len - 1) / cs;
+	const size_t hdr = chunk_index_size(nchunks);
+
+	/* Untouched frames are copied; the others get a worst case bound */
+	size_t cap = hdr;
+	for (size_t i = 0; i < nchunks; i++) {
+		if (i < first || i > last) {
+			cap += chunk_frame_len(ci, i);
+		} else {
+			cap += ZSTD_compressBound(chunk_len(cs, new_len, i));
+		}
+	}
+
+	struct zipstr *nzs = zipstr_new(cap);
+	char *const scratch = RedisModule_Alloc(cs);
+	size_t off = 0;
+
+	for (size_t i = 0; i < nchunks; i++) {
+		char *const dst = nzs->buf + hdr + off;
+
+		if (i < first || i > last) {
+			const size_t flen = chunk_frame_len(ci, i);
+
+			(void) memcpy(dst, ci->frames +
+			    chunk_frame_start(ci, i), flen);
+			off += flen;
+			le32_write(nzs->buf + CHUNK_HDR_SIZE + 4 * i, off);
+			continue;
+		}
+
+		const size_t start = i * cs;
+		const size_t clen = chunk_len(cs, new_len, i);
+		size_t old_len = 0;
+
+		if (start < zs->orig_len) {
+			old_len = chunk_len(cs, zs->orig_len, i);
+			if (zipstr_decompress_chunk(module, zs, ci, i, NULL,
+			    scratch) != 0) {
+				RedisModule_Free(scratch);
+				RedisModule_Free(nzs);
+				return NULL;
+			}
+		}
+		(void) memset(scratch + old_len, 0, clen - old_len);
+
+		const size_t from = offset > start ? offset - start : 0;
+		const size_t to = offset + len < start + clen ?
+		    offset + len - start : clen;
+		if (from < to) {
+			(void) memcpy(scratch + from, data + (start + from -
+			    offset), to - from);
+		}
+
+		const size_t flen = frame_compress(module->cctx, clevel, cdict,
+		    dst, cap - hdr - off, scratch, clen);
+		if (ZSTD_isError(flen) != 0) {
+			RedisModule_Free(scratch);
+			RedisModule_Free(nzs);
+			return NULL;
+		}
+		off += flen;
+		le32_write(nzs->buf + CHUNK_HDR_SIZE + 4 * i, off);
+	}
+	RedisModule_Free(scratch);
+	chunk_index_write(nzs->buf, cs, nchunks);
+
+	nzs = zipstr_shrink(nzs, hdr + off);
+	nzs->orig_len = new_len;
+
+	return nzs;
+}
+
+struct zipstr *zipstr_setrange_whole(struct compress_module *module,
+    const struct zipstr *zs, const ZSTD_CDict *cdict, size_t offset,
+    const char *data, size_t len, char **raw) {
+
+	const size_t new_len = offset + len > zs->orig_len ? offset + len :
+	    zs->orig_len;
+	char *const buf = RedisModule_Alloc(new_len);
+
+	if (zipstr_decompress(module, zs, buf) != 0) {
+		RedisModule_Free(buf);
+		return NULL;
+	}
+	if (offset > zs->orig_len) {
+		(void) memset(buf + zs->orig_len, 0, offset - zs->orig_len);
+	}
+	(void) memcpy(buf + offset, data, len);
+
+	struct zipstr *const nzs = zipstr_encode(module->cctx,
+	    tune_levels[module->tuner.step], cdict, buf, new_len,
+	    module->chunk_size, &module->large);
+	if (nzs == NULL) {
+		*raw = buf;
+		return NULL;
+	}
+	RedisModule_Free(buf);
+
+	return nzs;
+}
+
+/*
+ * Write data at offset into a copy of the object, growing it as needed.
+ * Returns a new object that isn't accounted for yet, with the dictionary
+ * it was compressed with set. If the result doesn't compress, NULL is
+ * returned and *raw is set to the new contents, which the caller frees.
+ * Both are NULL on decompression errors.
+ */
+struct zipstr *zipstr_setrange(struct compress_module *module,
+    const struct zipstr *zs, size_t offset, const char *data, size_t len,
+    char **raw) {
+
+	struct dict *const dict = zipstr_dict(zs);
+	const ZSTD_CDict *const cdict = dict != NULL ? dict_cdict(dict) :
+	    NULL;
+	struct chunk_index ci;
+	struct zipstr *nzs;
+
+	*raw = NULL;
+
+	/* Without the CDict, the whole value is compressed without it */
+	if (zipstr_chunks(zs, &ci) && (dict == NULL || cdict != NULL)) {
+		nzs = zipstr_setrange_chunked(module, zs, &ci, cdict, offset,
+		    data, len);
+	} else {
+		nzs = zipstr_setrange_whole(module, zs, cdict, offset, data,
+		    len, raw);
+	}
+
+	if (nzs != NULL)
+		nzs->dict_slot = cdict != NULL ? zs->dict_slot : 0;
+	return nzs;
+}
+
+/*
+ * Append data to a log, compressing the blocks that the tail and data fill.
+ * Returns the log, which may have moved, or NULL if a block couldn't be
+ * compressed, or the one it's chained to decompressed, leaving zs as it
+ * was. Only the new blocks are written; the frames before stay in place.
+ */
+struct zipstr *log_seal(struct compress_module *module, struct zipstr *zs,
+    const struct chunk_index *li, const ZSTD_CDict *cdict,
+    const char *data, size_t len) {
+
+	const int clevel = tune_levels[module->tuner.step];
+	const size_t bs = li->chunk_size;
+	const size_t n = li->nchunks;
+	const size_t tail_len = log_tail_len(zs, li);
+	const size_t nseal = (tail_len + len) / bs;
+	const size_t rest = tail_len + len - nseal * bs;
+	const size_t cap = nseal * ZSTD_compressBound(bs);
+	struct dict *const dict = zipstr_dict(zs);
+
+	/* Contents of the new blocks and tail */
+	char *const buf = RedisModule_Alloc(tail_len + len);
+	(void) memcpy(buf, log_tail(li), tail_len);
+	(void) memcpy(buf + tail_len, data, len);
+
+	/* The last block, if the first new one is chained to it */
+	char *prev = NULL;
+	if (nseal > 0 && (n % LOG_CHAIN) != 0) {
+		prev = RedisModule_Alloc(2 * bs);
+		if (log_block_read(module, zs, li, n - 1, prev,
+		    prev + bs) != 0) {
+			RedisModule_Free(prev);
+			RedisModule_Free(buf);
+			return NULL;
+		}
+	}
+
+	char *const frames = RedisModule_Alloc(cap);
+	unsigned char *const ends = RedisModule_Alloc(4 * (n + nseal));
+	const char *prefix = prev;
+	size_t off = chunk_frame_start(li, n);
+	size_t frames_len = 0;
+
+	(void) memcpy(ends, li->ends, 4 * n);
+	for (size_t j = 0; j < nseal; j++) {
+		const size_t i = n + j;
+		const char *const src = buf + j * bs;
+		const uint64_t start = module->stats ? monotonic_ns() : 0;
+		const size_t flen = log_block_compress(module->cctx, clevel,
+		    cdict, (i % LOG_CHAIN) != 0 ? prefix : NULL,
+		    frames + frames_len, cap - frames_len, src, bs);
+
+		if (ZSTD_isError(flen) != 0) {
+			RedisModule_Free(ends);
+			RedisModule_Free(frames);
+			RedisModule_Free(prev);
+			RedisModule_Free(buf);
+			return NULL;
+		}
+		if (module->stats) {
+			codec_record_compress(module, dict,
+			    monotonic_ns() - start, bs, flen);
+		}
+		frames_len += flen;
+		off += flen;
+		le32_write(ends + 4 * i, off);
+		prefix = src;
+	}
+
+	/* The tail and ends are written over; both were copied above */
+	const size_t new_len = chunk_index_size(n + nseal) + off + rest;
+	const size_t at = CHUNK_HDR_SIZE + chunk_frame_start(li, n);
+
+	if (new_len > zs->len)
+		zs = RedisModule_Realloc(zs, sizeof (*zs) + new_len);
+	(void) memcpy(zs->buf + at, frames, frames_len);
+	(void) memcpy(zs->buf + at + frames_len, buf + nseal * bs, rest);
+	(void) memcpy(zs->buf + at + frames_len + rest, ends, 4 * (n + nseal));
+	log_header_write(zs->buf, bs, n + nseal);
+	RedisModule_Free(ends);
+	RedisModule_Free(frames);
+	RedisModule_Free(prev);
+	RedisModule_Free(buf);
+
+	zs = zipstr_shrink(zs, new_len);
+	zs->orig_len += len;
+
+	return zs;
+}
+
+/*
+ * New log of data with blocks of block_size, compressed with dict (or
+ * without if NULL). Returns an object that isn't accounted for yet, or
+ * NULL on errors.
+ */
+struct zipstr *log_encode(struct compress_module *module, struct dict *dict,
+    const char *data, size_t len, size_t block_size) {
+
+	const ZSTD_CDict *const cdict = dict != NULL ? dict_cdict(dict) :
+	    NULL;
+
+	if (dict != NULL && cdict == NULL)
+		return NULL;
+
+	struct zipstr *const empty = zipstr_new(CHUNK_HDR_SIZE);
+	struct chunk_index li;
+
+	log_header_write(empty->buf, block_size, 0);
+	empty->len = CHUNK_HDR_SIZE;
+	empty->orig_len = 0;
+	empty->dict_slot = dict != NULL ? dict->slot : 0;
+	(void) zipstr_log(empty, &li);
+
+	struct zipstr *const zs = log_seal(module, empty, &li, cdict, data,
+	    len);
+	if (zs == NULL)
+		RedisModule_Free(empty);
+
+	return zs;
+}
+
+/*
+ * Append data to the tail of a log, when it doesn't fill a block. Returns
+ * the log, which may have moved.
+ */
+struct zipstr *log_grow(struct zipstr *zs, const struct chunk_index *li,
+    const char *data, size_t len) {
+
+	const size_t ends_len = 4 * li->nchunks;
+	const size_t at = zs->len - ends_len;
+
+	zs = RedisModule_Realloc(zs, sizeof (*zs) + zs->len + len);
+	(void) memmove(zs->buf + at + len, zs->buf + at, ends_len);
+	(void) memcpy(zs->buf + at, data, len);
+	zs->len += len;
+	zs->orig_len += len;
+
+	return zs;
+}
+
+/*
+ * Append data to an accounted log. Until the tail fills a block, data is
+ * only copied to it. Returns the log, which may have moved, or NULL if a
+ * block couldn't be compressed, leaving zs as it was.
+ */
+struct zipstr *log_append(struct compress_module *module, struct zipstr *zs,
+    const char *data, size_t len) {
+
+	struct dict *const dict = zipstr_dict(zs);
+	const ZSTD_CDict *cdict = NULL;
+	struct chunk_index li;
+	struct zipstr *nzs;
+
+	(void) zipstr_log(zs, &li);
+
+	const size_t old_len = zs->len;
+	const size_t old_tail = log_tail_len(zs, &li);
+
+	/* Cached copies are found by address, and out of date anyway */
+	cache_remove(&module->cache, zs);
+
+	if (old_tail + len < li.chunk_size) {
+		nzs = log_grow(zs, &li, data, len);
+	} else {
+		if (dict != NULL && (cdict = dict_cdict(dict)) == NULL)
+			return NULL;
+		nzs = log_seal(module, zs, &li, cdict, data, len);
+		if (nzs == NULL)
+			return NULL;
+	}
+
+	(void) zipstr_log(nzs, &li);
+
+	module->mem_total_uncompressed += len;
+	module->mem_total_compressed += nzs->len - old_len;
+	module->log_tail_bytes += log_tail_len(nzs, &li) - old_tail;
+	if (dict != NULL) {
+		dict->mem_uncompressed += len;
+		dict->mem_compressed += nzs->len - old_len;
+	}
+
+	return nzs;
+}
+
+/*
+ * Reply with the decompressed object. The buffer is grown as needed so it
+ * can be reused across objects; the caller frees it.
+ */
+int zipstr_reply(RedisModuleCtx *ctx, const struct zipstr *zs, char **buf,
+    size_t *buflen) {
+
+	const struct cache_entry *const e = cache_get(&module.cache, zs);
+	if (e != NULL) {
+		return RedisModule_ReplyWithStringBuffer(ctx, e->data, e->len);
+	}
+
+	if (*buflen < zs->orig_len) {
+		RedisModule_Free(*buf);
+		*buf = RedisModule_Alloc(zs->orig_len);
+		*buflen = zs->orig_len;
+	}
+
+	if (zipstr_decompress(&module, zs, *buf) != 0) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR decompression failed");
+	}
+	cache_admit(&module.cache, zs, *buf, zs->orig_len);
+
+	return RedisModule_ReplyWithStringBuffer(ctx, *buf, zs->orig_len);
+}
+
+/*
+ * Propagate the new value of keyname as SETRAW, so that replicas and the
+ * AOF store the compressed bytes rather than compressing the value again.
+ */
+void zipstr_replicate(RedisModuleCtx *ctx, RedisModuleString *keyname,
+    const struct zipstr *zs, int keepttl) {
+	const struct dict *const dict = zipstr_dict(zs);
+	const long long id = dict != NULL ? dict->id : 0;
+	size_t len;
+	const char *const frames = zipstr_frames(zs, &len);
+
+	if (keepttl) {
+		RedisModule_Replicate(ctx, MODPREFIX".setraw", "sllbc",
+		    keyname, id, (long long)zs->orig_len, frames, len,
+		    "KEEPTTL");
+	} else {
+		RedisModule_Replicate(ctx, MODPREFIX".setraw", "sllb",
+		    keyname, id, (long long)zs->orig_len, frames, len);
+	}
+	zipstr_frames_free(zs, frames);
+}
+
+/*
+ * Whether the calling client may be blocked while a background job runs.
+ */
+int can_block(RedisModuleCtx *ctx) {
+	int deny = REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA |
+	    REDISMODULE_CTX_FLAGS_LOADING;
+#ifdef REDISMODULE_CTX_FLAGS_DENY_BLOCKING
+	deny |= REDISMODULE_CTX_FLAGS_DENY_BLOCKING;
+#endif
+
+	return (RedisModule_GetContextFlags(ctx) & deny) == 0;
+}
+
+void *worker_main(void *arg) {
+	struct worker_pool *const pool = arg;
+	ZSTD_CCtx *const cctx = ZSTD_createCCtx();
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->head == NULL) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		struct compress_job *const job = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL) {
+			pool->tail = &pool->head;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		const uint64_t start = job->measure ? monotonic_ns() : 0;
+
+		job->zs = zipstr_encode(cctx, job->clevel, job->cdict,
+		    job->data, job->len, job->chunk_size, &job->large);
+		if (job->measure)
+			job->ns = monotonic_ns() - start;
+		compress_job_install(job);
+		RedisModule_UnblockClient(job->bc, job);
+	}
+
+	return NULL;
+}
+
+int worker_pool_start(struct worker_pool *pool) {
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->head = NULL;
+	pool->tail = &pool->head;
+	pool->njobs = 0;
+
+	for (long long i = 0; i < pool->nthreads; i++) {
+		pthread_t tid;
+
+		if (pthread_create(&tid, NULL, worker_main, pool) != 0) {
+			RedisModule_Log(NULL, "warning",
+			    "Could not start compression thread");
+			return REDISMODULE_ERR;
+		}
+		(void) pthread_detach(tid);
+	}
+
+	return REDISMODULE_OK;
+}
+
+void worker_pool_submit(struct worker_pool *pool, struct compress_job *job) {
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	*pool->tail = job;
+	pool->tail = &job->next;
+	pool->njobs++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Parse the options of SET key value [NX|XX] [GET]
+ * [EX seconds|PX milliseconds|EXAT unix-time|PXAT unix-time-ms|KEEPTTL].
+ * Returns an error message, or NULL.
+ */
+const char *set_opts_parse(RedisModuleString **argv, int argc,
+    struct set_opts *opts) {
+	(void) memset(opts, 0, sizeof (*opts));
+
+	for (int i = 3; i < argc; i++) {
+		const char *const opt = RedisModule_StringPtrLen(argv[i], NULL);
+		const int has_expire = opts->expire_at != 0 || opts->keepttl;
+		long long mul = 0, now = 0, v;
+
+		if (strcasecmp(opt, "nx") == 0 && !opts->xx) {
+			opts->nx = 1;
+		} else if (strcasecmp(opt, "xx") == 0 && !opts->nx) {
+			opts->xx = 1;
+		} else if (strcasecmp(opt, "get") == 0) {
+			opts->get = 1;
+		} else if (strcasecmp(opt, "keepttl") == 0 && !has_expire) {
+			opts->keepttl = 1;
+		} else if (strcasecmp(opt, "ex") == 0 && !has_expire) {
+			mul = 1000;
+			now = RedisModule_Milliseconds();
+		} else if (strcasecmp(opt, "px") == 0 && !has_expire) {
+			mul = 1;
+			now = RedisModule_Milliseconds();
+		} else if (strcasecmp(opt, "exat") == 0 && !has_expire) {
+			mul = 1000;
+		} else if (strcasecmp(opt, "pxat") == 0 && !has_expire) {
+			mul = 1;
+		} else {
+			return "ERR syntax error";
+		}
+		if (mul == 0)
+			continue;
+
+		if (++i == argc)
+			return "ERR syntax error";
+		if (RedisModule_StringToLongLong(argv[i], &v) !=
+		    REDISMODULE_OK) {
+			return "ERR value is not an integer or out of range";
+		}
+		if (v <= 0 || v > (LLONG_MAX - now) / mul)
+			return "ERR invalid expire time in 'set' command";
+		opts->expire_at = now + v * mul;
+	}
+	if (opts->get && opts->nx)
+		return "ERR syntax error";
+
+	return NULL;
+}
+
+/*
+ * Store the compressed object zs, or val if NULL, at the open key, apply
+ * the expiry options and propagate the write. A SET with an expiry time in
+ * the past deletes the key.
+ */
+void set_value(RedisModuleCtx *ctx, RedisModuleKey *key,
+    RedisModuleString *keyname, struct zipstr *zs, RedisModuleString *val,
+    const struct set_opts *opts) {
+	const mstime_t ttl = opts->keepttl ? RedisModule_GetExpire(key) :
+	    REDISMODULE_NO_EXPIRE;
+
+	if (zs != NULL)
+		RedisModule_ModuleTypeSetValue(key, ZipString_Type, zs);
+	else
+		RedisModule_StringSet(key, val);
+
+	if (opts->expire_at != 0) {
+		const mstime_t left = opts->expire_at -
+		    RedisModule_Milliseconds();
+
+		if (left <= 0) {
+			RedisModule_DeleteKey(key);
+			RedisModule_Replicate(ctx, "DEL", "s", keyname);
+			return;
+		}
+		RedisModule_SetExpire(key, left);
+	} else if (ttl != REDISMODULE_NO_EXPIRE) {
+		RedisModule_SetExpire(key, ttl);
+	}
+
+	if (zs != NULL) {
+		zipstr_replicate(ctx, keyname, zs, opts->keepttl);
+	} else if (opts->keepttl) {
+		RedisModule_Replicate(ctx, "SET", "ssc", keyname, val,
+		    "KEEPTTL");
+	} else {
+		RedisModule_Replicate(ctx, "SET", "ss", keyname, val);
+	}
+	if (opts->expire_at != 0) {
+		RedisModule_Replicate(ctx, "PEXPIREAT", "sl", keyname,
+		    (long long)opts->expire_at);
+	}
+}
+
+/*
+ * Store the compressed value from the worker thread, under the GIL, before
+ * the client is unblocked. The SET takes effect even if the client goes
+ * away meanwhile, like a SET that isn't offloaded.
+ */
+void compress_job_install(struct compress_job *job) {
+	RedisModuleCtx *const ctx = RedisModule_GetThreadSafeContext(job->bc);
+
+	RedisModule_ThreadSafeContextLock(ctx);
+	(void) RedisModule_SelectDb(ctx, job->db);
+
+	if (job->measure) {
+		const size_t out = job->zs != NULL ? job->zs->len : job->len;
+
+		if (module.stats) {
+			codec_record_compress(&module, job->dict, job->ns,
+			    job->len, out);
+		}
+		if (module.autotune) {
+			tuner_record(&module, job->dict != NULL ?
+			    &job->dict->tuner : &module.tuner, job->dict,
+			    job->ns, job->len, out);
+		}
+	}
+
+	struct zipstr *zs = NULL;
+	if (job->zs != NULL) {
+		zs = zipstr_init(&module, job->zs, job->dict, job->zs->len,
+		    job->zs->orig_len);
+		job->zs = NULL;
+	} else {
+		module.nskipped[SKIP_INCOMPRESSIBLE]++;
+	}
+
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, job->keyname,
+	    REDISMODULE_WRITE);
+
+	set_value(ctx, key, job->keyname, zs, job->val, &job->opts);
+	RedisModule_CloseKey(key);
+
+	RedisModule_ThreadSafeContextUnlock(ctx);
+	RedisModule_FreeThreadSafeContext(ctx);
+}
+
+/*
+ * Reply once the worker has stored the value.
+ */
+int compress_job_reply(RedisModuleCtx *ctx, RedisModuleString **argv,
+    int argc) {
+	REDISMODULE_NOT_USED(argv);
+	REDISMODULE_NOT_USED(argc);
+
+	return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+void compress_job_free(RedisModuleCtx *ctx, void *privdata) {
+	REDISMODULE_NOT_USED(ctx);
+
+	struct compress_job *const job = privdata;
+
+	if (job->dict != NULL) {
+		job->dict->njobs--;
+		dict_trim(&module, job->dict);
+		dict_rele(&module, job->dict, NULL);
+	}
+	RedisModule_FreeString(NULL, job->keyname);
+	RedisModule_FreeString(NULL, job->val);
+	RedisModule_Free(job);
+
+	module.pool.njobs--;
+}
+
+/*
+ * Hand the value to the worker pool and block the client until it has been
+ * compressed and stored.
+ */
+int compress_offload(RedisModuleCtx *ctx, RedisModuleString *keyname,
+    RedisModuleString *val, const struct set_opts *opts) {
+	struct compress_job *const job = RedisModule_Calloc(1, sizeof (*job));
+	size_t key_len;
+	const char *const keystr = RedisModule_StringPtrLen(keyname, &key_len);
+
+	job->data = RedisModule_StringPtrLen(val, &job->len);
+	job->clevel = tune_levels[module.tuner.step];
+	job->chunk_size = module.chunk_size;
+	job->large = module.large;
+
+	/* Keep the dictionary alive until the object holds its own ref */
+	job->dict = dict_lookup(&module, NULL, keystr, key_len);
+	if (job->dict != NULL && (job->cdict = dict_cdict(job->dict)) == NULL)
+		job->dict = NULL;
+	if (job->dict != NULL) {
+		dict_hold(job->dict, NULL);
+		job->dict->njobs++;
+	}
+	job->measure = module.autotune || module.stats;
+	job->opts = *opts;
+	job->db = RedisModule_GetSelectedDb(ctx);
+
+	RedisModule_RetainString(NULL, keyname);
+	RedisModule_RetainString(NULL, val);
+	job->keyname = keyname;
+	job->val = val;
+
+	job->bc = RedisModule_BlockClient(ctx, compress_job_reply, NULL,
+	    compress_job_free, 0);
+	module.noffloaded++;
+	worker_pool_submit(&module.pool, job);
+
+	return REDISMODULE_OK;
+}
+
+/*
+ * SET key value [NX|XX] [GET]
+ * [EX seconds|PX milliseconds|EXAT unix-time|PXAT unix-time-ms|KEEPTTL]
+ *
+ * Values are only compressed on a worker thread for plain SETs, optionally
+ * with an expiry time, as the others depend on the key's current value.
+ */
+int set_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc < 3)
+		return RedisModule_WrongArity(ctx);
+
+	struct set_opts opts;
+	const char *const err = set_opts_parse(argv, argc, &opts);
+	if (err != NULL)
+		return RedisModule_ReplyWithError(ctx, err);
+
+	RedisModuleString *const keyname = argv[1];
+	RedisModuleString *const val = argv[2];
+	size_t src_len;
+	const char *const src = RedisModule_StringPtrLen(val, &src_len);
+	size_t key_len;
+	const char *const keystr = RedisModule_StringPtrLen(keyname, &key_len);
+
+	if (!opts.nx && !opts.xx && !opts.get && !opts.keepttl &&
+	    module.pool.nthreads > 0 &&
+	    src_len >= (size_t)module.offload_threshold && can_block(ctx) &&
+	    compress_skip(&module, src, src_len) == SKIP_NONE) {
+		return compress_offload(ctx, keyname, val, &opts);
+	}
+
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, keyname,
+	    REDISMODULE_READ | REDISMODULE_WRITE);
+	const int type = RedisModule_KeyType(key);
+
+	if (opts.get && type != REDISMODULE_KEYTYPE_EMPTY &&
+	    type != REDISMODULE_KEYTYPE_STRING &&
+	    (type != REDISMODULE_KEYTYPE_MODULE ||
+	    RedisModule_ModuleTypeGetType(key) != ZipString_Type)) {
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithError(ctx, "ERR bad type");
+	}
+	if ((opts.nx && type != REDISMODULE_KEYTYPE_EMPTY) ||
+	    (opts.xx && type == REDISMODULE_KEYTYPE_EMPTY)) {
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithNull(ctx);
+	}
+
+	if (opts.get) {
+		if (type == REDISMODULE_KEYTYPE_EMPTY) {
+			RedisModule_ReplyWithNull(ctx);
+		} else if (type == REDISMODULE_KEYTYPE_STRING) {
+			size_t len;
+			const char *const str = RedisModule_StringDMA(key,
+			    &len, REDISMODULE_READ);
+
+			RedisModule_ReplyWithStringBuffer(ctx, str, len);
+		} else {
+			char *buf = NULL;
+			size_t buflen = 0;
+
+			zipstr_reply(ctx, RedisModule_ModuleTypeGetValue(key),
+			    &buf, &buflen);
+			RedisModule_Free(buf);
+		}
+	}
+
+	struct zipstr *const zs = zipstr_create(&module, keystr, key_len,
+	    src, src_len);
+
+	set_value(ctx, key, keyname, zs, val, &opts);
+	RedisModule_CloseKey(key);
+
+	if (opts.get)
+		return REDISMODULE_OK;
+	return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+int get_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc != 2)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModuleString *const keyname = argv[1];
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, keyname,
+	    REDISMODULE_READ);
+	
+	switch (RedisModule_KeyType(key)) {
+	case REDISMODULE_KEYTYPE_MODULE:
+	        if (RedisModule_ModuleTypeGetType(key) != ZipString_Type) {
+			RedisModule_CloseKey(key);
+			return RedisModule_ReplyWithError(ctx, "ERR bad type");
+		}
+	        break;
+	case REDISMODULE_KEYTYPE_EMPTY:
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithNull(ctx);
+	case REDISMODULE_KEYTYPE_STRING:
+		{
+			size_t len;
+			const char *const str = RedisModule_StringDMA(key,
+			    &len, REDISMODULE_READ);
+
+			RedisModule_ReplyWithStringBuffer(ctx, str, len);
+			RedisModule_CloseKey(key);
+			return REDISMODULE_OK;
+		}
+	default:
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithError(ctx, "ERR bad type");
+	}
+
+	const struct zipstr *const zs = RedisModule_ModuleTypeGetValue(key);
+	char *buf = NULL;
+	size_t buflen = 0;
+
+	zipstr_reply(ctx, zs, &buf, &buflen);
+	RedisModule_Free(buf);
+	RedisModule_CloseKey(key);
+
+	return REDISMODULE_OK;
+}
+
+/*
+ * GETDEL key
+ */
+int getdel_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc != 2)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, argv[1],
+	    REDISMODULE_READ | REDISMODULE_WRITE);
+
+	switch (RedisModule_KeyType(key)) {
+	case REDISMODULE_KEYTYPE_MODULE:
+		if (RedisModule_ModuleTypeGetType(key) != ZipString_Type) {
+			RedisModule_CloseKey(key);
+			return RedisModule_ReplyWithError(ctx, "ERR bad type");
+		}
+		{
+			char *buf = NULL;
+			size_t buflen = 0;
+
+			zipstr_reply(ctx, RedisModule_ModuleTypeGetValue(key),
+			    &buf, &buflen);
+			RedisModule_Free(buf);
+		}
+		break;
+	case REDISMODULE_KEYTYPE_STRING:
+		{
+			size_t len;
+			const char *const str = RedisModule_StringDMA(key,
+			    &len, REDISMODULE_READ);
+
+			RedisModule_ReplyWithStringBuffer(ctx, str, len);
+		}
+		break;
+	case REDISMODULE_KEYTYPE_EMPTY:
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithNull(ctx);
+	default:
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithError(ctx, "ERR bad type");
+	}
+
+	RedisModule_DeleteKey(key);
+	RedisModule_CloseKey(key);
+	RedisModule_Replicate(ctx, "DEL", "s", argv[1]);
+
+	return REDISMODULE_OK;
+}
+
+/*
+ * MSET key value [key value ...]
+ */
+int mset_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc < 3 || (argc % 2) == 0)
+		return RedisModule_WrongArity(ctx);
+
+	struct prefix_cache cache = { .n = 0 };
+
+	for (int i = 1; i < argc; i += 2) {
+		size_t key_len;
+		const char *const keystr = RedisModule_StringPtrLen(argv[i],
+		    &key_len);
+		size_t src_len;
+		const char *const src = RedisModule_StringPtrLen(argv[i + 1],
+		    &src_len);
+
+		struct dict *const dict = dict_lookup(&module, &cache, keystr,
+		    key_len);
+		struct zipstr *const zs = zipstr_compress(&module, dict, src,
+		    src_len);
+
+		RedisModuleKey *const key = RedisModule_OpenKey(ctx, argv[i],
+		    REDISMODULE_WRITE);
+		if (zs != NULL) {
+			RedisModule_ModuleTypeSetValue(key, ZipString_Type, zs);
+			zipstr_replicate(ctx, argv[i], zs, 0);
+		} else {
+			RedisModule_StringSet(key, argv[i + 1]);
+			RedisModule_Replicate(ctx, "SET", "ss", argv[i],
+			    argv[i + 1]);
+		}
+		RedisModule_CloseKey(key);
+	}
+
+	return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/*
+ * MGET key [key ...]
+ *
+ * Like MGET, keys that don't hold a string reply with nil.
+ */
+int mget_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc < 2)
+		return RedisModule_WrongArity(ctx);
+
+	/* Shared by all keys; grown to the largest value */
+	char *buf = NULL;
+	size_t buflen = 0;
+
+	RedisModule_ReplyWithArray(ctx, argc - 1);
+	for (int i = 1; i < argc; i++) {
+		RedisModuleKey *const key = RedisModule_OpenKey(ctx, argv[i],
+		    REDISMODULE_READ);
+
+		switch (RedisModule_KeyType(key)) {
+		case REDISMODULE_KEYTYPE_MODULE:
+			if (RedisModule_ModuleTypeGetType(key) !=
+			    ZipString_Type) {
+				RedisModule_ReplyWithNull(ctx);
+				break;
+			}
+			zipstr_reply(ctx, RedisModule_ModuleTypeGetValue(key),
+			    &buf, &buflen);
+			break;
+		case REDISMODULE_KEYTYPE_STRING:
+			{
+				size_t len;
+				const char *const str = RedisModule_StringDMA(
+				    key, &len, REDISMODULE_READ);
+				RedisModule_ReplyWithStringBuffer(ctx, str,
+				    len);
+			}
+			break;
+		default:
+			RedisModule_ReplyWithNull(ctx);
+			break;
+		}
+		RedisModule_CloseKey(key);
+	}
+	RedisModule_Free(buf);
+
+	return REDISMODULE_OK;
+}
+
+/*
+ * Reply with the stored form of a key: an array of the dictionary ID (0 for
+ * none), the original length and the zstd frames of a compressed value, or
+ * the value itself if it isn't compressed. Logs can't be decoded on their
+ * own, so they are decompressed too. Returns -1 without replying if the key
+ * holds another type.
+ */
+int raw_reply(RedisModuleCtx *ctx, RedisModuleKey *key) {
+	switch (RedisModule_KeyType(key)) {
+	case REDISMODULE_KEYTYPE_MODULE:
+		if (RedisModule_ModuleTypeGetType(key) != ZipString_Type)
+			return -1;
+		{
+			const struct zipstr *const zs =
+			    RedisModule_ModuleTypeGetValue(key);
+			const struct dict *const dict = zipstr_dict(zs);
+			struct chunk_index li;
+
+			if (zipstr_log(zs, &li)) {
+				char *buf = NULL;
+				size_t buflen = 0;
+
+				zipstr_reply(ctx, zs, &buf, &buflen);
+				RedisModule_Free(buf);
+				return 0;
+			}
+
+			size_t len;
+			const char *const frames = zipstr_frames(zs, &len);
+
+			RedisModule_ReplyWithArray(ctx, 3);
+			RedisModule_ReplyWithLongLong(ctx,
+			    dict != NULL ? dict->id : 0);
+			RedisModule_ReplyWithLongLong(ctx, zs->orig_len);
+			RedisModule_ReplyWithStringBuffer(ctx, frames, len);
+			zipstr_frames_free(zs, frames);
+		}
+		return 0;
+	case REDISMODULE_KEYTYPE_STRING:
+		{
+			size_t len;
+			const char *const str = RedisModule_StringDMA(key,
+			    &len, REDISMODULE_READ);
+
+			RedisModule_ReplyWithStringBuffer(ctx, str, len);
+		}
+		return 0;
+	case REDISMODULE_KEYTYPE_EMPTY:
+		RedisModule_ReplyWithNull(ctx);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * GETRAW key
+ *
+ * Return the value without decompressing it, for clients that decompress
+ * on their own with the dictionaries of COMPRESS.DICT DUMP.
+ */
+int GetRawCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc != 2)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, argv[1],
+	    REDISMODULE_READ);
+	const int err = raw_reply(ctx, key);
+
+	RedisModule_CloseKey(key);
+	if (err != 0)
+		return RedisModule_ReplyWithError(ctx, "ERR bad type");
+
+	return REDISMODULE_OK;
+}
+
+/*
+ * MGETRAW key [key ...]
+ */
+int MGetRawCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc < 2)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModule_ReplyWithArray(ctx, argc - 1);
+	for (int i = 1; i < argc; i++) {
+		RedisModuleKey *const key = RedisModule_OpenKey(ctx, argv[i],
+		    REDISMODULE_READ);
+
+		if (raw_reply(ctx, key) != 0)
+			RedisModule_ReplyWithNull(ctx);
+		RedisModule_CloseKey(key);
+	}
+
+	return REDISMODULE_OK;
+}
+
+/*
+ * Clamp a GETRANGE style inclusive range to a value of len bytes. Returns
+ * the number of bytes in range, 0 if it's empty.
+ */
+size_t range_clamp(long long start, long long end, size_t len,
+    size_t *offset) {
+
+	const long long llen = (long long)len;
+
+	if (start < 0)
+		start += llen;
+	if (end < 0)
+		end += llen;
+	if (start < 0)
+		start = 0;
+	if (end < 0)
+		end = 0;
+	if (end >= llen)
+		end = llen - 1;
+	if (len == 0 || start > end)
+		return 0;
+
+	*offset = start;
+	return end - start + 1;
+}
+
+/*
+ * GETRANGE key start end
+ *
+ * Only the chunks overlapping the range are decompressed.
+ */
+int getrange_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc != 4)
+		return RedisModule_WrongArity(ctx);
+
+	long long start, end;
+	if (RedisModule_StringToLongLong(argv[2], &start) != REDISMODULE_OK ||
+	    RedisModule_StringToLongLong(argv[3], &end) != REDISMODULE_OK) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR value is not an integer or out of range");
+	}
+
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, argv[1],
+	    REDISMODULE_READ);
+	size_t offset = 0;
+	size_t len;
+
+	switch (RedisModule_KeyType(key)) {
+	case REDISMODULE_KEYTYPE_MODULE:
+		if (RedisModule_ModuleTypeGetType(key) != ZipString_Type)
+			break;
+		{
+			const struct zipstr *const zs =
+			    RedisModule_ModuleTypeGetValue(key);
+
+			len = range_clamp(start, end, zs->orig_len, &offset);
+			if (len == 0) {
+				RedisModule_CloseKey(key);
+				return RedisModule_ReplyWithStringBuffer(ctx,
+				    "", 0);
+			}
+
+			char *const buf = RedisModule_Alloc(len);
+			if (zipstr_read_range(&module, zs, offset, len,
+			    buf) != 0) {
+				RedisModule_ReplyWithError(ctx,
+				    "ERR decompression failed");
+			} else {
+				RedisModule_ReplyWithStringBuffer(ctx, buf,
+				    len);
+			}
+			RedisModule_Free(buf);
+			RedisModule_CloseKey(key);
+			return REDISMODULE_OK;
+		}
+	case REDISMODULE_KEYTYPE_EMPTY:
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithStringBuffer(ctx, "", 0);
+	case REDISMODULE_KEYTYPE_STRING:
+		{
+			size_t slen;
+			const char *const str = RedisModule_StringDMA(key,
+			    &slen, REDISMODULE_READ);
+
+			len = range_clamp(start, end, slen, &offset);
+			RedisModule_ReplyWithStringBuffer(ctx, str + offset,
+			    len);
+			RedisModule_CloseKey(key);
+			return REDISMODULE_OK;
+		}
+	default:
+		break;
+	}
+	RedisModule_CloseKey(key);
+
+	return RedisModule_ReplyWithError(ctx, "ERR bad type");
+}
+
+/*
+ * STRLEN key
+ */
+int StrlenCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc != 2)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, argv[1],
+	    REDISMODULE_READ);
+	long long len = -1;
+
+	switch (RedisModule_KeyType(key)) {
+	case REDISMODULE_KEYTYPE_MODULE:
+		if (RedisModule_ModuleTypeGetType(key) == ZipString_Type) {
+			const struct zipstr *const zs =
+			    RedisModule_ModuleTypeGetValue(key);
+			len = zs->orig_len;
+		}
+		break;
+	case REDISMODULE_KEYTYPE_EMPTY:
+		len = 0;
+		break;
+	case REDISMODULE_KEYTYPE_STRING:
+		len = RedisModule_ValueLength(key);
+		break;
+	default:
+		break;
+	}
+	RedisModule_CloseKey(key);
+
+	if (len < 0)
+		return RedisModule_ReplyWithError(ctx, "ERR bad type");
+
+	return RedisModule_ReplyWithLongLong(ctx, len);
+}
+
+/*
+ * Write data at offset into the value at key, creating it if needed, and
+ * reply with the new length. Compressed values stay compressed unless the
+ * result no longer compresses; plain strings are patched in place.
+ */
+int key_setrange(RedisModuleCtx *ctx, RedisModuleString *keyname,
+    size_t offset, const char *data, size_t len) {
+
+	if (offset + len > MAX_STRING_SIZE) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR string exceeds maximum allowed size (512MB)");
+	}
+
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, keyname,
+	    REDISMODULE_READ | REDISMODULE_WRITE);
+	size_t new_len = offset + len;
+
+	switch (RedisModule_KeyType(key)) {
+	case REDISMODULE_KEYTYPE_EMPTY:
+		if (len == 0) {
+			new_len = 0;
+			break;
+		}
+		{
+			size_t key_len;
+			const char *const keystr = RedisModule_StringPtrLen(
+			    keyname, &key_len);
+			char *const buf = RedisModule_Calloc(1, new_len);
+
+			(void) memcpy(buf + offset, data, len);
+			struct zipstr *const zs = zipstr_create(&module,
+			    keystr, key_len, buf, new_len);
+			if (zs != NULL) {
+				RedisModule_ModuleTypeSetValue(key,
+				    ZipString_Type, zs);
+				zipstr_replicate(ctx, keyname, zs, 0);
+			} else {
+				RedisModuleString *const str =
+				    RedisModule_CreateString(ctx, buf, new_len);
+				RedisModule_StringSet(key, str);
+				RedisModule_FreeString(ctx, str);
+				RedisModule_Replicate(ctx, "SETRANGE", "slb",
+				    keyname, (long long)offset, data, len);
+			}
+			RedisModule_Free(buf);
+		}
+		break;
+	case REDISMODULE_KEYTYPE_STRING:
+		{
+			const size_t old_len = RedisModule_ValueLength(key);
+
+			if (len == 0 || old_len > new_len)
+				new_len = old_len;
+			if (len == 0)
+				break;
+			if (new_len > old_len)
+				RedisModule_StringTruncate(key, new_len);
+
+			size_t dma_len;
+			char *const str = RedisModule_StringDMA(key, &dma_len,
+			    REDISMODULE_WRITE);
+			(void) memcpy(str + offset, data, len);
+			RedisModule_Replicate(ctx, "SETRANGE", "slb", keyname,
+			    (long long)offset, data, len);
+		}
+		break;
+	case REDISMODULE_KEYTYPE_MODULE:
+		if (RedisModule_ModuleTypeGetType(key) != ZipString_Type) {
+			RedisModule_CloseKey(key);
+			return RedisModule_ReplyWithError(ctx, "ERR bad type");
+		}
+		{
+			struct zipstr *const zs =
+			    RedisModule_ModuleTypeGetValue(key);
+			char *raw;
+
+			if (len == 0 || zs->orig_len > new_len)
+				new_len = zs->orig_len;
+			if (len == 0)
+				break;
+
+			struct zipstr *const nzs = zipstr_setrange(&module, zs,
+			    offset, data, len, &raw);
+			if (nzs != NULL) {
+				/* Keeps the TTL, unlike setting a new value */
+				zipstr_init(&module, nzs, zipstr_dict(nzs),
+				    nzs->len, nzs->orig_len);
+				RedisModule_ModuleTypeReplaceValue(key,
+				    ZipString_Type, nzs, NULL);
+				zipstr_free(zs);
+				zipstr_replicate(ctx, keyname, nzs, 1);
+			} else if (raw != NULL) {
+				const mstime_t expire =
+				    RedisModule_GetExpire(key);
+				RedisModuleString *const str =
+				    RedisModule_CreateString(ctx, raw, new_len);
+
+				RedisModule_StringSet(key, str);
+				if (expire != REDISMODULE_NO_EXPIRE)
+					RedisModule_SetExpire(key, expire);
+				RedisModule_Replicate(ctx, "SET", "ssc",
+				    keyname, str, "KEEPTTL");
+				RedisModule_FreeString(ctx, str);
+				RedisModule_Free(raw);
+			} else {
+				RedisModule_CloseKey(key);
+				return RedisModule_ReplyWithError(ctx,
+				    "ERR decompression failed");
+			}
+		}
+		break;
+	default:
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithError(ctx, "ERR bad type");
+	}
+	RedisModule_CloseKey(key);
+
+	return RedisModule_ReplyWithLongLong(ctx, new_len);
+}
+
+/*
+ * SETRANGE key offset value
+ */
+int setrange_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc != 4)
+		return RedisModule_WrongArity(ctx);
+
+	long long offset;
+	if (RedisModule_StringToLongLong(argv[2], &offset) != REDISMODULE_OK) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR value is not an integer or out of range");
+	}
+	if (offset < 0 || offset > MAX_STRING_SIZE) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR offset is out of range");
+	}
+
+	size_t len;
+	const char *const data = RedisModule_StringPtrLen(argv[3], &len);
+
+	return key_setrange(ctx, argv[1], offset, data, len);
+}
+
+/*
+ * Append data to the log at key, making one of the value it holds if
+ * needed, and reply with the new length. A new log is propagated as SETRAW,
+ * since making it depends on log-block-size and the dictionaries. Appends
+ * to a log are propagated as APPEND of the data: its blocks only depend on
+ * the block size it records, so replicas and the AOF end up with the same
+ * layout whatever their own settings.
+ */
+int key_append_log(RedisModuleCtx *ctx, RedisModuleString *keyname,
+    const char *data, size_t len) {
+
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, keyname,
+	    REDISMODULE_READ | REDISMODULE_WRITE);
+	struct zipstr *zs = NULL;
+	size_t old_len = 0;
+
+	switch (RedisModule_KeyType(key)) {
+	case REDISMODULE_KEYTYPE_MODULE:
+		if (RedisModule_ModuleTypeGetType(key) != ZipString_Type) {
+			RedisModule_CloseKey(key);
+			return RedisModule_ReplyWithError(ctx, "ERR bad type");
+		}
+		zs = RedisModule_ModuleTypeGetValue(key);
+		old_len = zs->orig_len;
+		break;
+	case REDISMODULE_KEYTYPE_STRING:
+		old_len = RedisModule_ValueLength(key);
+		break;
+	case REDISMODULE_KEYTYPE_EMPTY:
+		break;
+	default:
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithError(ctx, "ERR bad type");
+	}
+
+	if (old_len + len > MAX_STRING_SIZE) {
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR string exceeds maximum allowed size (512MB)");
+	}
+
+	struct chunk_index li;
+
+	if (zs != NULL && zipstr_log(zs, &li)) {
+		struct zipstr *const nzs = log_append(&module, zs, data, len);
+
+		if (nzs == NULL) {
+			RedisModule_CloseKey(key);
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR compression failed");
+		}
+		/* Keeps the TTL */
+		RedisModule_ModuleTypeReplaceValue(key, ZipString_Type, nzs,
+		    NULL);
+		RedisModule_CloseKey(key);
+		RedisModule_Replicate(ctx, MODPREFIX".append", "sb", keyname,
+		    data, len);
+		return RedisModule_ReplyWithLongLong(ctx, old_len + len);
+	}
+
+	size_t keylen;
+	const char *const keystr = RedisModule_StringPtrLen(keyname, &keylen);
+	char *const buf = RedisModule_Alloc(old_len + len);
+
+	/* Logs made of existing values use the key's current dictionary */
+	struct dict *const dict = dict_lookup(&module, NULL, keystr, keylen);
+
+	if (zs != NULL && zipstr_decompress(&module, zs, buf) != 0) {
+		RedisModule_Free(buf);
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR decompression failed");
+	}
+	if (zs == NULL && old_len > 0) {
+		size_t dma_len;
+		const char *const str = RedisModule_StringDMA(key, &dma_len,
+		    REDISMODULE_READ);
+
+		(void) memcpy(buf, str, old_len);
+	}
+	(void) memcpy(buf + old_len, data, len);
+	struct zipstr *const nzs = log_encode(&module, dict, buf,
+	    old_len + len, module.log_block_size);
+	RedisModule_Free(buf);
+
+	if (nzs == NULL) {
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR compression failed");
+	}
+
+	zipstr_init(&module, nzs, dict, nzs->len, nzs->orig_len);
+	if (zs != NULL) {
+		RedisModule_ModuleTypeReplaceValue(key, ZipString_Type, nzs,
+		    NULL);
+		zipstr_free(zs);
+	} else {
+		const mstime_t expire = RedisModule_GetExpire(key);
+
+		RedisModule_ModuleTypeSetValue(key, ZipString_Type, nzs);
+		if (expire != REDISMODULE_NO_EXPIRE)
+			RedisModule_SetExpire(key, expire);
+	}
+	RedisModule_CloseKey(key);
+	zipstr_replicate(ctx, keyname, nzs, 1);
+
+	return RedisModule_ReplyWithLongLong(ctx, old_len + len);
+}
+
+/*
+ * APPEND key value
+ *
+ * With log-block-size set, the value is stored as a log, and logs stay
+ * logs either way.
+ */
+int append_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc != 3)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, argv[1],
+	    REDISMODULE_READ);
+	size_t offset = 0;
+	int log = module.log_block_size > 0;
+
+	switch (RedisModule_KeyType(key)) {
+	case REDISMODULE_KEYTYPE_MODULE:
+		if (RedisModule_ModuleTypeGetType(key) == ZipString_Type) {
+			const struct zipstr *const zs =
+			    RedisModule_ModuleTypeGetValue(key);
+			struct chunk_index li;
+
+			offset = zs->orig_len;
+			log |= zipstr_log(zs, &li);
+		}
+		break;
+	case REDISMODULE_KEYTYPE_STRING:
+		offset = RedisModule_ValueLength(key);
+		break;
+	default:
+		break;
+	}
+	RedisModule_CloseKey(key);
+
+	size_t len;
+	const char *const data = RedisModule_StringPtrLen(argv[2], &len);
+
+	if (log && len > 0)
+		return key_append_log(ctx, argv[1], data, len);
+	return key_setrange(ctx, argv[1], offset, data, len);
+}
+
+/*
+ * SETRAW key dictid origlen payload [KEEPTTL]
+ *
+ * Store an already compressed value, as propagated to replicas and the AOF
+ * by the write commands. Dictionary ID 0 means no dictionary.
+ */
+int SetRawCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc != 5 && argc != 6)
+		return RedisModule_WrongArity(ctx);
+
+	int keepttl = 0;
+	if (argc == 6) {
+		const char *const opt = RedisModule_StringPtrLen(argv[5],
+		    NULL);
+
+		if (strcasecmp(opt, "keepttl") != 0)
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR syntax error");
+		keepttl = 1;
+	}
+
+	long long id, orig_len;
+	if (RedisModule_StringToLongLong(argv[2], &id) != REDISMODULE_OK ||
+	    RedisModule_StringToLongLong(argv[3], &orig_len) !=
+	    REDISMODULE_OK) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR value is not an integer or out of range");
+	}
+	if (orig_len < 0 || orig_len > MAX_STRING_SIZE) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR original length is out of range");
+	}
+
+	struct dict *dict = NULL;
+	if (id != 0 && (dict = dict_find(id)) == NULL) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR unknown dictionary");
+	}
+
+	size_t len;
+	const char *const payload = RedisModule_StringPtrLen(argv[4], &len);
+	struct zipstr *zs = zipstr_new(len);
+
+	(void) memcpy(zs->buf, payload, len);
+	zs->len = len;
+	zs->orig_len = orig_len;
+	if (zipstr_check(&module, zs, dict) != 0) {
+		RedisModule_Free(zs);
+		return RedisModule_ReplyWithError(ctx, "ERR invalid payload");
+	}
+	zs = zipstr_compact(zs);
+	zipstr_init(&module, zs, dict, zs->len, orig_len);
+
+	RedisModuleKey *const key = RedisModule_OpenKey(ctx, argv[1],
+	    REDISMODULE_WRITE);
+	const mstime_t expire = keepttl ? RedisModule_GetExpire(key) :
+	    REDISMODULE_NO_EXPIRE;
+
+	RedisModule_ModuleTypeSetValue(key, ZipString_Type, zs);
+	if (expire != REDISMODULE_NO_EXPIRE)
+		RedisModule_SetExpire(key, expire);
+	RedisModule_CloseKey(key);
+	RedisModule_ReplicateVerbatim(ctx);
+
+	return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/*
+ * Dictionary the fields of the hash are compressed with, or NULL.
+ */
+struct dict *ziphash_dict(const struct ziphash *zh) {
+	return dict_slot_get(zh->dict_slot);
+}
+
+/*
+ * Empty hash whose fields will be compressed with dict.
+ */
+struct ziphash *ziphash_new(struct dict *dict) {
+	struct ziphash *const zh = RedisModule_Calloc(1, sizeof (*zh));
+
+	zh->dict_slot = dict != NULL ? dict->slot : 0;
+	dict_hold(dict, NULL);
+	module.nhashes++;
+
+	return zh;
+}
+
+/*
+ * Add a field to the totals of the hash, its dictionary and the module, or
+ * remove it from them with n set to -1.
+ */
+void ziphash_account(struct ziphash *zh, int n, size_t field_len,
+    size_t orig_len, size_t len) {
+	struct dict *const dict = ziphash_dict(zh);
+
+	/* Unsigned arithmetic wraps, so adding -x subtracts x */
+	field_len *= n;
+	orig_len *= n;
+	len *= n;
+
+	zh->nfields += n;
+	zh->fields_len += field_len;
+	zh->orig_len += orig_len;
+	zh->len += len;
+	module.hash_fields += n;
+	module.hash_mem_uncompressed += orig_len;
+	module.hash_mem_compressed += len;
+	if (dict != NULL) {
+		dict->mem_uncompressed += orig_len;
+		dict->mem_compressed += len;
+	}
+}
+
+void packed_entry(const char *packed, size_t off, struct hash_entry *e) {
+	const char *const p = packed + off;
+
+	e->field_len = le32_read(p);
+	e->orig_len = le32_read(p + 4);
+	e->len = le32_read(p + 8);
+	e->field = p + HASH_ENTRY_HDR;
+	e->value = e->field + e->field_len;
+	e->off = off;
+	e->hv = NULL;
+}
+
+size_t packed_entry_size(const struct hash_entry *e) {
+	return HASH_ENTRY_HDR + e->field_len + e->len;
+}
+
+void hash_entry_set(struct hash_entry *e, const char *field,
+    size_t field_len, struct hash_value *hv) {
+	e->field = field;
+	e->field_len = field_len;
+	e->orig_len = hv->orig_len;
+	e->len = hv->len;
+	e->value = hv->buf;
+	e->hv = hv;
+}
+
+/*
+ * Iterate over the fields in no particular order. The field of an entry is
+ * only valid until the next one, but its value lasts until the hash
+ * changes.
+ */
+void hash_iter_start(struct hash_iter *it, const struct ziphash *zh) {
+	it->zh = zh;
+	it->off = 0;
+	it->iter = zh->fields != NULL ?
+	    RedisModule_DictIteratorStartC(zh->fields, "^", NULL, 0) : NULL;
+}
+
+int hash_iter_next(struct hash_iter *it, struct hash_entry *e) {
+	if (it->iter != NULL) {
+		size_t len;
+		void *data;
+		const char *const field = RedisModule_DictNextC(it->iter, &len,
+		    &data);
+
+		if (field == NULL)
+			return 0;
+		hash_entry_set(e, field, len, data);
+		return 1;
+	}
+
+	if (it->off >= it->zh->packed_len)
+		return 0;
+	packed_entry(it->zh->packed, it->off, e);
+	it->off += packed_entry_size(e);
+	return 1;
+}
+
+void hash_iter_stop(struct hash_iter *it) {
+	if (it->iter != NULL)
+		RedisModule_DictIteratorStop(it->iter);
+}
+
+/*
+ * Field n of the hash in iteration order, of which only the value is valid
+ * afterwards.
+ */
+void ziphash_nth(const struct ziphash *zh, size_t n, struct hash_entry *e) {
+	struct hash_iter it;
+
+	hash_iter_start(&it, zh);
+	while (hash_iter_next(&it, e) && n-- > 0)
+		;
+	hash_iter_stop(&it);
+	e->field = NULL;
+}
+
+/*
+ * Find a field. Returns 0 if the hash doesn't have it.
+ */
+int ziphash_find(const struct ziphash *zh, const char *field, size_t len,
+    struct hash_entry *e) {
+	if (zh->fields != NULL) {
+		struct hash_value *const hv = RedisModule_DictGetC(zh->fields,
+		    (void *)field, len, NULL);
+
+		if (hv == NULL)
+			return 0;
+		hash_entry_set(e, field, len, hv);
+		return 1;
+	}
+
+	for (size_t off = 0; off < zh->packed_len;
+	    off += packed_entry_size(e)) {
+		packed_entry(zh->packed, off, e);
+		if (e->field_len == len && memcmp(e->field, field, len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Remove a field found by ziphash_find().
+ */
+void ziphash_remove(struct ziphash *zh, const struct hash_entry *e) {
+	ziphash_account(zh, -1, e->field_len, e->orig_len, e->len);
+
+	if (zh->fields != NULL) {
+		(void) RedisModule_DictDelC(zh->fields, (void *)e->field,
+		    e->field_len, NULL);
+		RedisModule_Free(e->hv);
+		return;
+	}
+
+	const size_t size = packed_entry_size(e);
+
+	(void) memmove(zh->packed + e->off, zh->packed + e->off + size,
+	    zh->packed_len - e->off - size);
+	zh->packed_len -= size;
+	if (zh->packed_len == 0) {
+		RedisModule_Free(zh->packed);
+		zh->packed = NULL;
+	} else {
+		zh->packed = RedisModule_Realloc(zh->packed, zh->packed_len);
+	}
+}
+
+/*
+ * Move the entries of a packed hash to a dict.
+ */
+void ziphash_unpack(struct ziphash *zh) {
+	struct hash_entry e;
+
+	zh->fields = RedisModule_CreateDict(NULL);
+	for (size_t off = 0; off < zh->packed_len;
+	    off += packed_entry_size(&e)) {
+		packed_entry(zh->packed, off, &e);
+
+		struct hash_value *const hv = RedisModule_Alloc(sizeof (*hv) +
+		    e.len);
+
+		hv->orig_len = e.orig_len;
+		hv->len = e.len;
+		(void) memcpy(hv->buf, e.value, e.len);
+		(void) RedisModule_DictSetC(zh->fields, (void *)e.field,
+		    e.field_len, hv);
+	}
+	RedisModule_Free(zh->packed);
+	zh->packed = NULL;
+	zh->packed_len = 0;
+}
+
+/*
+ * Set a field to hv, taking ownership of it. Returns 1 if the field is new.
+ */
+int ziphash_insert(struct ziphash *zh, const char *field, size_t field_len,
+    struct hash_value *hv) {
+	const size_t orig_len = hv->orig_len;
+	const size_t len = hv->len;
+	struct hash_entry e;
+	const int found = ziphash_find(zh, field, field_len, &e);
+
+	if (found)
+		ziphash_remove(zh, &e);
+
+	if (zh->fields == NULL &&
+	    (zh->nfields >= (size_t)module.hash_max_packed_entries ||
+	    len > (size_t)module.hash_max_packed_value))
+		ziphash_unpack(zh);
+
+	if (zh->fields != NULL) {
+		(void) RedisModule_DictSetC(zh->fields, (void *)field,
+		    field_len, hv);
+	} else {
+		char *p;
+
+		zh->packed = RedisModule_Realloc(zh->packed, zh->packed_len +
+		    HASH_ENTRY_HDR + field_len + len);
+		p = zh->packed + zh->packed_len;
+		le32_write(p, field_len);
+		le32_write(p + 4, orig_len);
+		le32_write(p + 8, len);
+		(void) memcpy(p + HASH_ENTRY_HDR, field, field_len);
+		(void) memcpy(p + HASH_ENTRY_HDR + field_len, hv->buf, len);
+		zh->packed_len += HASH_ENTRY_HDR + field_len + len;
+		RedisModule_Free(hv);
+	}
+	ziphash_account(zh, 1, field_len, orig_len, len);
+
+	return !found;
+}
+
+void ziphash_release(void *value) {
+	struct ziphash *const zh = value;
+	struct dict *const dict = ziphash_dict(zh);
+
+	if (zh->fields != NULL) {
+		struct hash_iter it;
+		struct hash_entry e;
+
+		hash_iter_start(&it, zh);
+		while (hash_iter_next(&it, &e))
+			RedisModule_Free(e.hv);
+		hash_iter_stop(&it);
+		RedisModule_FreeDict(NULL, zh->fields);
+	}
+	RedisModule_Free(zh->packed);
+
+	module.hash_fields -= zh->nfields;
+	module.hash_mem_uncompressed -= zh->orig_len;
+	module.hash_mem_compressed -= zh->len;
+	module.nhashes--;
+	if (dict != NULL) {
+		dict->mem_uncompressed -= zh->orig_len;
+		dict->mem_compressed -= zh->len;
+	}
+	dict_rele(&module, dict, NULL);
+
+	RedisModule_Free(zh);
+}
+
+void ziphash_free(void *value) {
+	release_on_main(value, ziphash_release);
+}
+
+/*
+ * Memory of the hash, roughly for hashes that aren't packed, and an even
+ * share of its dictionary.
+ */
+size_t ziphash_mem_usage(const void *value) {
+	const struct ziphash *const zh = value;
+	size_t mem = sizeof (*zh);
+
+	if (zh->fields != NULL) {
+		mem += zh->nfields * (sizeof (struct hash_value) +
+		    2 * sizeof (void *)) + zh->fields_len + zh->len;
+	} else {
+		mem += zh->packed_len;
+	}
+
+	const struct dict *const dict = ziphash_dict(zh);
+	if (dict != NULL)
+		mem += dict_mem(dict) / dict->refcnt;
+
+	return mem;
+}
+
+size_t ziphash_free_effort(RedisModuleString *key, const void *value) {
+	REDISMODULE_NOT_USED(key);
+
+	const struct ziphash *const zh = value;
+
+	return zh->fields != NULL ? zh->nfields : 1;
+}
+
+/*
+ * Move the hash and its packed entries. The values of larger hashes stay
+ * where they are.
+ */
+int ziphash_defrag(RedisModuleDefragCtx *ctx, RedisModuleString *key,
+    void **value) {
+	REDISMODULE_NOT_USED(key);
+
+	struct ziphash *zh = *value;
+	struct ziphash *const nzh = RedisModule_DefragAlloc(ctx, zh);
+
+	if (nzh != NULL)
+		*value = zh = nzh;
+	if (zh->packed != NULL) {
+		char *const packed = RedisModule_DefragAlloc(ctx, zh->packed);
+
+		if (packed != NULL)
+			zh->packed = packed;
+	}
+
+	return 0;
+}
+
+/*
+ * Compress a field value with dict, or keep it as is if it's skipped or
+ * doesn't shrink.
+ */
+struct hash_value *hash_value_encode(struct compress_module *module,
+    struct dict *dict, const char *data, size_t len) {
+
+	struct hash_value *hv = RedisModule_Alloc(sizeof (*hv) + len);
+	size_t clen = 0;
+
+	hv->orig_len = len;
+	if (len > 1 && compress_skip(module, data, len) == SKIP_NONE) {
+		const ZSTD_CDict *const cdict = dict != NULL ?
+		    dict_cdict(dict) : NULL;
+
+		if (dict == NULL || cdict != NULL) {
+			struct level_tuner *const tuner = dict != NULL ?
+			    &dict->tuner : &module->tuner;
+			const int measure = module->autotune || module->stats;
+			const uint64_t start = measure ? monotonic_ns() : 0;
+
+			/* One byte short, so that len == orig_len is as is */
+			clen = frame_compress_compact(module->cctx,
+			    tune_levels[tuner->step], cdict, hv->buf, len - 1,
+			    data, len);
+			if (measure) {
+				const uint64_t ns = monotonic_ns() - start;
+				const size_t out = ZSTD_isError(clen) ? len :
+				    clen;
+
+				if (module->stats) {
+					codec_record_compress(module, dict, ns,
+					    len, out);
+				}
+				if (module->autotune) {
+					tuner_record(module, tuner, dict, ns,
+					    len, out);
+				}
+			}
+		}
+	}
+
+	if (clen == 0 || ZSTD_isError(clen)) {
+		(void) memcpy(hv->buf, data, len);
+		hv->len = len;
+		return hv;
+	}
+	hv->len = clen;
+
+	return RedisModule_Realloc(hv, sizeof (*hv) + clen);
+}
+
+/*
+ * Value of a field, decompressed into *buf if needed. The buffer is grown
+ * as needed so it can be reused across fields; the caller frees it.
+ * Returns NULL on decompression errors.
+ */
+const char *hash_value_read(struct compress_module *module,
+    struct dict *dict, const struct hash_entry *e, char **buf,
+    size_t *buflen) {
+
+	if (e->len == e->orig_len)
+		return e->value;
+
+	if (*buflen < e->orig_len) {
+		RedisModule_Free(*buf);
+		*buf = RedisModule_Alloc(e->orig_len);
+		*buflen = e->orig_len;
+	}
+	if (dctx_use_dict(module, dict, ZSTD_f_zstd1_magicless) != 0)
+		return NULL;
+
+	const uint64_t start = module->stats ? monotonic_ns() : 0;
+	const size_t len = ZSTD_decompressDCtx(module->dctx, *buf,
+	    e->orig_len, e->value, e->len);
+	if (ZSTD_isError(len) || len != e->orig_len)
+		return NULL;
+	if (module->stats) {
+		codec_record_decompress(module, dict, monotonic_ns() - start,
+		    len);
+	}
+
+	return *buf;
+}
+
+/*
+ * Check a field value as stored, from COMPRESS.HSETRAW: the value itself if
+ * it has orig_len bytes, otherwise one shorter zstd frame without its magic
+ * number, compressed with dict.
+ */
+int hash_value_check(struct compress_module *module, struct dict *dict,
+    const char *buf, size_t len, size_t orig_len) {
+	if (len == orig_len)
+		return 0;
+	if (len > orig_len)
+		return -1;
+
+	char *const frame = RedisModule_Alloc(len + 4);
+
+	le32_write(frame, ZSTD_MAGICNUMBER);
+	(void) memcpy(frame + 4, buf, len);
+
+	const unsigned long long size = ZSTD_getFrameContentSize(frame,
+	    len + 4);
+	int ok = ZSTD_findFrameCompressedSize(frame, len + 4) == len + 4 &&
+	    frame_dict_matches(frame, len + 4, dict);
+
+	if (ok && size == ZSTD_CONTENTSIZE_UNKNOWN) {
+		ok = frame_check_size(module, dict, frame, len + 4,
+		    orig_len) == 0;
+	} else if (ok) {
+		ok = size == orig_len;
+	}
+
+	RedisModule_Free(frame);
+	return ok ? 0 : -1;
+}
+
+int hash_value_reply(RedisModuleCtx *ctx, const struct ziphash *zh,
+    const struct hash_entry *e, char **buf, size_t *buflen) {
+	const char *const value = hash_value_read(&module, ziphash_dict(zh),
+	    e, buf, buflen);
+
+	if (value == NULL) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR decompression failed");
+	}
+	return RedisModule_ReplyWithStringBuffer(ctx, value, e->orig_len);
+}
+
+/*
+ * Fields are saved with their value as stored, so loading doesn't compress
+ * them again.
+ */
+void ziphash_rdb_save(RedisModuleIO *rdb, void *value) {
+	const struct ziphash *const zh = value;
+	struct hash_iter it;
+	struct hash_entry e;
+
+	RedisModule_SaveUnsigned(rdb, dict_save_ref(ziphash_dict(zh)));
+	RedisModule_SaveUnsigned(rdb, zh->nfields);
+
+	hash_iter_start(&it, zh);
+	while (hash_iter_next(&it, &e)) {
+		RedisModule_SaveStringBuffer(rdb, e.field, e.field_len);
+		RedisModule_SaveUnsigned(rdb, e.orig_len);
+		RedisModule_SaveStringBuffer(rdb, e.value, e.len);
+	}
+	hash_iter_stop(&it);
+}
+
+void *ziphash_rdb_load(RedisModuleIO *rdb, int encver) {
+	if (encver > ZIPHASH_ENCODING_VERSION) {
+		RedisModule_Log(NULL, "notice", "Unknown version (%d)", encver);
+		return NULL;
+	}
+
+	struct dict *dict;
+	if (dict_load_ref(RedisModule_LoadUnsigned(rdb), &dict) != 0)
+		return NULL;
+
+	struct ziphash *const zh = ziphash_new(dict);
+	const uint64_t nfields = RedisModule_LoadUnsigned(rdb);
+
+	for (uint64_t i = 0; i < nfields; i++) {
+		size_t field_len, len;
+		char *const field = RedisModule_LoadStringBuffer(rdb,
+		    &field_len);
+		const uint64_t orig_len = RedisModule_LoadUnsigned(rdb);
+		char *const buf = RedisModule_LoadStringBuffer(rdb, &len);
+
+		if (len > orig_len || orig_len > MAX_STRING_SIZE) {
+			RedisModule_Log(NULL, "warning", "Bad hash field");
+			RedisModule_Free(field);
+			RedisModule_Free(buf);
+			ziphash_release(zh);
+			return NULL;
+		}
+
+		struct hash_value *const hv = RedisModule_Alloc(sizeof (*hv) +
+		    len);
+
+		hv->orig_len = orig_len;
+		hv->len = len;
+		(void) memcpy(hv->buf, buf, len);
+		(void) ziphash_insert(zh, field, field_len, hv);
+		RedisModule_Free(field);
+		RedisModule_Free(buf);
+	}
+
+	return zh;
+}
+
+/*
+ * Rewrite the hash as COMPRESS.HSETRAW of each field with its value as
+ * stored, preceded by the dictionary it uses.
+ */
+void ziphash_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+    void *value) {
+	const struct ziphash *const zh = value;
+	struct dict *const dict = ziphash_dict(zh);
+	const long long id = dict != NULL ? dict->id : 0;
+	struct hash_iter it;
+	struct hash_entry e;
+
+	dicts_emit_aof(aof, dict);
+
+	hash_iter_start(&it, zh);
+	while (hash_iter_next(&it, &e)) {
+		RedisModule_EmitAOF(aof, MODPREFIX".hsetraw", "slblb", key,
+		    id, e.field, e.field_len, (long long)e.orig_len, e.value,
+		    (size_t)e.len);
+	}
+	hash_iter_stop(&it);
+}
+
+/*
+ * Open key as a compressed hash. Returns NULL with *type set to its type if
+ * it holds something else. The key is left open for plain hashes, which
+ * the plain_h* functions then handle and close, and closed otherwise.
+ */
+struct ziphash *ziphash_open(RedisModuleCtx *ctx, RedisModuleString *keyname,
+    int mode, RedisModuleKey **key, int *type) {
+
+	*key = RedisModule_OpenKey(ctx, keyname, mode);
+	*type = RedisModule_KeyType(*key);
+	if (*type == REDISMODULE_KEYTYPE_MODULE &&
+	    RedisModule_ModuleTypeGetType(*key) == ZipHash_Type)
+		return RedisModule_ModuleTypeGetValue(*key);
+	if (*type == REDISMODULE_KEYTYPE_HASH)
+		return NULL;
+
+	RedisModule_CloseKey(*key);
+	*key = NULL;
+	return NULL;
+}
+
+/*
+ * Plain Redis hashes are left as they are, and handled in place with the
+ * hash API of modules. Writes are propagated as the Redis command, like
+ * strings stored uncompressed.
+ */
+int plain_hset(RedisModuleCtx *ctx, RedisModuleKey *key,
+    RedisModuleString **argv, int argc) {
+	long long added = 0;
+
+	for (int i = 2; i < argc; i += 2) {
+		/* Counts the fields that existed, which are updated */
+		added += RedisModule_HashSet(key, REDISMODULE_HASH_NONE,
+		    argv[i], argv[i + 1], NULL) == 0;
+	}
+	RedisModule_CloseKey(key);
+	RedisModule_Replicate(ctx, "HSET", "v", argv + 1, (size_t)(argc - 1));
+
+	return RedisModule_ReplyWithLongLong(ctx, added);
+}
+
+/*
+ * Reply with the value of field, or nil if it doesn't exist.
+ */
+void plain_hget_reply(RedisModuleCtx *ctx, RedisModuleKey *key,
+    RedisModuleString *field) {
+	RedisModuleString *value = NULL;
+
+	(void) RedisModule_HashGet(key, REDISMODULE_HASH_NONE, field, &value,
+	    NULL);
+	if (value == NULL) {
+		RedisModule_ReplyWithNull(ctx);
+		return;
+	}
+	RedisModule_ReplyWithString(ctx, value);
+	RedisModule_FreeString(ctx, value);
+}
+
+struct plain_hgetall {
+	RedisModuleCtx *ctx;
+	long len;
+};
+
+void plain_hgetall_cb(RedisModuleKey *key, RedisModuleString *field,
+    RedisModuleString *value, void *privdata) {
+	REDISMODULE_NOT_USED(key);
+
+	struct plain_hgetall *const r = privdata;
+
+	RedisModule_ReplyWithString(r->ctx, field);
+	RedisModule_ReplyWithString(r->ctx, value);
+	r->len += 2;
+}
+
+int plain_hgetall(RedisModuleCtx *ctx, RedisModuleKey *key) {
+	RedisModuleScanCursor *const cursor = RedisModule_ScanCursorCreate();
+	struct plain_hgetall r = { ctx, 0 };
+
+	RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+	while (RedisModule_ScanKey(key, cursor, plain_hgetall_cb, &r))
+		;
+	RedisModule_ReplySetArrayLength(ctx, r.len);
+	RedisModule_ScanCursorDestroy(cursor);
+	RedisModule_CloseKey(key);
+
+	return REDISMODULE_OK;
+}
+
+int plain_hdel(RedisModuleCtx *ctx, RedisModuleKey *key,
+    RedisModuleString **argv, int argc) {
+	long long deleted = 0;
+
+	/* The key goes with its last field */
+	for (int i = 2; i < argc; i++) {
+		deleted += RedisModule_HashSet(key, REDISMODULE_HASH_NONE,
+		    argv[i], REDISMODULE_HASH_DELETE, NULL);
+	}
+	RedisModule_CloseKey(key);
+	if (deleted > 0) {
+		RedisModule_Replicate(ctx, "HDEL", "v", argv + 1,
+		    (size_t)(argc - 1));
+	}
+
+	return RedisModule_ReplyWithLongLong(ctx, deleted);
+}
+
+/*
+ * HSET key field value [field value ...]
+ */
+int hset_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc < 4 || (argc % 2) != 0)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *key;
+	int type;
+	struct ziphash *zh = ziphash_open(ctx, argv[1],
+	    REDISMODULE_READ | REDISMODULE_WRITE, &key, &type);
+
+	if (zh == NULL) {
+		switch (type) {
+		case REDISMODULE_KEYTYPE_EMPTY:
+			break;
+		case REDISMODULE_KEYTYPE_HASH:
+			return plain_hset(ctx, key, argv, argc);
+		default:
+			return RedisModule_ReplyWithError(ctx, "ERR bad type");
+		}
+
+		size_t keylen;
+		const char *const keystr = RedisModule_StringPtrLen(argv[1],
+		    &keylen);
+
+		key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_WRITE);
+		zh = ziphash_new(dict_lookup(&module, NULL, keystr, keylen));
+		RedisModule_ModuleTypeSetValue(key, ZipHash_Type, zh);
+	}
+
+	struct dict *const dict = ziphash_dict(zh);
+	long long added = 0;
+
+	/* Field, original length and value as stored, for HSETRAW */
+	const int nraw = (argc - 2) / 2 * 3;
+	RedisModuleString **const raw = RedisModule_Alloc(nraw *
+	    sizeof (*raw));
+
+	for (int i = 2, j = 0; i < argc; i += 2, j += 3) {
+		size_t field_len, len;
+		const char *const field = RedisModule_StringPtrLen(argv[i],
+		    &field_len);
+		const char *const value = RedisModule_StringPtrLen(argv[i + 1],
+		    &len);
+		struct hash_value *const hv = hash_value_encode(&module, dict,
+		    value, len);
+
+		raw[j] = argv[i];
+		raw[j + 1] = RedisModule_CreateStringFromLongLong(ctx,
+		    hv->orig_len);
+		raw[j + 2] = RedisModule_CreateString(ctx, hv->buf, hv->len);
+		added += ziphash_insert(zh, field, field_len, hv);
+	}
+	RedisModule_CloseKey(key);
+
+	RedisModule_Replicate(ctx, MODPREFIX".hsetraw", "slv", argv[1],
+	    dict != NULL ? dict->id : 0, raw, (size_t)nraw);
+	for (int j = 0; j < nraw; j += 3) {
+		RedisModule_FreeString(ctx, raw[j + 1]);
+		RedisModule_FreeString(ctx, raw[j + 2]);
+	}
+	RedisModule_Free(raw);
+
+	return RedisModule_ReplyWithLongLong(ctx, added);
+}
+
+/*
+ * HSETRAW key dictid field origlen payload [field origlen payload ...]
+ */
+int HSetRawCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+    int argc) {
+	if (argc < 6 || (argc % 3) != 0)
+		return RedisModule_WrongArity(ctx);
+
+	long long id;
+	if (RedisModule_StringToLongLong(argv[2], &id) != REDISMODULE_OK) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR value is not an integer or out of range");
+	}
+
+	struct dict *dict = NULL;
+	if (id != 0 && (dict = dict_find(id)) == NULL) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR unknown dictionary");
+	}
+
+	/* Check every field before changing the hash */
+	for (int i = 3; i < argc; i += 3) {
+		long long orig_len;
+		size_t len;
+		const char *const payload = RedisModule_StringPtrLen(
+		    argv[i + 2], &len);
+
+		if (RedisModule_StringToLongLong(argv[i + 1], &orig_len) !=
+		    REDISMODULE_OK) {
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR value is not an integer or out of range");
+		}
+		if (orig_len < 0 || orig_len > MAX_STRING_SIZE) {
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR original length is out of range");
+		}
+		if (hash_value_check(&module, dict, payload, len,
+		    orig_len) != 0) {
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR invalid payload");
+		}
+	}
+
+	RedisModuleKey *key;
+	int type;
+	struct ziphash *zh = ziphash_open(ctx, argv[1],
+	    REDISMODULE_READ | REDISMODULE_WRITE, &key, &type);
+
+	if (zh == NULL) {
+		if (key != NULL)
+			RedisModule_CloseKey(key);
+		if (type != REDISMODULE_KEYTYPE_EMPTY)
+			return RedisModule_ReplyWithError(ctx, "ERR bad type");
+
+		key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_WRITE);
+		zh = ziphash_new(dict);
+		RedisModule_ModuleTypeSetValue(key, ZipHash_Type, zh);
+	} else if (ziphash_dict(zh) != dict) {
+		RedisModule_CloseKey(key);
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR the hash uses another dictionary");
+	}
+
+	long long added = 0;
+
+	for (int i = 3; i < argc; i += 3) {
+		size_t field_len, len;
+		const char *const field = RedisModule_StringPtrLen(argv[i],
+		    &field_len);
+		const char *const payload = RedisModule_StringPtrLen(
+		    argv[i + 2], &len);
+		long long orig_len;
+		struct hash_value *const hv = RedisModule_Alloc(sizeof (*hv) +
+		    len);
+
+		(void) RedisModule_StringToLongLong(argv[i + 1], &orig_len);
+		hv->orig_len = orig_len;
+		hv->len = len;
+		(void) memcpy(hv->buf, payload, len);
+		added += ziphash_insert(zh, field, field_len, hv);
+	}
+	RedisModule_CloseKey(key);
+	RedisModule_ReplicateVerbatim(ctx);
+
+	return RedisModule_ReplyWithLongLong(ctx, added);
+}
+
+/*
+ * HGET key field
+ */
+int hget_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc != 3)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *key;
+	int type;
+	const struct ziphash *const zh = ziphash_open(ctx, argv[1],
+	    REDISMODULE_READ, &key, &type);
+
+	if (zh == NULL) {
+		switch (type) {
+		case REDISMODULE_KEYTYPE_EMPTY:
+			return RedisModule_ReplyWithNull(ctx);
+		case REDISMODULE_KEYTYPE_HASH:
+			plain_hget_reply(ctx, key, argv[2]);
+			RedisModule_CloseKey(key);
+			return REDISMODULE_OK;
+		default:
+			return RedisModule_ReplyWithError(ctx, "ERR bad type");
+		}
+	}
+
+	size_t len;
+	const char *const field = RedisModule_StringPtrLen(argv[2], &len);
+	struct hash_entry e;
+
+	if (!ziphash_find(zh, field, len, &e)) {
+		RedisModule_ReplyWithNull(ctx);
+	} else {
+		char *buf = NULL;
+		size_t buflen = 0;
+
+		hash_value_reply(ctx, zh, &e, &buf, &buflen);
+		RedisModule_Free(buf);
+	}
+	RedisModule_CloseKey(key);
+
+	return REDISMODULE_OK;
+}
+
+/*
+ * HMGET key field [field ...]
+ */
+int hmget_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc < 3)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *key;
+	int type;
+	const struct ziphash *const zh = ziphash_open(ctx, argv[1],
+	    REDISMODULE_READ, &key, &type);
+
+	if (zh == NULL && type != REDISMODULE_KEYTYPE_EMPTY &&
+	    type != REDISMODULE_KEYTYPE_HASH)
+		return RedisModule_ReplyWithError(ctx, "ERR bad type");
+
+	/* Shared by all fields; grown to the largest value */
+	char *buf = NULL;
+	size_t buflen = 0;
+
+	RedisModule_ReplyWithArray(ctx, argc - 2);
+	for (int i = 2; i < argc; i++) {
+		size_t len;
+		const char *const field = RedisModule_StringPtrLen(argv[i],
+		    &len);
+		struct hash_entry e;
+
+		if (key != NULL && zh == NULL)
+			plain_hget_reply(ctx, key, argv[i]);
+		else if (zh == NULL || !ziphash_find(zh, field, len, &e))
+			RedisModule_ReplyWithNull(ctx);
+		else
+			hash_value_reply(ctx, zh, &e, &buf, &buflen);
+	}
+	RedisModule_Free(buf);
+	if (key != NULL)
+		RedisModule_CloseKey(key);
+
+	return REDISMODULE_OK;
+}
+
+/*
+ * HGETALL key
+ */
+int hgetall_command(RedisModuleCtx *ctx, RedisModuleString **argv,
+    int argc) {
+	if (argc != 2)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *key;
+	int type;
+	const struct ziphash *const zh = ziphash_open(ctx, argv[1],
+	    REDISMODULE_READ, &key, &type);
+
+	if (zh == NULL) {
+		switch (type) {
+		case REDISMODULE_KEYTYPE_EMPTY:
+			return RedisModule_ReplyWithArray(ctx, 0);
+		case REDISMODULE_KEYTYPE_HASH:
+			return plain_hgetall(ctx, key);
+		default:
+			return RedisModule_ReplyWithError(ctx, "ERR bad type");
+		}
+	}
+
+	struct hash_iter it;
+	struct hash_entry e;
+	char *buf = NULL;
+	size_t buflen = 0;
+
+	RedisModule_ReplyWithArray(ctx, zh->nfields * 2);
+	hash_iter_start(&it, zh);
+	while (hash_iter_next(&it, &e)) {
+		RedisModule_ReplyWithStringBuffer(ctx, e.field, e.field_len);
+		hash_value_reply(ctx, zh, &e, &buf, &buflen);
+	}
+	hash_iter_stop(&it);
+	RedisModule_Free(buf);
+	RedisModule_CloseKey(key);
+
+	return REDISMODULE_OK;
+}
+
+/*
+ * HDEL key field [field ...]
+ */
+int hdel_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc < 3)
+		return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *key;
+	int type;
+	struct ziphash *const zh = ziphash_open(ctx, argv[1],
+	    REDISMODULE_READ | REDISMODULE_WRITE, &key, &type);
+
+	if (zh == NULL) {
+		switch (type) {
+		case REDISMODULE_KEYTYPE_EMPTY:
+			return RedisModule_ReplyWithLongLong(ctx, 0);
+		case REDISMODULE_KEYTYPE_HASH:
+			return plain_hdel(ctx, key, argv, argc);
+		default:
+			return RedisModule_ReplyWithError(ctx, "ERR bad type");
+		}
+	}
+
+	RedisModuleString **const removed = RedisModule_Alloc((argc - 2) *
+	    sizeof (*removed));
+	long long deleted = 0;
+
+	for (int i = 2; i < argc; i++) {
+		size_t len;
+		const char *const field = RedisModule_StringPtrLen(argv[i],
+		    &len);
+		struct hash_entry e;
+
+		if (ziphash_find(zh, field, len, &e)) {
+			ziphash_remove(zh, &e);
+			removed[deleted++] = argv[i];
+		}
+	}
+	if (zh->nfields == 0)
+		RedisModule_DeleteKey(key);
+	RedisModule_CloseKey(key);
+	if (deleted > 0) {
+		/* Only the fields removed; the key goes with the last one */
+		RedisModule_Replicate(ctx, MODPREFIX".hdel", "sv", argv[1],
+		    removed, (size_t)deleted);
+	}
+	RedisModule_Free(removed);
+
+	return RedisModule_ReplyWithLongLong(ctx, deleted);
+}
+
+/*
+ * Run a command handler, recording its latency if stats are enabled. For
+ * values handed to the worker pool, only the time until the client is
+ * blocked is counted.
+ */
+int timed_command(enum stat_cmd cmd, RedisModuleCmdFunc fn,
+    RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (!module.stats)
+		return fn(ctx, argv, argc);
+
+	const uint64_t start = monotonic_ns();
+	const int ret = fn(ctx, argv, argc);
+
+	hist_record(&module.latency[cmd], monotonic_ns() - start);
+	return ret;
+}
+
+int SetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_SET, set_command, ctx, argv, argc);
+}
+
+int GetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_GET, get_command, ctx, argv, argc);
+}
+
+int GetDelCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_GETDEL, getdel_command, ctx, argv, argc);
+}
+
+int MSetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_MSET, mset_command, ctx, argv, argc);
+}
+
+int MGetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_MGET, mget_command, ctx, argv, argc);
+}
+
+int GetRangeCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_GETRANGE, getrange_command, ctx, argv, argc);
+}
+
+int SetRangeCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_SETRANGE, setrange_command, ctx, argv, argc);
+}
+
+int AppendCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_APPEND, append_command, ctx, argv, argc);
+}
+
+int HSetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_HSET, hset_command, ctx, argv, argc);
+}
+
+int HGetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_HGET, hget_command, ctx, argv, argc);
+}
+
+int HMGetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_HMGET, hmget_command, ctx, argv, argc);
+}
+
+int HGetAllCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_HGETALL, hgetall_command, ctx, argv, argc);
+}
+
+int HDelCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	return timed_command(STAT_HDEL, hdel_command, ctx, argv, argc);
+}
+
+/*
+ * SETEX key seconds value to COMPRESS.SET key value EX seconds, and the
+ * same with PX for PSETEX.
+ */
+void filter_setex(RedisModuleCommandFilterCtx *fctx, const char *unit) {
+	if (RedisModule_CommandFilterArgsCount(fctx) != 4)
+		return;
+
+	RedisModuleString *const ttl = (RedisModuleString *)
+	    RedisModule_CommandFilterArgGet(fctx, 2);
+	RedisModuleString *const val = (RedisModuleString *)
+	    RedisModule_CommandFilterArgGet(fctx, 3);
+
+	/* Replacing an argument releases it */
+	RedisModule_RetainString(NULL, ttl);
+	RedisModule_RetainString(NULL, val);
+	RedisModule_CommandFilterArgReplace(fctx, 2, val);
+	RedisModule_CommandFilterArgReplace(fctx, 3,
+	    RedisModule_CreateString(NULL, unit, 2));
+	RedisModule_CommandFilterArgInsert(fctx, 4, ttl);
+}
+
+void filter_setex_ex(RedisModuleCommandFilterCtx *fctx) {
+	filter_setex(fctx, "EX");
+}
+
+void filter_setex_px(RedisModuleCommandFilterCtx *fctx) {
+	filter_setex(fctx, "PX");
+}
+
+/*
+ * GETSET key value to COMPRESS.SET key value GET.
+ */
+void filter_getset(RedisModuleCommandFilterCtx *fctx) {
+	if (RedisModule_CommandFilterArgsCount(fctx) != 3)
+		return;
+
+	RedisModule_CommandFilterArgInsert(fctx, 3,
+	    RedisModule_CreateString(NULL, "GET", 3));
+}
+
+/*
+ * Commands rewritten in transparent mode. Arguments are rewritten too where
+ * the module command takes them in another form. Hash commands are only
+ * rewritten with transparent-hash set.
+ */
+struct filter_cmd {
+	const char *name;
+	size_t len;
+	const char *target;
+	void (*rewrite)(RedisModuleCommandFilterCtx *fctx);
+	int hash;
+	RedisModuleString *str;		/* target, created on load */
+};
+
+static struct filter_cmd filter_cmds[] = {
+	{ "get", 3, MODPREFIX".get", NULL, 0, NULL },
+	{ "set", 3, MODPREFIX".set", NULL, 0, NULL },
+	{ "mget", 4, MODPREFIX".mget", NULL, 0, NULL },
+	{ "mset", 4, MODPREFIX".mset", NULL, 0, NULL },
+	{ "setex", 5, MODPREFIX".set", filter_setex_ex, 0, NULL },
+	{ "psetex", 6, MODPREFIX".set", filter_setex_px, 0, NULL },
+	{ "getset", 6, MODPREFIX".set", filter_getset, 0, NULL },
+	{ "getdel", 6, MODPREFIX".getdel", NULL, 0, NULL },
+	{ "strlen", 6, MODPREFIX".strlen", NULL, 0, NULL },
+	{ "append", 6, MODPREFIX".append", NULL, 0, NULL },
+	{ "getrange", 8, MODPREFIX".getrange", NULL, 0, NULL },
+	{ "setrange", 8, MODPREFIX".setrange", NULL, 0, NULL },
+	{ "hset", 4, MODPREFIX".hset", NULL, 1, NULL },
+	{ "hget", 4, MODPREFIX".hget", NULL, 1, NULL },
+	{ "hmget", 5, MODPREFIX".hmget", NULL, 1, NULL },
+	{ "hgetall", 7, MODPREFIX".hgetall", NULL, 1, NULL },
+	{ "hdel", 4, MODPREFIX".hdel", NULL, 1, NULL },
+};
+
+/*
+ * Lengths of the names in filter_cmds, and a hash of the length and three
+ * letters that has no collisions between them. Other commands are mostly
+ * rejected by their length, and otherwise by one comparison.
+ */
+#define	FILTER_LENS	((1 << 3) | (1 << 4) | (1 << 5) | (1 << 6) | \
+			    (1 << 7) | (1 << 8))
+#define	FILTER_MAX_LEN	8
+#define	FILTER_TABLE_SIZE	32
+
+static struct filter_cmd *filter_table[FILTER_TABLE_SIZE];
+
+unsigned filter_hash(const char *name, size_t len) {
+	const unsigned c0 = (unsigned char)name[0] | 0x20;
+	const unsigned c1 = (unsigned char)name[1] | 0x20;
+	const unsigned cl = (unsigned char)name[len - 1] | 0x20;
+
+	return (c0 * 2 + c1 * 10 + cl + len) & (FILTER_TABLE_SIZE - 1);
+}
+
+/*
+ * Fill the hash table. Fails if two commands collide.
+ */
+int filter_table_init(RedisModuleCtx *ctx) {
+	const size_t n = sizeof (filter_cmds) / sizeof (filter_cmds[0]);
+
+	(void) memset(filter_table, 0, sizeof (filter_table));
+	for (size_t i = 0; i < n; i++) {
+		struct filter_cmd *const fc = &filter_cmds[i];
+		const unsigned h = filter_hash(fc->name, fc->len);
+
+		if (filter_table[h] != NULL)
+			return -1;
+		filter_table[h] = fc;
+		fc->str = RedisModule_CreateString(ctx, fc->target,
+		    strlen(fc->target));
+	}
+	return 0;
+}
+
+void transparent_filter(RedisModuleCommandFilterCtx *fctx) {
+	size_t len;
+	const char *const name = RedisModule_StringPtrLen(
+	    RedisModule_CommandFilterArgGet(fctx, 0), &len);
+
+	if (len > FILTER_MAX_LEN || ((FILTER_LENS >> len) & 1) == 0)
+		return;
+
+	struct filter_cmd *const fc = filter_table[filter_hash(name, len)];
+	if (fc == NULL || fc->len != len || strncasecmp(fc->name, name, len))
+		return;
+	if (fc->hash && !module.transparent_hash)
+		return;
+
+	if (fc->rewrite != NULL)
+		fc->rewrite(fctx);
+	/*
+	 * Increase ref count as Redis drops the refcnt of the arguments
+	 * once the call has finished processing.
+	 */
+	RedisModule_RetainString(NULL, fc->str);
+	RedisModule_CommandFilterArgReplace(fctx, 0, fc->str);
+}
+
+/*
+ * TRANSPARENT on|off
+ */
+int TransparentCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc != 2) {
+		return RedisModule_WrongArity(ctx);
+	}
+	const char *val = RedisModule_StringPtrLen(argv[1], NULL);
+
+	if (strcasecmp(val, "on") == 0 || strcasecmp(val, "yes") == 0) {
+		int c = 0;
+		if (module.filter == NULL) {
+			c++;
+			module.filter = RedisModule_RegisterCommandFilter(ctx,
+			    transparent_filter, REDISMODULE_CMDFILTER_NOSELF);
+		}
+		return RedisModule_ReplyWithLongLong(ctx, c);
+	}
+
+	if (strcasecmp(val, "off") == 0 || strcasecmp(val, "no") == 0) {
+		int c = 0;
+		if (module.filter != NULL) {
+			c++;
+			RedisModule_UnregisterCommandFilter(ctx, module.filter);
+			module.filter = NULL;
+		}
+		return RedisModule_ReplyWithLongLong(ctx, c);
+	}
+
+	return RedisModule_ReplyWithError(ctx, "invalid argument");
+}
+
+#define	DEFAULT_DICT_SIZE	100*1024
+#define	DEFAULT_MAX_NSAMPLES	1024
+#define	TRAINBUF_FACTOR		10
+#define	TRAIN_SLICE_MS		1	/* Sampling time per event loop tick */
+#define	TRAIN_HOLDOUT		10	/* Every 10th sample is held out */
+#define	TRAIN_MAX_THREADS	64
+
+void train_data_init(struct train_data *train, size_t max_nsamples,
+    size_t max_bytes, uint64_t seed) {
+	train->samples = RedisModule_Calloc(max_nsamples,
+	    sizeof (*train->samples));
+	train->nsamples = 0;
+	train->max_nsamples = max_nsamples;
+	train->bytes = 0;
+	train->max_bytes = max_bytes;
+	train->seen = 0;
+	train->rng = seed != 0 ? seed : 1;
+}
+
+void train_data_free(struct train_data *train) {
+	for (size_t i = 0; i < train->nsamples; i++)
+		RedisModule_Free(train->samples[i].data);
+	RedisModule_Free(train->samples);
+	train->samples = NULL;
+	train->nsamples = 0;
+	train->bytes = 0;
+}
+
+uint64_t train_rand(struct train_data *train) {
+	uint64_t x = train->rng;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	train->rng = x;
+
+	return x;
+}
+
+/*
+ * Drop sample i, moving the last sample into its place.
+ */
+void train_evict(struct train_data *train, size_t i) {
+	struct train_sample *const last = &train->samples[--train->nsamples];
+
+	train->bytes -= train->samples[i].len;
+	RedisModule_Free(train->samples[i].data);
+	train->samples[i] = *last;
+	last->data = NULL;
+	last->len = 0;
+}
+
+/*
+ * Offer the value of a key to the reservoir. The nth eligible key replaces
+ * a random sample with probability max_nsamples / n. When the byte budget
+ * is exceeded, random samples make room for the new one, so large values
+ * don't crowd out the rest and no sample is cut short unless it's larger
+ * than the whole budget. A compressed hash offers one of its fields, picked
+ * at random.
+ */
+void train_callback(RedisModuleCtx *ctx, RedisModuleString *keyname,
+    RedisModuleKey *key, void *data) {
+	REDISMODULE_NOT_USED(ctx);
+
+	struct train_data *const train = data;
+
+	if (key == NULL)
+		return;
+
+	/* Ensure that the key matches the given prefix  */
+	size_t keylen;
+	const char *keystr = RedisModule_StringPtrLen(keyname, &keylen);
+
+	if (train->match_prefix != NULL && (keylen <= train->match_len ||
+	    memcmp(train->match_prefix, keystr, train->match_len) != 0 ||
+	    !module.is_delim[(unsigned char)keystr[train->match_len]])) {
+		return;
+	}
+
+	/* Strings, compressed strings and compressed hashes can serve */
+	const struct zipstr *zs = NULL;
+	const struct ziphash *zh = NULL;
+	struct hash_entry e;
+	const char *str = NULL;
+	size_t len;
+
+	switch (RedisModule_KeyType(key)) {
+	case REDISMODULE_KEYTYPE_STRING:
+		str = RedisModule_StringDMA(key, &len, REDISMODULE_READ);
+		if (str == NULL)
+			return;
+		break;
+	case REDISMODULE_KEYTYPE_MODULE:
+		if (RedisModule_ModuleTypeGetType(key) == ZipHash_Type) {
+			zh = RedisModule_ModuleTypeGetValue(key);
+			if (zh->nfields == 0)
+				return;
+			len = 0;
+			break;
+		}
+		if (RedisModule_ModuleTypeGetType(key) != ZipString_Type)
+			return;
+		zs = RedisModule_ModuleTypeGetValue(key);
+		len = zs->orig_len;
+		break;
+	default:
+		return;
+	}
+	if (zh == NULL && len == 0)
+		return;
+
+	train->seen++;
+	size_t slot = train->nsamples;
+	if (slot >= train->max_nsamples) {
+		slot = train_rand(train) % train->seen;
+		if (slot >= train->max_nsamples)
+			return;
+	}
+
+	/* Finding a field of a packed hash is a walk: only for kept samples */
+	if (zh != NULL) {
+		ziphash_nth(zh, train_rand(train) % zh->nfields, &e);
+		len = e.orig_len;
+		if (len == 0)
+			return;
+	}
+
+	/* Larger than the budget: partial data is OK */
+	if (len > train->max_bytes)
+		len = train->max_bytes;
+
+	char *const sample = RedisModule_Alloc(len);
+	if (zs != NULL) {
+		if (zipstr_read_range(&module, zs, 0, len, sample) != 0) {
+			RedisModule_Free(sample);
+			return;
+		}
+	} else if (zh != NULL) {
+		char *buf = NULL;
+		size_t buflen = 0;
+		const char *const value = hash_value_read(&module,
+		    ziphash_dict(zh), &e, &buf, &buflen);
+
+		if (value != NULL)
+			(void) memcpy(sample, value, len);
+		RedisModule_Free(buf);
+		if (value == NULL) {
+			RedisModule_Free(sample);
+			return;
+		}
+	} else {
+		(void) memcpy(sample, str, len);
+	}
+
+	if (slot < train->nsamples)
+		train_evict(train, slot);
+	while (train->nsamples > 0 && train->bytes + len > train->max_bytes)
+		train_evict(train, train_rand(train) % train->nsamples);
+
+	train->samples[train->nsamples].data = sample;
+	train->samples[train->nsamples].len = len;
+	train->nsamples++;
+	train->bytes += len;
+}
+
+struct train_job *train_job_create(long long dict_size, const char *prefix,
+    size_t prefix_len) {
+	struct train_job *const job = RedisModule_Calloc(1, sizeof (*job));
+
+	job->id = RedisModule_Milliseconds();
+	job->started = job->id;
+	job->state = TRAIN_SAMPLING;
+
+	if (prefix != NULL) {
+		/* Command arguments don't outlive an async job; keep a copy */
+		job->prefix = RedisModule_Alloc(prefix_len + 1);
+		(void) memcpy(job->prefix, prefix, prefix_len);
+		job->prefix[prefix_len] = '\0';
+		job->prefix_len = prefix_len;
+	}
+
+	const long long max_bytes = module.train_bytes > 0 ?
+	    module.train_bytes : TRAINBUF_FACTOR * dict_size;
+
+	train_data_init(&job->train, module.train_samples, max_bytes,
+	    (uint64_t)job->id);
+	job->train.match_prefix = job->prefix;
+	job->train.match_len = job->prefix_len;
+
+	job->algo = TRAIN_DEFAULT;
+	job->nthreads = 1;
+	job->level = module.clevel;
+	job->dictbuf_len = dict_size;
+	job->cursor = RedisModule_ScanCursorCreate();
+
+	return job;
+}
+
+void train_job_free(struct train_job *job) {
+	if (job->cursor != NULL)
+		RedisModule_ScanCursorDestroy(job->cursor);
+	if (job->scan_ctx != NULL)
+		RedisModule_FreeThreadSafeContext(job->scan_ctx);
+	train_data_free(&job->train);
+	RedisModule_Free(job->dictbuf);
+	RedisModule_Free(job->prefix);
+	RedisModule_Free(job);
+}
+
+/*
+ * Sample keys until the keyspace has been scanned, or budget_ms has passed
+ * (0 means no limit). Returns 1 if more keys remain.
+ */
+int train_job_sample(RedisModuleCtx *ctx, struct train_job *job,
+    long long budget_ms) {
+	const long long deadline = RedisModule_Milliseconds() + budget_ms;
+	int active;
+
+	do {
+		active = RedisModule_Scan(ctx, job->cursor, train_callback,
+		    &job->train);
+	} while (active == 1 && (budget_ms == 0 ||
+	    RedisModule_Milliseconds() < deadline));
+
+	return active;
+}
+
+/*
+ * Samples packed back to back, as ZDICT wants them.
+ */
+struct train_set {
+	char *buf;
+	size_t *sizes;
+	size_t n;
+	size_t len;
+};
+
+/*
+ * Run the parameter search of the job's algorithm. Each candidate is
+ * scored by compressing part of the training set at the job's level.
+ */
+size_t train_job_search(struct train_job *job, const struct train_set *ts) {
+	ZDICT_params_t zparams = { .compressionLevel = job->level };
+	size_t ret;
+
+	if (job->algo == TRAIN_COVER) {
+		ZDICT_cover_params_t params = {
+			.nbThreads = job->nthreads,
+			.splitPoint = 0.75,
+			.zParams = zparams,
+		};
+
+		ret = ZDICT_optimizeTrainFromBuffer_cover(job->dictbuf,
+		    job->dictbuf_len, ts->buf, ts->sizes, ts->n, &params);
+		job->k = params.k;
+		job->d = params.d;
+		return ret;
+	}
+
+	ZDICT_fastCover_params_t params = {
+		.nbThreads = job->nthreads,
+		.zParams = zparams,
+	};
+
+	if (job->algo == TRAIN_DEFAULT) {
+		params.d = 8;
+		params.steps = 4;
+	}
+	ret = ZDICT_optimizeTrainFromBuffer_fastCover(job->dictbuf,
+	    job->dictbuf_len, ts->buf, ts->sizes, ts->n, &params);
+	job->k = params.k;
+	job->d = params.d;
+
+	return ret;
+}
+
+/*
+ * Compression ratio of the held-out samples with the new dictionary, or 0
+ * if it can't be measured.
+ */
+double train_job_evaluate(const struct train_job *job,
+    const struct train_set *ts) {
+	if (ts->n == 0 || ZSTD_isError(job->dict_size))
+		return 0;
+
+	ZSTD_CCtx *const cctx = ZSTD_createCCtx();
+	ZSTD_CDict *const cdict = ZSTD_createCDict(job->dictbuf,
+	    job->dict_size, job->level);
+	size_t max_len = 0;
+
+	for (size_t i = 0; i < ts->n; i++) {
+		if (ts->sizes[i] > max_len)
+			max_len = ts->sizes[i];
+	}
+
+	const size_t dst_len = ZSTD_compressBound(max_len);
+	char *const dst = RedisModule_Alloc(dst_len);
+	const char *src = ts->buf;
+	size_t compressed = 0;
+	double ratio = 0;
+
+	for (size_t i = 0; cctx != NULL && cdict != NULL && i < ts->n; i++) {
+		const size_t len = ZSTD_compress_usingCDict(cctx, dst, dst_len,
+		    src, ts->sizes[i], cdict);
+
+		if (ZSTD_isError(len)) {
+			compressed = 0;
+			break;
+		}
+		compressed += len;
+		src += ts->sizes[i];
+	}
+	if (compressed > 0)
+		ratio = (double)ts->len / compressed;
+
+	RedisModule_Free(dst);
+	ZSTD_freeCDict(cdict);
+	ZSTD_freeCCtx(cctx);
+
+	return ratio;
+}
+
+int train_heldout(size_t i, size_t nheldout) {
+	return i % TRAIN_HOLDOUT == TRAIN_HOLDOUT - 1 &&
+	    i / TRAIN_HOLDOUT < nheldout;
+}
+
+/*
+ * Train the dictionary from the collected samples. Every TRAIN_HOLDOUT-th
+ * sample is kept out of training to measure the ratio of the result. Only
+ * touches memory owned by the job, so it's safe to call from a worker
+ * thread.
+ */
+void train_job_train(struct train_job *job) {
+	struct train_data *const train = &job->train;
+	struct train_set sets[2];	/* Training, held out */
+	char *const buf = RedisModule_Alloc(train->bytes);
+	size_t *const sizes = RedisModule_Alloc(train->nsamples *
+	    sizeof (*sizes));
+	const size_t nheldout = train->nsamples >= 2 * TRAIN_HOLDOUT ?
+	    train->nsamples / TRAIN_HOLDOUT : 0;
+
+	size_t train_len = 0;
+
+	/* Held-out samples are packed after the training set */
+	for (size_t i = 0; i < train->nsamples; i++) {
+		if (!train_heldout(i, nheldout))
+			train_len += train->samples[i].len;
+	}
+	sets[0] = (struct train_set){ buf, sizes, 0, 0 };
+	sets[1] = (struct train_set){ buf + train_len,
+	    sizes + (train->nsamples - nheldout), 0, 0 };
+
+	for (size_t i = 0; i < train->nsamples; i++) {
+		struct train_sample *const sample = &train->samples[i];
+		struct train_set *const ts = &sets[train_heldout(i, nheldout)];
+
+		(void) memcpy(ts->buf + ts->len, sample->data, sample->len);
+		ts->sizes[ts->n++] = sample->len;
+		ts->len += sample->len;
+		RedisModule_Free(sample->data);
+		sample->data = NULL;
+	}
+
+	job->dictbuf = RedisModule_Alloc(job->dictbuf_len);
+	job->dict_size = train_job_search(job, &sets[0]);
+	job->nheldout = nheldout;
+	job->ratio = train_job_evaluate(job, &sets[1]);
+
+	RedisModule_Free(sizes);
+	RedisModule_Free(buf);
+	job->state = TRAIN_DONE;
 }
 
-int TransparentCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-	if (argc != 2) {
-		return RedisModule_WrongArity(ctx);
+/*
+ * Install the trained dictionary and reply to the client.
+ */
+int train_job_reply(RedisModuleCtx *ctx, struct train_job *job) {
+	if (job->cancelled) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR training cancelled");
 	}
-	const char *val = RedisModule_StringPtrLen(argv[1], NULL);
 
-	if (strcasecmp(val, "yes") == 0) {
-		int c = 0;
-		if (module.set_filter == NULL) {
-			c++;
-			module.set_filter = RedisModule_RegisterCommandFilter(
-			    ctx, set_command_filter, 0);
-		}
-		if (module.get_filter == NULL) {
-			c++;
-			module.get_filter = RedisModule_RegisterCommandFilter(
-			    ctx, get_command_filter, 0);
-		}
+	if (ZSTD_isError(job->dict_size)) {
+		const int err = ZSTD_getErrorCode(job->dict_size);
+		const char *errstr = ZSTD_getErrorString(err);
+		const char *fmt = "ERR zstd error: %s";
+		char buf[strlen(errstr) + strlen(fmt)];
 
-		return RedisModule_ReplyWithLongLong(ctx, c);
+		(void) snprintf(buf, sizeof (buf), fmt, errstr);
+
+		return RedisModule_ReplyWithError(ctx, buf);
 	}
 
-	if (strcasecmp(val, "no") == 0) {
-		int c = 0;
-		if (module.set_filter != NULL) {
-			c++;
-			RedisModule_UnregisterCommandFilter(ctx,
-			    module.set_filter);
-			module.set_filter = NULL;
-		}
-		if (module.get_filter != NULL) {
-			c++;
-			RedisModule_UnregisterCommandFilter(ctx,
-			    module.get_filter);
-			module.get_filter = NULL;
-		}
-		return RedisModule_ReplyWithLongLong(ctx, c);
+	long long id = dict_create(&module, job->dictbuf, job->dict_size,
+	    job->prefix, job->prefix_len, module.clevel);
+
+	if (id < 0) {
+		return RedisModule_ReplyWithError(ctx, "ERR dictionary failed");
 	}
+	dict_replicate(ctx, dict_find(id));
 
-	return RedisModule_ReplyWithError(ctx, "invalid argument");
+	RedisModule_ReplyWithArray(ctx, 7);
+	RedisModule_ReplyWithLongLong(ctx, id);
+	RedisModule_ReplyWithLongLong(ctx, job->dict_size);
+	RedisModule_ReplyWithLongLong(ctx,
+	    job->train.nsamples - job->nheldout);
+	RedisModule_ReplyWithLongLong(ctx, job->nheldout);
+	RedisModule_ReplyWithDouble(ctx, job->ratio);
+	RedisModule_ReplyWithLongLong(ctx, job->k);
+	RedisModule_ReplyWithLongLong(ctx, job->d);
+
+	return REDISMODULE_OK;
 }
 
-void train_callback(RedisModuleCtx *ctx, RedisModuleString *keyname,
-    RedisModuleKey *key, void *data) {
-	REDISMODULE_NOT_USED(ctx);
+void *train_thread_main(void *arg) {
+	struct train_job *const job = arg;
 
-	struct train_data *const train = data;
+	train_job_train(job);
+	RedisModule_UnblockClient(job->bc, job);
 
-	if (key == NULL)
-		return;
+	return NULL;
+}
 
-	/* Ensure that the key matches the given prefix  */
-	size_t keylen;
-	const char *keystr = RedisModule_StringPtrLen(keyname, &keylen);
+void train_timer_cb(RedisModuleCtx *ctx, void *data) {
+	struct train_job *const job = data;
 
-	if (train->match_prefix != NULL && (keylen < train->match_len ||
-	    memcmp(train->match_prefix, keystr, train->match_len) != 0)) {
-		RedisModule_Log(ctx, "notice", "prefix mismatch %s",
-		    RedisModule_StringPtrLen(keyname, NULL));
+	if (job->cancelled) {
+		RedisModule_UnblockClient(job->bc, job);
 		return;
-	} else {
-		RedisModule_Log(ctx, "notice", "prefix MATCH %s",
-		    RedisModule_StringPtrLen(keyname, NULL));
 	}
 
-	/* Ensure there is space for another sample */
-	if (train->nsamples >= train->max_nsamples ||
-	    train->offset >= train->buflen) {
+	if (train_job_sample(job->scan_ctx, job, TRAIN_SLICE_MS)) {
+		job->timer = RedisModule_CreateTimer(ctx, TRAIN_SLICE_MS,
+		    train_timer_cb, job);
 		return;
 	}
 
-	/* Only STRING objects can serve as sample data */
-	if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_STRING)
-		return;
+	RedisModule_Log(ctx, "debug",
+	    "End scan. %zu samples of %llu keys, %zu bytes",
+	    job->train.nsamples, (unsigned long long)job->train.seen,
+	    job->train.bytes);
 
-	size_t sample_len;
-	const char *const sample = RedisModule_StringDMA(key, &sample_len,
-	    REDISMODULE_READ);
-	if (sample == NULL)
+	/* Sampling is done; run the expensive part off the main thread */
+	pthread_t tid;
+
+	job->state = TRAIN_TRAINING;
+	if (pthread_create(&tid, NULL, train_thread_main, job) != 0) {
+		RedisModule_Log(ctx, "warning",
+		    "Could not start training thread; training inline");
+		train_job_train(job);
+		RedisModule_UnblockClient(job->bc, job);
 		return;
+	}
+	(void) pthread_detach(tid);
+}
+
+int train_reply_cb(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	REDISMODULE_NOT_USED(argv);
+	REDISMODULE_NOT_USED(argc);
 
-	/* Partial data is OK */
-	if (sample_len + train->offset >= train->buflen)
-		sample_len = train->buflen - train->offset;
+	return train_job_reply(ctx,
+	    RedisModule_GetBlockedClientPrivateData(ctx));
+}
 
-	memcpy(train->buf + train->offset, sample, sample_len);
+void train_free_cb(RedisModuleCtx *ctx, void *privdata) {
+	REDISMODULE_NOT_USED(ctx);
 
-	train->offset += sample_len;
-	train->sample_sizes[train->nsamples] = sample_len;
-	train->nsamples++;
+	if (module.train_job == privdata)
+		module.train_job = NULL;
+	train_job_free(privdata);
 }
 
-#define	DEFAULT_DICT_SIZE	100*1024
-#define	DEFAULT_MAX_NSAMPLES	1024
-#define	TRAINBUF_FACTOR		10
+void train_disconnect_cb(RedisModuleCtx *ctx, RedisModuleBlockedClient *bc) {
+	REDISMODULE_NOT_USED(ctx);
+	REDISMODULE_NOT_USED(bc);
+
+	/* Nobody is waiting for the dictionary anymore */
+	if (module.train_job != NULL)
+		module.train_job->cancelled = 1;
+}
 
 /*
- * DICT TRAIN [DICTSIZE <size>] [PREFIX <prefix>]
+ * DICT TRAIN [DICTSIZE <size>] [PREFIX <prefix>] [ALGO <algo>] [THREADS <n>]
+ *            [ASYNC]
  *
  * Train a new dictionary on STRING objects stored in Redis.
  *
@@ -605,24 +6076,39 @@ void train_callback(RedisModuleCtx *ctx, RedisModuleString *keyname,
  * PREFIX string  -- Train data only on strings where the keys match the
  *                   prefix. 
  *
+ * ALGO algo      -- DEFAULT, the fastCover setup of ZDICT_trainFromBuffer,
+ *                   FASTCOVER or COVER. The latter search more k and d
+ *                   parameters and take longer.
+ *
+ * THREADS n      -- Threads used by the parameter search (default 1).
+ *
+ * ASYNC          -- Collect samples in small steps on the event loop and
+ *                   train the dictionary on a separate thread. The client
+ *                   is blocked until the dictionary has been created.
+ *
  */
 int DictTrainCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-	if (argc != 2 && argc != 4) {
-		return RedisModule_WrongArity(ctx);
-	}
-
 	long long dict_size = DEFAULT_DICT_SIZE;
 	const char *prefix = NULL;
 	size_t prefix_len = 0;
+	enum train_algo algo = TRAIN_DEFAULT;
+	long long nthreads = 1;
+	int async = 0;
 
-	if (argc > 2 && (argc % 2) != 0) {
-		/* expect matching OPTION VAL pairs */
-		return RedisModule_ReplyWithError(ctx,
-		    "ERR invalid syntax");
-	}
-	for (int i = 2; i < argc; i += 2) {
+	for (int i = 2; i < argc; i++) {
 		const char *const arg = RedisModule_StringPtrLen(argv[i], NULL);
-		RedisModuleString *const val = argv[i+1];
+
+		if (strcasecmp(arg, "async") == 0) {
+			async = 1;
+			continue;
+		}
+
+		/* expect matching OPTION VAL pairs */
+		if (i + 1 >= argc) {
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR invalid syntax");
+		}
+		RedisModuleString *const val = argv[++i];
 
 		if (strcasecmp(arg, "dictsize") == 0) {
 			int err = RedisModule_StringToLongLong(val, &dict_size);
@@ -636,71 +6122,126 @@ int DictTrainCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 			}
 		} else if (strcasecmp(arg, "prefix") == 0) {
 			prefix = RedisModule_StringPtrLen(val, &prefix_len);
+		} else if (strcasecmp(arg, "algo") == 0) {
+			const char *const name = RedisModule_StringPtrLen(val,
+			    NULL);
+
+			if (strcasecmp(name, "default") == 0) {
+				algo = TRAIN_DEFAULT;
+			} else if (strcasecmp(name, "fastcover") == 0) {
+				algo = TRAIN_FASTCOVER;
+			} else if (strcasecmp(name, "cover") == 0) {
+				algo = TRAIN_COVER;
+			} else {
+				return RedisModule_ReplyWithError(ctx,
+				    "ERR invalid algo");
+			}
+		} else if (strcasecmp(arg, "threads") == 0) {
+			if (RedisModule_StringToLongLong(val, &nthreads) !=
+			    REDISMODULE_OK || nthreads < 1 ||
+			    nthreads > TRAIN_MAX_THREADS) {
+				return RedisModule_ReplyWithError(ctx,
+				    "ERR invalid threads");
+			}
 		} else {
 			return RedisModule_ReplyWithError(ctx,
 			    "ERR invalid syntax");
 		}
 	}
 
-	struct train_data train;
-	train.buflen = TRAINBUF_FACTOR * dict_size;
-	train.buf = RedisModule_Alloc(train.buflen);
-	train.offset = 0;
-	train.max_nsamples = DEFAULT_MAX_NSAMPLES;
-	train.sample_sizes = RedisModule_Calloc(train.max_nsamples,
-	    sizeof (*train.sample_sizes));
-	train.nsamples = 0;
-	train.match_prefix = prefix;
-	train.match_len = prefix_len;
-
-	RedisModuleScanCursor *const c = RedisModule_ScanCursorCreate();
-	int iter = 0;
-	int active = 0;
+	if (module.train_job != NULL) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR training already in progress");
+	}
+
+	if (async && !can_block(ctx)) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR ASYNC is not allowed in MULTI or scripts");
+	}
+
+	struct train_job *const job = train_job_create(dict_size, prefix,
+	    prefix_len);
+	job->algo = algo;
+	job->nthreads = nthreads;
+
+	if (async) {
+		job->bc = RedisModule_BlockClient(ctx, train_reply_cb, NULL,
+		    train_free_cb, 0);
+		RedisModule_SetDisconnectCallback(job->bc, train_disconnect_cb);
+		job->scan_ctx = RedisModule_GetThreadSafeContext(job->bc);
+		job->timer = RedisModule_CreateTimer(ctx, 0, train_timer_cb,
+		    job);
+		module.train_job = job;
+
+		return REDISMODULE_OK;
+	}
+
 	RedisModule_Log(ctx, "debug", "Start scan for training data");
-	do {
-		RedisModule_Log(ctx, "debug", "iteration %d", iter++);
-		active = RedisModule_Scan(ctx, c, train_callback, &train);
-	} while (active == 1 && train.nsamples < train.max_nsamples &&
-	    train.offset < train.buflen); 
-	RedisModule_ScanCursorDestroy(c);
-	RedisModule_Log(ctx, "debug", "End scan. %zu samples, buf size %zu",
-	    train.nsamples, train.offset);
+	while (train_job_sample(ctx, job, 0))
+		;
+	RedisModule_Log(ctx, "debug",
+	    "End scan. %zu samples of %llu keys, %zu bytes",
+	    job->train.nsamples, (unsigned long long)job->train.seen,
+	    job->train.bytes);
 
 	/*
 	 * Attempt to create a dictionary from training data.
 	 */
-	char *dictbuf = RedisModule_Alloc(dict_size);
-	dict_size = ZDICT_trainFromBuffer(dictbuf, dict_size,
-		train.buf, train.sample_sizes, train.nsamples);
+	train_job_train(job);
 
-	RedisModule_Free(train.buf);
-	RedisModule_Free(train.sample_sizes);
+	const int ret = train_job_reply(ctx, job);
+	train_job_free(job);
 
-	if (ZSTD_isError(dict_size)) {
-		const int err = ZSTD_getErrorCode(dict_size);
-		const char *errstr = ZSTD_getErrorString(err);
-		const char *fmt = "ERR zstd error: %s";
-		char buf[strlen(errstr) + strlen(fmt)];
+	return ret;
+}
 
-		(void) snprintf(buf, sizeof (buf), fmt, errstr);
+/*
+ * DICT STATUS
+ *
+ * Report on the async training job, if any.
+ */
+int DictStatusCommand(RedisModuleCtx *ctx) {
+	const struct train_job *const job = module.train_job;
+	static const char *const states[] = {
+		[TRAIN_SAMPLING] = "sampling",
+		[TRAIN_TRAINING] = "training",
+		[TRAIN_DONE] = "done",
+	};
 
-		return RedisModule_ReplyWithError(ctx, buf);
+	if (job == NULL) {
+		return RedisModule_ReplyWithNull(ctx);
 	}
 
-	long long id = dict_create(&module, dictbuf, dict_size, prefix,
-	    prefix_len, module.clevel);
-	RedisModule_Free(dictbuf);
+	RedisModule_ReplyWithArray(ctx, 7);
+	RedisModule_ReplyWithLongLong(ctx, job->id);
+	RedisModule_ReplyWithSimpleString(ctx,
+	    job->cancelled ? "cancelled" : states[job->state]);
+	RedisModule_ReplyWithStringBuffer(ctx,
+	    job->prefix != NULL ? job->prefix : "", job->prefix_len);
+	RedisModule_ReplyWithLongLong(ctx, job->train.nsamples);
+	RedisModule_ReplyWithLongLong(ctx, job->train.bytes);
+	RedisModule_ReplyWithLongLong(ctx, job->dictbuf_len);
+	RedisModule_ReplyWithLongLong(ctx,
+	    RedisModule_Milliseconds() - job->started);
 
-	if (id < 0) {
-		return RedisModule_ReplyWithError(ctx, "ERR dictionary failed");
+	return REDISMODULE_OK;
+}
+
+/*
+ * DICT CANCEL
+ *
+ * Cancel the async training job. Sampling stops at the next tick; a running
+ * ZDICT step can't be interrupted, so its result is discarded instead.
+ */
+int DictCancelCommand(RedisModuleCtx *ctx) {
+	if (module.train_job == NULL) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR no training in progress");
 	}
 
-	RedisModule_ReplyWithArray(ctx, 3);
-	RedisModule_ReplyWithLongLong(ctx, id);
-	RedisModule_ReplyWithLongLong(ctx, dict_size);
-	RedisModule_ReplyWithLongLong(ctx, train.nsamples);
+	module.train_job->cancelled = 1;
 
-	return REDISMODULE_OK;
+	return RedisModule_ReplyWithSimpleString(ctx, "OK");
 }
 
 int DictDropCommand(RedisModuleCtx *ctx, struct dict *dict) {
@@ -709,54 +6250,397 @@ int DictDropCommand(RedisModuleCtx *ctx, struct dict *dict) {
 		    "ERR no active dictionary");
 	}
 
-	dict_rele(&module, dict, NULL);
-	if (module.dict == dict)
-		module.dict = NULL;
+	const long long id = dict->id;
+
+	if (dict_deactivate(&module, dict) != 0) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR dictionary is not active");
+	}
+	RedisModule_Replicate(ctx, MODPREFIX".dict", "cl", "DROP", id);
+
+	return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/*
+ * DICT RESTORE <dictBuffer> [ID <id>] [PREFIX <prefix>] [INACTIVE]
+ *
+ * Without ID, the dictionary gets a new ID. An existing dictionary with
+ * the same ID is activated again. INACTIVE, as written by AOF rewrites,
+ * keeps the dictionary for the objects loaded after it without using it
+ * for new values.
+ */
+int DictRestoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+    int argc) {
+	if (argc < 3) {
+		return RedisModule_WrongArity(ctx);
+	}
+
+	size_t buflen;
+	const char *const buf = RedisModule_StringPtrLen(argv[2], &buflen);
+	long long id = 0;
+	const char *prefix = NULL;
+	size_t prefix_len = 0;
+	int inactive = 0;
+
+	for (int i = 3; i < argc; i++) {
+		const char *const opt = RedisModule_StringPtrLen(argv[i], NULL);
+
+		if (strcasecmp(opt, "id") == 0 && i + 1 < argc) {
+			if (RedisModule_StringToLongLong(argv[++i], &id) !=
+			    REDISMODULE_OK || id <= 0) {
+				return RedisModule_ReplyWithError(ctx,
+				    "ERR invalid dictionary id");
+			}
+		} else if (strcasecmp(opt, "prefix") == 0 && i + 1 < argc) {
+			prefix = RedisModule_StringPtrLen(argv[++i],
+			    &prefix_len);
+		} else if (strcasecmp(opt, "inactive") == 0) {
+			inactive = 1;
+		} else {
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR syntax error");
+		}
+	}
+	if (inactive && (RedisModule_GetContextFlags(ctx) &
+	    REDISMODULE_CTX_FLAGS_LOADING) == 0) {
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR INACTIVE is only valid while loading");
+	}
+
+	struct dict *dict = id != 0 ? dict_find(id) : NULL;
+	if (dict != NULL) {
+		if (dict->buflen != buflen ||
+		    memcmp(dict->buf, buf, buflen) != 0 ||
+		    dict->prefix_len != prefix_len || (prefix_len > 0 &&
+		    memcmp(dict->prefix, prefix, prefix_len) != 0)) {
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR dictionary id exists");
+		}
+		dict_hold(dict, NULL);
+	} else {
+		dict = dict_new(&module, id != 0 ? id :
+		    RedisModule_Milliseconds(), buf, buflen, prefix,
+		    prefix_len, module.clevel);
+		if (dict == NULL) {
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR dictionary failed");
+		}
+	}
+
+	if (inactive) {
+		load_dicts_hold(dict);
+	} else if (dict_is_active(&module, dict)) {
+		dict_rele(&module, dict, NULL);
+	} else if (dict_activate(&module, dict) != 0) {
+		dict_rele(&module, dict, NULL);
+		return RedisModule_ReplyWithError(ctx,
+		    "ERR dictionary failed");
+	}
+	if (!inactive) {
+		dict_replicate(ctx, dict);
+	}
+
+	return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+int DictDumpCommand(RedisModuleCtx *ctx, const struct dict *dict) {
+	if (dict == NULL) {
+		return RedisModule_ReplyWithNull(ctx);
+	}
+	return RedisModule_ReplyWithStringBuffer(ctx, dict->buf,
+	    dict->buflen);
+}
+
+int DictListCommand(RedisModuleCtx *ctx) {
+	RedisModule_ReplyWithArray(ctx, RedisModule_DictSize(module.all_dicts));
+
+	RedisModuleDictIter *const iter = RedisModule_DictIteratorStartC(
+	    module.all_dicts, "^", NULL, 0);
+
+	void *data;
+	while (RedisModule_DictNextC(iter, NULL, &data) != NULL) {
+		const struct dict *dict = data;
+		double ratio = 0;
+		const char *prefix = "";
+		size_t prefix_len = 1;
+
+		if (dict->prefix_len > 0) {
+			prefix = dict->prefix;
+			prefix_len = dict->prefix_len;
+		}
+		if (dict->mem_compressed > 0) {
+			ratio = (double)dict->mem_uncompressed /
+				(double)dict->mem_compressed;
+		}
+
+		RedisModule_ReplyWithArray(ctx, 8);
+		RedisModule_ReplyWithLongLong(ctx, dict->id);
+		RedisModule_ReplyWithStringBuffer(ctx, prefix, prefix_len);
+		RedisModule_ReplyWithLongLong(ctx, dict->refcnt);
+		RedisModule_ReplyWithLongLong(ctx, dict->mem_uncompressed);
+		RedisModule_ReplyWithLongLong(ctx, dict->mem_compressed);
+		RedisModule_ReplyWithDouble(ctx, ratio);
+		RedisModule_ReplyWithLongLong(ctx,
+		    tune_levels[dict->tuner.step]);
+		RedisModule_ReplyWithLongLong(ctx, dict_mem(dict));
+	}
+	RedisModule_DictIteratorStop(iter);
+
+	return REDISMODULE_OK;
+}
+
+/*
+ * Recompress every field of a hash with dict into a new hash swapped in
+ * place. HSETRAW keeps the dictionary of an existing hash, so the new hash
+ * is propagated as DEL and HSETRAW of all its fields, then its TTL.
+ */
+void migrate_hash(RedisModuleCtx *ctx, struct migrator *mig,
+    RedisModuleString *keyname, struct ziphash *zh, struct dict *dict) {
+	struct dict *const old = ziphash_dict(zh);
+	struct ziphash *const nzh = ziphash_new(dict);
+	const size_t nraw = zh->nfields * 3;
+	RedisModuleString **const raw = RedisModule_Alloc(nraw *
+	    sizeof (*raw));
+	struct hash_iter it;
+	struct hash_entry e;
+	size_t j = 0;
+
+	hash_iter_start(&it, zh);
+	while (hash_iter_next(&it, &e)) {
+		const char *const value = hash_value_read(&module, old, &e,
+		    &mig->buf, &mig->buflen);
+
+		if (value == NULL)
+			break;
+
+		struct hash_value *const hv = hash_value_encode(&module, dict,
+		    value, e.orig_len);
+
+		raw[j] = RedisModule_CreateString(ctx, e.field, e.field_len);
+		raw[j + 1] = RedisModule_CreateStringFromLongLong(ctx,
+		    hv->orig_len);
+		raw[j + 2] = RedisModule_CreateString(ctx, hv->buf, hv->len);
+		(void) ziphash_insert(nzh, e.field, e.field_len, hv);
+		j += 3;
+	}
+	hash_iter_stop(&it);
+
+	if (j == nraw) {
+		RedisModuleKey *const key = RedisModule_OpenKey(ctx, keyname,
+		    REDISMODULE_WRITE);
+		const mstime_t expire = RedisModule_GetExpire(key);
+
+		mig->migrated++;
+		mig->bytes_before += zh->len;
+		mig->bytes_after += nzh->len;
+
+		RedisModule_ModuleTypeReplaceValue(key, ZipHash_Type, nzh,
+		    NULL);
+		ziphash_free(zh);
+		RedisModule_CloseKey(key);
+
+		RedisModule_Replicate(ctx, "DEL", "s", keyname);
+		RedisModule_Replicate(ctx, MODPREFIX".hsetraw", "slv", keyname,
+		    dict != NULL ? dict->id : 0, raw, nraw);
+		if (expire != REDISMODULE_NO_EXPIRE) {
+			RedisModule_Replicate(ctx, "PEXPIREAT", "sl", keyname,
+			    (long long)(RedisModule_Milliseconds() + expire));
+		}
+	} else {
+		mig->failed++;
+		ziphash_release(nzh);
+	}
+
+	for (size_t i = 0; i < j; i++)
+		RedisModule_FreeString(ctx, raw[i]);
+	RedisModule_Free(raw);
+}
+
+/*
+ * Recompress the object at key if its key now maps to another dictionary.
+ */
+void migrate_callback(RedisModuleCtx *ctx, RedisModuleString *keyname,
+    RedisModuleKey *key, void *data) {
+	struct migrator *const mig = data;
+
+	if (key == NULL)
+		return;
+	mig->scanned++;
+
+	if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_MODULE)
+		return;
+
+	const RedisModuleType *const type =
+	    RedisModule_ModuleTypeGetType(key);
+	if (type != ZipString_Type && type != ZipHash_Type)
+		return;
+
+	void *const value = RedisModule_ModuleTypeGetValue(key);
+	size_t keylen;
+	const char *const keystr = RedisModule_StringPtrLen(keyname, &keylen);
+	struct dict *const dict = dict_lookup(&module, NULL, keystr, keylen);
+	const struct dict *const cur = type == ZipString_Type ?
+	    zipstr_dict(value) : ziphash_dict(value);
+
+	if (cur == dict)
+		return;
+
+	const ZSTD_CDict *const cdict = dict != NULL ? dict_cdict(dict) : NULL;
+	if (dict != NULL && cdict == NULL) {
+		mig->failed++;
+		return;
+	}
+
+	if (type == ZipHash_Type) {
+		migrate_hash(ctx, mig, keyname, value, dict);
+		return;
+	}
+
+	struct zipstr *const zs = value;
+
+	if (mig->buflen < zs->orig_len) {
+		RedisModule_Free(mig->buf);
+		mig->buf = RedisModule_Alloc(zs->orig_len);
+		mig->buflen = zs->orig_len;
+	}
+	if (zipstr_decompress(&module, zs, mig->buf) != 0) {
+		mig->failed++;
+		return;
+	}
+
+	struct chunk_index li;
+	struct zipstr *nzs;
+
+	if (zipstr_log(zs, &li)) {
+		nzs = log_encode(&module, dict, mig->buf, zs->orig_len,
+		    li.chunk_size);
+		if (nzs != NULL) {
+			nzs = zipstr_init(&module, nzs, dict, nzs->len,
+			    nzs->orig_len);
+		}
+	} else {
+		nzs = zipstr_compress(&module, dict, mig->buf, zs->orig_len);
+	}
+	if (nzs == NULL) {
+		mig->failed++;
+		return;
+	}
+
+	RedisModuleKey *const wkey = RedisModule_OpenKey(ctx, keyname,
+	    REDISMODULE_WRITE);
 
-	return RedisModule_ReplyWithSimpleString(ctx, "OK");
+	mig->migrated++;
+	mig->bytes_before += zs->len;
+	mig->bytes_after += nzs->len;
+
+	/* Swap in place, keeping the TTL; frees the old dictionary ref */
+	RedisModule_ModuleTypeReplaceValue(wkey, ZipString_Type, nzs, NULL);
+	zipstr_free(zs);
+	RedisModule_CloseKey(wkey);
+	zipstr_replicate(ctx, keyname, nzs, 1);
 }
 
-int DictDumpCommand(RedisModuleCtx *ctx, const struct dict *dict) {
-	if (dict == NULL) {
-		return RedisModule_ReplyWithNull(ctx);
-	}
-	return RedisModule_ReplyWithStringBuffer(ctx, dict->buf,
-	    dict->buflen);
+void migrate_stop(struct migrator *mig) {
+	mig->running = 0;
+	mig->finished = RedisModule_Milliseconds();
+	RedisModule_ScanCursorDestroy(mig->cursor);
+	mig->cursor = NULL;
+	RedisModule_Free(mig->buf);
+	mig->buf = NULL;
+	mig->buflen = 0;
 }
 
-int DictListCommand(RedisModuleCtx *ctx) {
-	RedisModule_ReplyWithArray(ctx, RedisModule_DictSize(module.all_dicts));
+/*
+ * Migrate for up to migrate-budget-ms, then yield to clients.
+ */
+void migrate_timer_cb(RedisModuleCtx *ctx, void *data) {
+	struct migrator *const mig = data;
+	const uint64_t deadline = monotonic_ns() +
+	    (uint64_t)mig->budget_ms * 1000000;
+
+	while (monotonic_ns() < deadline) {
+		if (RedisModule_SelectDb(ctx, mig->db) != REDISMODULE_OK) {
+			/* Past the last database */
+			RedisModule_Log(ctx, "notice",
+			    "Migration done: %zu of %zu keys recompressed",
+			    mig->migrated, mig->scanned);
+			migrate_stop(mig);
+			return;
+		}
+		if (RedisModule_Scan(ctx, mig->cursor, migrate_callback,
+		    mig) == 0) {
+			RedisModule_ScanCursorRestart(mig->cursor);
+			mig->db++;
+		}
+	}
 
-	RedisModuleDictIter *const iter = RedisModule_DictIteratorStartC(
-	    module.all_dicts, "^", NULL, 0);
+	mig->timer = RedisModule_CreateTimer(ctx, MIGRATE_TICK_MS,
+	    migrate_timer_cb, mig);
+}
 
-	void *data;
-	while (RedisModule_DictNextC(iter, NULL, &data) != NULL) {
-		const struct dict *dict = data;
-		double ratio = 0;
-		const char *prefix = "";
-		size_t prefix_len = 1;
+/*
+ * DICT MIGRATE [STOP|STATUS]
+ */
+int DictMigrateCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+    int argc) {
+	struct migrator *const mig = &module.migrator;
+	const char *const subcmd = argc > 2 ?
+	    RedisModule_StringPtrLen(argv[2], NULL) : "start";
 
-		if (dict->prefix_len > 0) {
-			prefix = dict->prefix;
-			prefix_len = dict->prefix_len;
+	if (argc > 3) {
+		return RedisModule_WrongArity(ctx);
+	}
+
+	if (strcasecmp(subcmd, "start") == 0) {
+		if (mig->running) {
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR migration already running");
 		}
-		if (dict->mem_compressed > 0) {
-			ratio = (double)dict->mem_uncompressed /
-				(double)dict->mem_compressed;
+		mig->running = 1;
+		mig->cursor = RedisModule_ScanCursorCreate();
+		mig->db = 0;
+		mig->started = RedisModule_Milliseconds();
+		mig->finished = 0;
+		mig->scanned = 0;
+		mig->migrated = 0;
+		mig->failed = 0;
+		mig->bytes_before = 0;
+		mig->bytes_after = 0;
+		mig->timer = RedisModule_CreateTimer(ctx, 0, migrate_timer_cb,
+		    mig);
+		return RedisModule_ReplyWithSimpleString(ctx, "OK");
+	}
+
+	if (strcasecmp(subcmd, "stop") == 0) {
+		if (!mig->running) {
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR no migration running");
 		}
+		(void) RedisModule_StopTimer(ctx, mig->timer, NULL);
+		migrate_stop(mig);
+		return RedisModule_ReplyWithSimpleString(ctx, "OK");
+	}
 
-		RedisModule_ReplyWithArray(ctx, 6);
-		RedisModule_ReplyWithLongLong(ctx, dict->id);
-		RedisModule_ReplyWithStringBuffer(ctx, prefix, prefix_len);
-		RedisModule_ReplyWithLongLong(ctx, dict->refcnt);
-		RedisModule_ReplyWithLongLong(ctx, dict->mem_uncompressed);
-		RedisModule_ReplyWithLongLong(ctx, dict->mem_compressed);
-		RedisModule_ReplyWithDouble(ctx, ratio);
+	if (strcasecmp(subcmd, "status") == 0) {
+		if (mig->started == 0) {
+			return RedisModule_ReplyWithNull(ctx);
+		}
+		RedisModule_ReplyWithArray(ctx, 7);
+		RedisModule_ReplyWithSimpleString(ctx,
+		    mig->running ? "running" : "done");
+		RedisModule_ReplyWithLongLong(ctx, mig->db);
+		RedisModule_ReplyWithLongLong(ctx, mig->scanned);
+		RedisModule_ReplyWithLongLong(ctx, mig->migrated);
+		RedisModule_ReplyWithLongLong(ctx, mig->failed);
+		RedisModule_ReplyWithLongLong(ctx,
+		    (long long)mig->bytes_before - (long long)mig->bytes_after);
+		RedisModule_ReplyWithLongLong(ctx, (mig->running ?
+		    RedisModule_Milliseconds() : mig->finished) - mig->started);
+		return REDISMODULE_OK;
 	}
-	RedisModule_DictIteratorStop(iter);
 
-	return REDISMODULE_OK;
+	return RedisModule_ReplyWithError(ctx,
+	    "ERR unknown subcommand, expected STOP or STATUS");
 }
 
 /*
@@ -767,9 +6651,16 @@ int DictCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 		"DICT subcommands are:",
 		"LIST                    -- List active dictionaries.",
 		"DUMP [<id>]             -- Dump the dictionary.",
-		"RESTORE <DICTBUF>       -- Restores the dictionary",
+		"RESTORE <DICTBUF> [ID <id>] [PREFIX <prefix>]",
+		"                        -- Restores the dictionary",
 		"DROP                    -- Drops the dictionary.",
-		"TRAIN [DICTSIZE <size>] -- Train a new dictionary.",
+		"TRAIN [DICTSIZE <size>] [PREFIX <prefix>] [ALGO <algo>]",
+		"      [THREADS <n>] [ASYNC]",
+		"                        -- Train a new dictionary.",
+		"STATUS                  -- Show the async training job.",
+		"CANCEL                  -- Cancel the async training job.",
+		"MIGRATE [STOP|STATUS]   -- Recompress objects onto the",
+		"                           current dictionaries.",
 	};
 
 	if (argc < 2) {
@@ -782,20 +6673,24 @@ int DictCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 	if (strcasecmp(str, "train") == 0) {
 		/* DICT TRAIN */
 		return DictTrainCommand(ctx, argv, argc);
-	} else if (strcasecmp(str, "restore") == 0) {
-		/* DICT RESTORE <dictBuffer> */
-		if (argc != 3) {
+	} else if (strcasecmp(str, "status") == 0) {
+		/* DICT STATUS */
+		if (argc != 2) {
 			return RedisModule_WrongArity(ctx);
 		}
-		size_t buflen;
-		const char *buf = RedisModule_StringPtrLen(argv[2], &buflen);
-
-		if (dict_create(&module, buf, buflen, NULL, 0,
-		    module.clevel) < 0) {
-			return RedisModule_ReplyWithError(ctx,
-			    "ERR dictionary failed");
+		return DictStatusCommand(ctx);
+	} else if (strcasecmp(str, "cancel") == 0) {
+		/* DICT CANCEL */
+		if (argc != 2) {
+			return RedisModule_WrongArity(ctx);
 		}
-		return RedisModule_ReplyWithSimpleString(ctx, "OK");
+		return DictCancelCommand(ctx);
+	} else if (strcasecmp(str, "migrate") == 0) {
+		/* DICT MIGRATE [STOP|STATUS] */
+		return DictMigrateCommand(ctx, argv, argc);
+	} else if (strcasecmp(str, "restore") == 0) {
+		/* DICT RESTORE <dictBuffer> [ID <id>] [PREFIX <prefix>] */
+		return DictRestoreCommand(ctx, argv, argc);
 	} else if (
 	    strcasecmp(str, "drop") == 0 ||
 	    strcasecmp(str, "dump") == 0) {
@@ -828,7 +6723,10 @@ int DictCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 		return DictDumpCommand(ctx, dict);
 	} else if (strcasecmp(str, "list") == 0) {
 		/* DICT LIST */
-		DictListCommand(ctx);
+		if (argc != 2) {
+			return RedisModule_WrongArity(ctx);
+		}
+		return DictListCommand(ctx);
 	} else if (strcasecmp(str, "help") == 0) {
 		/* DICT HELP */
 		size_t items = sizeof (help) / sizeof (help[0]);
@@ -843,12 +6741,284 @@ int DictCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 	    "Unknown subcommand. Try DICT HELP.");
 }
 
+void delimiters_changed(void) {
+	(void) memset(module.is_delim, 0, sizeof (module.is_delim));
+	for (const char *c = module.delimiters; *c != '\0'; c++)
+		module.is_delim[(unsigned char)*c] = 1;
+}
+
+struct config_opt *config_find(const char *name) {
+	const size_t nopts = sizeof (config_opts) / sizeof (config_opts[0]);
+
+	for (size_t i = 0; i < nopts; i++) {
+		if (strcasecmp(config_opts[i].name, name) == 0)
+			return &config_opts[i];
+	}
+	return NULL;
+}
+
+/*
+ * Set an option. Returns an error message on failure, or NULL.
+ */
+const char *config_set(const char *name, RedisModuleString *val,
+    int loading) {
+	struct config_opt *const opt = config_find(name);
+	long long v;
+
+	if (opt == NULL) {
+		return "ERR unknown option";
+	}
+	if (!loading && !opt->runtime) {
+		return "ERR option can only be set when loading the module";
+	}
+	if (opt->str != NULL) {
+		size_t len;
+		const char *const str = RedisModule_StringPtrLen(val, &len);
+
+		RedisModule_Free(*opt->str);
+		*opt->str = RedisModule_Alloc(len + 1);
+		(void) memcpy(*opt->str, str, len);
+		(*opt->str)[len] = '\0';
+	} else {
+		if (RedisModule_StringToLongLong(val, &v) != REDISMODULE_OK ||
+		    v < opt->min || v > opt->max) {
+			return "ERR invalid value";
+		}
+		*opt->value = v;
+	}
+	if (opt->changed != NULL) {
+		opt->changed();
+	}
+
+	return NULL;
+}
+
+/*
+ * CONFIG GET <option|*>
+ * CONFIG SET <option> <value>
+ */
+int ConfigCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc < 3) {
+		return RedisModule_WrongArity(ctx);
+	}
+
+	const char *const subcmd = RedisModule_StringPtrLen(argv[1], NULL);
+	const char *const name = RedisModule_StringPtrLen(argv[2], NULL);
+
+	if (strcasecmp(subcmd, "set") == 0) {
+		if (argc != 4) {
+			return RedisModule_WrongArity(ctx);
+		}
+		const char *const err = config_set(name, argv[3], 0);
+		if (err != NULL) {
+			return RedisModule_ReplyWithError(ctx, err);
+		}
+		return RedisModule_ReplyWithSimpleString(ctx, "OK");
+	}
+
+	if (strcasecmp(subcmd, "get") == 0) {
+		if (argc != 3) {
+			return RedisModule_WrongArity(ctx);
+		}
+		const size_t nopts = sizeof (config_opts) /
+		    sizeof (config_opts[0]);
+		long n = 0;
+
+		RedisModule_ReplyWithArray(ctx,
+		    REDISMODULE_POSTPONED_ARRAY_LEN);
+		for (size_t i = 0; i < nopts; i++) {
+			if (strcmp(name, "*") != 0 &&
+			    strcasecmp(name, config_opts[i].name) != 0)
+				continue;
+			RedisModule_ReplyWithSimpleString(ctx,
+			    config_opts[i].name);
+			if (config_opts[i].str != NULL) {
+				RedisModule_ReplyWithCString(ctx,
+				    *config_opts[i].str);
+			} else {
+				RedisModule_ReplyWithLongLong(ctx,
+				    *config_opts[i].value);
+			}
+			n += 2;
+		}
+		RedisModule_ReplySetArrayLength(ctx, n);
+		return REDISMODULE_OK;
+	}
+
+	return RedisModule_ReplyWithError(ctx,
+	    "ERR unknown subcommand, expected GET or SET");
+}
+
+/*
+ * Clear the latency histograms and the zstd counters of every dictionary.
+ */
+void stats_reset(void) {
+	(void) memset(module.latency, 0, sizeof (module.latency));
+	(void) memset(&module.codec, 0, sizeof (module.codec));
+
+	RedisModuleDictIter *const iter = RedisModule_DictIteratorStartC(
+	    module.all_dicts, "^", NULL, 0);
+	void *data;
+	while (RedisModule_DictNextC(iter, NULL, &data) != NULL) {
+		struct dict *const dict = data;
+
+		(void) memset(&dict->stats, 0, sizeof (dict->stats));
+	}
+	RedisModule_DictIteratorStop(iter);
+}
+
+void stats_reply_codec(RedisModuleCtx *ctx, long long id,
+    const struct codec_stats *st) {
+	RedisModule_ReplyWithArray(ctx, 8);
+	RedisModule_ReplyWithLongLong(ctx, id);
+	RedisModule_ReplyWithLongLong(ctx, st->compressions);
+	RedisModule_ReplyWithLongLong(ctx, st->bytes_in);
+	RedisModule_ReplyWithLongLong(ctx, st->bytes_out);
+	RedisModule_ReplyWithLongLong(ctx, st->compress_ns);
+	RedisModule_ReplyWithLongLong(ctx, st->decompressions);
+	RedisModule_ReplyWithLongLong(ctx, st->bytes_decompressed);
+	RedisModule_ReplyWithLongLong(ctx, st->decompress_ns);
+}
+
+/*
+ * STATS [RESET]
+ *
+ * Replies with the latency of each command, as name, calls, mean, p50,
+ * p99, p99.9 and max in nanoseconds, followed by the zstd counters of each
+ * dictionary. Work done without a dictionary is reported as ID 0.
+ */
+int StatsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+	if (argc > 2)
+		return RedisModule_WrongArity(ctx);
+
+	if (argc == 2) {
+		const char *const subcmd = RedisModule_StringPtrLen(argv[1],
+		    NULL);
+
+		if (strcasecmp(subcmd, "reset") != 0) {
+			return RedisModule_ReplyWithError(ctx,
+			    "ERR unknown subcommand, expected RESET");
+		}
+		stats_reset();
+		return RedisModule_ReplyWithSimpleString(ctx, "OK");
+	}
+
+	RedisModule_ReplyWithArray(ctx, 4);
+
+	RedisModule_ReplyWithSimpleString(ctx, "latency");
+	RedisModule_ReplyWithArray(ctx, STAT_NCMDS);
+	for (int i = 0; i < STAT_NCMDS; i++) {
+		const struct latency_hist *const h = &module.latency[i];
+
+		RedisModule_ReplyWithArray(ctx, 7);
+		RedisModule_ReplyWithSimpleString(ctx, stat_cmd_names[i]);
+		RedisModule_ReplyWithLongLong(ctx, h->count);
+		RedisModule_ReplyWithLongLong(ctx, h->count > 0 ?
+		    h->total_ns / h->count : 0);
+		RedisModule_ReplyWithLongLong(ctx, hist_quantile(h, 0.5));
+		RedisModule_ReplyWithLongLong(ctx, hist_quantile(h, 0.99));
+		RedisModule_ReplyWithLongLong(ctx, hist_quantile(h, 0.999));
+		RedisModule_ReplyWithLongLong(ctx, h->max_ns);
+	}
+
+	RedisModule_ReplyWithSimpleString(ctx, "dictionaries");
+	RedisModule_ReplyWithArray(ctx,
+	    RedisModule_DictSize(module.all_dicts) + 1);
+	stats_reply_codec(ctx, 0, &module.codec);
+
+	RedisModuleDictIter *const iter = RedisModule_DictIteratorStartC(
+	    module.all_dicts, "^", NULL, 0);
+	void *data;
+	while (RedisModule_DictNextC(iter, NULL, &data) != NULL) {
+		const struct dict *const dict = data;
+
+		stats_reply_codec(ctx, dict->id, &dict->stats);
+	}
+	RedisModule_DictIteratorStop(iter);
+
+	return REDISMODULE_OK;
+}
+
+void info_add_codec(RedisModuleInfoCtx *ictx, char *name,
+    const struct codec_stats *st) {
+	RedisModule_InfoBeginDictField(ictx, name);
+	RedisModule_InfoAddFieldULongLong(ictx, "compressions",
+	    st->compressions);
+	RedisModule_InfoAddFieldULongLong(ictx, "bytes_in", st->bytes_in);
+	RedisModule_InfoAddFieldULongLong(ictx, "bytes_out", st->bytes_out);
+	RedisModule_InfoAddFieldULongLong(ictx, "compress_ns",
+	    st->compress_ns);
+	RedisModule_InfoAddFieldULongLong(ictx, "decompressions",
+	    st->decompressions);
+	RedisModule_InfoAddFieldULongLong(ictx, "bytes_decompressed",
+	    st->bytes_decompressed);
+	RedisModule_InfoAddFieldULongLong(ictx, "decompress_ns",
+	    st->decompress_ns);
+	RedisModule_InfoEndDictField(ictx);
+}
+
+/*
+ * Latency and per-dictionary sections, one dict field per command or
+ * dictionary.
+ */
+void info_stats(RedisModuleInfoCtx *ictx) {
+	char name[32];
+
+	RedisModule_InfoAddSection(ictx, "latency");
+	for (int i = 0; i < STAT_NCMDS; i++) {
+		const struct latency_hist *const h = &module.latency[i];
+
+		(void) snprintf(name, sizeof (name), "%s", stat_cmd_names[i]);
+		RedisModule_InfoBeginDictField(ictx, name);
+		RedisModule_InfoAddFieldULongLong(ictx, "calls", h->count);
+		RedisModule_InfoAddFieldULongLong(ictx, "mean_ns",
+		    h->count > 0 ? h->total_ns / h->count : 0);
+		RedisModule_InfoAddFieldULongLong(ictx, "p50_ns",
+		    hist_quantile(h, 0.5));
+		RedisModule_InfoAddFieldULongLong(ictx, "p99_ns",
+		    hist_quantile(h, 0.99));
+		RedisModule_InfoAddFieldULongLong(ictx, "p999_ns",
+		    hist_quantile(h, 0.999));
+		RedisModule_InfoAddFieldULongLong(ictx, "max_ns", h->max_ns);
+		RedisModule_InfoEndDictField(ictx);
+	}
+
+	RedisModule_InfoAddSection(ictx, "dictionaries");
+	(void) snprintf(name, sizeof (name), "nodict");
+	info_add_codec(ictx, name, &module.codec);
+
+	RedisModuleDictIter *const iter = RedisModule_DictIteratorStartC(
+	    module.all_dicts, "^", NULL, 0);
+	void *data;
+	while (RedisModule_DictNextC(iter, NULL, &data) != NULL) {
+		const struct dict *const dict = data;
+
+		(void) snprintf(name, sizeof (name), "dict_%lld", dict->id);
+		info_add_codec(ictx, name, &dict->stats);
+	}
+	RedisModule_DictIteratorStop(iter);
+}
+
 void info_cb(RedisModuleInfoCtx *ictx, int for_crash_report) {
 	REDISMODULE_NOT_USED(for_crash_report);
 
 	double ratio = (double)module.mem_total_uncompressed /
 		(double)module.mem_total_compressed;
 	char buf[10];
+	size_t dict_memory = 0, ncdicts = 0, nddicts = 0;
+
+	RedisModuleDictIter *const iter = RedisModule_DictIteratorStartC(
+	    module.all_dicts, "^", NULL, 0);
+	void *data;
+	while (RedisModule_DictNextC(iter, NULL, &data) != NULL) {
+		const struct dict *const dict = data;
+
+		dict_memory += dict_mem(dict);
+		for (int i = 0; i < TUNE_NLEVELS; i++)
+			ncdicts += dict->cdicts[i] != NULL;
+		nddicts += dict->ddict != NULL;
+	}
+	RedisModule_DictIteratorStop(iter);
 
 	RedisModule_InfoAddSection(ictx, "stats");
 	RedisModule_InfoAddFieldULongLong(ictx, "zstd_version",
@@ -861,43 +7031,139 @@ void info_cb(RedisModuleInfoCtx *ictx, int for_crash_report) {
 	    module.mem_total_uncompressed);
 	RedisModule_InfoAddFieldULongLong(ictx, "objects",
 	    module.nobjs);
+	RedisModule_InfoAddFieldULongLong(ictx, "header_bytes_saved",
+	    module.nobjs * (ZIPSTR_HDR_V1 - sizeof (struct zipstr)));
+	RedisModule_InfoAddFieldULongLong(ictx, "frame_bytes_saved",
+	    module.frame_bytes_saved);
+	RedisModule_InfoAddFieldULongLong(ictx, "logs", module.nlogs);
+	RedisModule_InfoAddFieldULongLong(ictx, "log_tail_bytes",
+	    module.log_tail_bytes);
+	RedisModule_InfoAddFieldULongLong(ictx, "hashes", module.nhashes);
+	RedisModule_InfoAddFieldULongLong(ictx, "hash_fields",
+	    module.hash_fields);
+	RedisModule_InfoAddFieldULongLong(ictx, "hash_compressed_size",
+	    module.hash_mem_compressed);
+	RedisModule_InfoAddFieldULongLong(ictx, "hash_uncompressed_size",
+	    module.hash_mem_uncompressed);
 	RedisModule_InfoAddFieldULongLong(ictx, "dictionaries",
 	    RedisModule_DictSize(module.all_dicts));
+	RedisModule_InfoAddFieldULongLong(ictx, "dictionary_memory",
+	    dict_memory);
+	RedisModule_InfoAddFieldULongLong(ictx, "cdicts", ncdicts);
+	RedisModule_InfoAddFieldULongLong(ictx, "ddicts", nddicts);
+	RedisModule_InfoAddFieldULongLong(ictx, "skipped_small",
+	    module.nskipped[SKIP_SMALL]);
+	RedisModule_InfoAddFieldULongLong(ictx, "skipped_magic",
+	    module.nskipped[SKIP_MAGIC]);
+	RedisModule_InfoAddFieldULongLong(ictx, "skipped_entropy",
+	    module.nskipped[SKIP_ENTROPY]);
+	RedisModule_InfoAddFieldULongLong(ictx, "skipped_incompressible",
+	    module.nskipped[SKIP_INCOMPRESSIBLE]);
+	RedisModule_InfoAddFieldLongLong(ictx, "autotune", module.autotune);
+	RedisModule_InfoAddFieldLongLong(ictx, "level",
+	    tune_levels[module.tuner.step]);
+	RedisModule_InfoAddFieldULongLong(ictx, "offloaded",
+	    module.noffloaded);
+	RedisModule_InfoAddFieldULongLong(ictx, "offload_jobs",
+	    module.pool.njobs);
+	RedisModule_InfoAddFieldULongLong(ictx, "migrated",
+	    module.migrator.migrated);
+	RedisModule_InfoAddFieldULongLong(ictx, "cache_hits",
+	    module.cache.hits);
+	RedisModule_InfoAddFieldULongLong(ictx, "cache_misses",
+	    module.cache.misses);
+	RedisModule_InfoAddFieldULongLong(ictx, "cache_evictions",
+	    module.cache.evictions);
+	RedisModule_InfoAddFieldULongLong(ictx, "cache_entries",
+	    module.cache.nentries);
+	RedisModule_InfoAddFieldULongLong(ictx, "cache_bytes",
+	    module.cache.bytes);
+
+	if (module.stats)
+		info_stats(ictx);
 }
 
-int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-	REDISMODULE_NOT_USED(argv);
-	REDISMODULE_NOT_USED(argc);
+/*
+ * Reset the module state and apply the option defaults.
+ */
+void module_defaults(void) {
+	memset(&module, 0, sizeof (module));
+	module.offload_threshold = DEFAULT_OFFLOAD_THRESHOLD;
+	module.cpu_budget_us = DEFAULT_CPU_BUDGET_US;
+	module.min_size = DEFAULT_MIN_SIZE;
+	module.detect = 1;
+	module.max_entropy = DEFAULT_MAX_ENTROPY;
+	module.cache.admit = DEFAULT_CACHE_ADMIT;
+	module.ddict_idle_timeout = DEFAULT_DDICT_IDLE_TIMEOUT;
+	module.migrator.budget_ms = DEFAULT_MIGRATE_BUDGET_MS;
+	module.stats = 1;
+	module.train_samples = DEFAULT_MAX_NSAMPLES;
+	module.large.threshold = DEFAULT_LARGE_THRESHOLD;
+	module.large.workers = DEFAULT_LARGE_WORKERS;
+	module.large.window_log = DEFAULT_LARGE_WINDOW_LOG;
+	module.large.ldm = 1;
+	module.hash_max_packed_entries = DEFAULT_HASH_MAX_PACKED_ENTRIES;
+	module.hash_max_packed_value = DEFAULT_HASH_MAX_PACKED_VALUE;
+	module.main_thread = pthread_self();
+	pthread_mutex_init(&module.free_lock, NULL);
+	module.delimiters = RedisModule_Strdup(DEFAULT_DELIMITERS);
+	delimiters_changed();
+}
 
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 	if (RedisModule_Init(ctx, MODPREFIX, 1, REDISMODULE_APIVER_1) ==
 	    REDISMODULE_ERR) {
 		return REDISMODULE_ERR;
 	}
 
-	memset(&module, 0, sizeof (module));
-	module.buflen = BUFSIZE;
-	module.buf = RedisModule_Alloc(module.buflen);
-	module.clevel = ZSTD_CLEVEL_DEFAULT; 
+	module_defaults();
+
+	/* Options are given as <name> <value> pairs */
+	if ((argc % 2) != 0) {
+		RedisModule_Log(ctx, "warning",
+		    "Options must be name/value pairs");
+		return REDISMODULE_ERR;
+	}
+	for (int i = 0; i < argc; i += 2) {
+		const char *const name = RedisModule_StringPtrLen(argv[i],
+		    NULL);
+		const char *const err = config_set(name, argv[i + 1], 1);
+
+		if (err != NULL) {
+			RedisModule_Log(ctx, "warning", "%s: %s", name, err);
+			return REDISMODULE_ERR;
+		}
+	}
+
+	if (module.pool.nthreads > 0 &&
+	    worker_pool_start(&module.pool) != REDISMODULE_OK) {
+		return REDISMODULE_ERR;
+	}
+	module.clevel = ZSTD_CLEVEL_DEFAULT;
+	module.tuner.step = tune_step(module.clevel); 
 	module.dict = NULL;
 	module.cctx = ZSTD_createCCtx();
 	module.dctx = ZSTD_createDCtx();
 	module.all_dicts = RedisModule_CreateDict(ctx);
-	module.prefix_dicts = RedisModule_CreateDict(ctx);
-	module.set_filter = NULL;
-	module.set_str = RedisModule_CreateStringPrintf(ctx, "%s.set",
-	    MODPREFIX);
-	module.get_filter = NULL;
-	module.get_str = RedisModule_CreateStringPrintf(ctx, "%s.get",
-	    MODPREFIX);
+	module.filter = NULL;
+	if (filter_table_init(ctx) != 0) {
+		RedisModule_Log(ctx, "warning", "Filter table collision");
+		return REDISMODULE_ERR;
+	}
 
 	RedisModuleTypeMethods tm = {
 		.version = REDISMODULE_TYPE_METHOD_VERSION,
 		.rdb_save = zipstr_rdb_save,
 		.rdb_load = zipstr_rdb_load,
-		.aux_save_triggers = REDISMODULE_AUX_BEFORE_RDB,
+		.aof_rewrite = zipstr_aof_rewrite,
+		.aux_save_triggers = REDISMODULE_AUX_BEFORE_RDB |
+		    REDISMODULE_AUX_AFTER_RDB,
 		.aux_save = zipstr_aux_save,
 		.aux_load = zipstr_aux_load,
-		.free = zipstr_free
+		.mem_usage = zipstr_mem_usage,
+		.free = zipstr_free,
+		.free_effort = zipstr_free_effort,
+		.defrag = zipstr_defrag
 	};
 
 	ZipString_Type = RedisModule_CreateDataType(ctx, "ZipStr001",
@@ -905,7 +7171,29 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 	if (ZipString_Type == NULL)
 		return REDISMODULE_ERR;
 
+	/* Dictionaries are saved with the aux data of ZipStr001 */
+	RedisModuleTypeMethods htm = {
+		.version = REDISMODULE_TYPE_METHOD_VERSION,
+		.rdb_save = ziphash_rdb_save,
+		.rdb_load = ziphash_rdb_load,
+		.aof_rewrite = ziphash_aof_rewrite,
+		.mem_usage = ziphash_mem_usage,
+		.free = ziphash_free,
+		.free_effort = ziphash_free_effort,
+		.defrag = ziphash_defrag
+	};
+
+	ZipHash_Type = RedisModule_CreateDataType(ctx, "ZipHash01",
+	    ZIPHASH_ENCODING_VERSION, &htm);
+	if (ZipHash_Type == NULL)
+		return REDISMODULE_ERR;
+
 	RedisModule_RegisterInfoFunc(ctx, info_cb);
+	RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_Loading,
+	    loading_cb);
+
+	module.clock = RedisModule_Milliseconds() / 1000;
+	(void) RedisModule_CreateTimer(ctx, DICT_SWEEP_MS, dict_sweep_cb, NULL);
 
 	if (RedisModule_CreateCommand(ctx, MODPREFIX".set", SetCommand,
 	    "write", 1, 1, 1) == REDISMODULE_ERR) {
@@ -917,11 +7205,101 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 		return REDISMODULE_ERR;
 	}
 
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".getdel", GetDelCommand,
+	    "write fast", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".setraw", SetRawCommand,
+	    "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".mset", MSetCommand,
+	    "write", 1, -1, 2) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".mget", MGetCommand,
+	    "readonly", 1, -1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".getraw", GetRawCommand,
+	    "readonly fast", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".mgetraw",
+	    MGetRawCommand, "readonly", 1, -1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".getrange",
+	    GetRangeCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".strlen", StrlenCommand,
+	    "readonly fast", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".setrange",
+	    SetRangeCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".append", AppendCommand,
+	    "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".hset", HSetCommand,
+	    "write deny-oom fast", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".hsetraw",
+	    HSetRawCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".hget", HGetCommand,
+	    "readonly fast", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".hmget", HMGetCommand,
+	    "readonly fast", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".hgetall",
+	    HGetAllCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".hdel", HDelCommand,
+	    "write fast", 1, 1, 1) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
 	if (RedisModule_CreateCommand(ctx, MODPREFIX".dict", DictCommand,
 	    "admin", 0, 0, 0) == REDISMODULE_ERR) {
 		return REDISMODULE_ERR;
 	}
 
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".config", ConfigCommand,
+	    "admin", 0, 0, 0) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
+	if (RedisModule_CreateCommand(ctx, MODPREFIX".stats", StatsCommand,
+	    "admin", 0, 0, 0) == REDISMODULE_ERR) {
+		return REDISMODULE_ERR;
+	}
+
 	if (RedisModule_CreateCommand(ctx, MODPREFIX".transparent",
 	    TransparentCommand, "admin", 0, 0, 0) == REDISMODULE_ERR) {
 		return REDISMODULE_ERR;